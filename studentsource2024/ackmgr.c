@@ -0,0 +1,170 @@
+/**
+ * \author {AUTHOR}
+ */
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <limits.h>
+#include <pthread.h>
+#include "ackmgr.h"
+
+/**
+ * readings of one sensor that entered the gateway and are not acknowledged yet, in arrival order
+ */
+typedef struct pending {
+    uint32_t head;          /**< oldest reading */
+    uint32_t count;
+    uint32_t capacity;      /**< power of two */
+    sensor_ts_t *ts;
+    bool *done;             /**< stored or dropped, acknowledged once all readings before it are done too */
+    sensor_ts_t acked;      /**< last "persisted up to" sent to the sensor */
+} pending_t;
+
+/**
+ * ack to send after the lock is released
+ */
+typedef struct ack {
+    sensor_id_t sensor_id;
+    sensor_ts_t up_to;
+} ack_t;
+
+struct ackmgr {
+    ackmgr_send_fn_t send;
+    void *arg;
+    pthread_mutex_t mutex;                  /**< protects all pending readings */
+    pending_t *sensors[UINT16_MAX + 1];     /**< indexed on sensor id, allocated on the first reading of a sensor */
+};
+
+int ackmgr_init(ackmgr_t **ack, ackmgr_send_fn_t send, void *arg) {
+    if (ack == NULL || send == NULL) return ACKMGR_FAILURE;
+    ackmgr_t *a = calloc(1, sizeof(ackmgr_t));
+    if (a == NULL) return ACKMGR_FAILURE;
+    if (pthread_mutex_init(&a->mutex, NULL) != 0) {
+        free(a);
+        return ACKMGR_FAILURE;
+    }
+    a->send = send;
+    a->arg = arg;
+    *ack = a;
+    return ACKMGR_SUCCESS;
+}
+
+int ackmgr_received(ackmgr_t *ack, const sensor_data_t *reading) {
+    int result = ACKMGR_SUCCESS;
+
+    pthread_mutex_lock(&ack->mutex);
+    pending_t *p = ack->sensors[reading->id];
+    if (p == NULL) {
+        p = calloc(1, sizeof(pending_t));
+        if (p == NULL) {
+            pthread_mutex_unlock(&ack->mutex);
+            return ACKMGR_FAILURE;
+        }
+        p->acked = LONG_MIN;
+        ack->sensors[reading->id] = p;
+    }
+    if (p->count == p->capacity) {
+        uint32_t capacity = p->capacity ? 2 * p->capacity : 16;
+        sensor_ts_t *ts = malloc(capacity * sizeof(sensor_ts_t));
+        bool *done = malloc(capacity * sizeof(bool));
+        if (ts == NULL || done == NULL) {
+            free(ts);
+            free(done);
+            result = ACKMGR_FAILURE;
+        } else {
+            for (uint32_t i = 0; i < p->count; i++) {
+                ts[i] = p->ts[(p->head + i) & (p->capacity - 1)];
+                done[i] = p->done[(p->head + i) & (p->capacity - 1)];
+            }
+            free(p->ts);
+            free(p->done);
+            p->ts = ts;
+            p->done = done;
+            p->head = 0;
+            p->capacity = capacity;
+        }
+    }
+    if (result == ACKMGR_SUCCESS) {
+        uint32_t tail = (p->head + p->count) & (p->capacity - 1);
+        p->ts[tail] = reading->ts;
+        p->done[tail] = false;
+        p->count++;
+    }
+    pthread_mutex_unlock(&ack->mutex);
+    return result;
+}
+
+/**
+ * Marks the oldest pending reading of the sensor with timestamp 'ts' as done and moves the ack forward over the
+ * done readings at the head, the ack manager must be locked
+ * \return true if the sensor has to be told a new "persisted up to", which is then stored in 'up_to'
+ */
+static bool resolve(ackmgr_t *ack, sensor_id_t sensor_id, sensor_ts_t ts, sensor_ts_t *up_to) {
+    pending_t *p = ack->sensors[sensor_id];
+    if (p == NULL) return false;    // Never registered, e.g. the ack mode was enabled while running
+
+    for (uint32_t i = 0; i < p->count; i++) {
+        uint32_t slot = (p->head + i) & (p->capacity - 1);
+        if (!p->done[slot] && p->ts[slot] == ts) {
+            p->done[slot] = true;
+            break;
+        }
+    }
+    if (p->count == 0 || !p->done[p->head]) return false;
+
+    sensor_ts_t last = LONG_MIN;
+    while (p->count > 0 && p->done[p->head]) {
+        last = p->ts[p->head];
+        p->head = (p->head + 1) & (p->capacity - 1);
+        p->count--;
+    }
+    // A pending reading with the same timestamp is not covered yet
+    if (p->count > 0 && p->ts[p->head] <= last) last = p->ts[p->head] - 1;
+    if (last <= p->acked) return false;
+    p->acked = last;
+    *up_to = last;
+    return true;
+}
+
+void ackmgr_dropped(ackmgr_t *ack, const sensor_data_t *reading) {
+    sensor_ts_t up_to;
+
+    pthread_mutex_lock(&ack->mutex);
+    bool advanced = resolve(ack, reading->id, reading->ts, &up_to);
+    pthread_mutex_unlock(&ack->mutex);
+    if (advanced) ack->send(ack->arg, reading->id, up_to);
+}
+
+void ackmgr_committed(ackmgr_t *ack, const sensor_block_t *block) {
+    ack_t acks[SENSOR_BLOCK_CAPACITY];
+    int num_acks = 0;
+    sensor_ts_t up_to;
+
+    // Batch the acks: one per sensor for the whole commit, with the furthest point reached
+    pthread_mutex_lock(&ack->mutex);
+    for (uint32_t i = 0; i < block->count; i++) {
+        if (!resolve(ack, block->id[i], block->ts[i], &up_to)) continue;
+        int a;
+        for (a = 0; a < num_acks && acks[a].sensor_id != block->id[i]; a++);
+        if (a == num_acks) num_acks++;
+        acks[a] = (ack_t){block->id[i], up_to};
+    }
+    pthread_mutex_unlock(&ack->mutex);
+
+    for (int a = 0; a < num_acks; a++) ack->send(ack->arg, acks[a].sensor_id, acks[a].up_to);
+}
+
+int ackmgr_free(ackmgr_t **ack) {
+    if (ack == NULL || *ack == NULL) return ACKMGR_FAILURE;
+    for (int i = 0; i <= UINT16_MAX; i++) {
+        pending_t *p = (*ack)->sensors[i];
+        if (p == NULL) continue;
+        free(p->ts);
+        free(p->done);
+        free(p);
+    }
+    pthread_mutex_destroy(&(*ack)->mutex);
+    free(*ack);
+    *ack = NULL;
+    return ACKMGR_SUCCESS;
+}
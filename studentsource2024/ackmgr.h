@@ -0,0 +1,68 @@
+/**
+ * \author {AUTHOR}
+ */
+
+#ifndef _ACKMGR_H_
+#define _ACKMGR_H_
+
+#include "config.h"
+
+#define ACKMGR_FAILURE -1
+#define ACKMGR_SUCCESS 0
+
+/*
+ * Persistence acknowledgements: every sensor node has one connection and stamps its readings with increasing
+ * timestamps, so the timestamp serves as the sequence number of a reading on its connection. The ack manager
+ * tracks, per sensor, the readings that entered the gateway and were not stored (or dropped) yet. Once every
+ * reading up to timestamp N is stored, the sensor is told "persisted up to N" and may discard those readings.
+ * Acks are cumulative and only sent when they advance, so one storage commit yields at most one ack per sensor.
+ */
+
+typedef struct ackmgr ackmgr_t;
+
+/**
+ * Sends "persisted up to 'up_to'" to the connection of 'sensor_id', called without any lock of the ack manager held
+ * Two commits finishing at the same time may deliver the acks of a sensor out of order, the receiver keeps the highest.
+ */
+typedef void (*ackmgr_send_fn_t)(void *arg, sensor_id_t sensor_id, sensor_ts_t up_to);
+
+/**
+ * Allocates an ack manager
+ * \param ack a double pointer to the ack manager that needs to be initialized
+ * \param send called for every ack
+ * \param arg passed to 'send'
+ * \return ACKMGR_SUCCESS on success and ACKMGR_FAILURE if an error occurred
+ */
+int ackmgr_init(ackmgr_t **ack, ackmgr_send_fn_t send, void *arg);
+
+/**
+ * Registers a reading that entered the gateway, readings of one sensor must be registered in arrival order
+ * \param ack a pointer to the ack manager that is used
+ * \param reading the reading
+ * \return ACKMGR_SUCCESS on success and ACKMGR_FAILURE if an error occurred
+ */
+int ackmgr_received(ackmgr_t *ack, const sensor_data_t *reading);
+
+/**
+ * Resolves a reading that will never be stored on purpose (e.g. a dropped duplicate), it no longer holds back acks
+ * \param ack a pointer to the ack manager that is used
+ * \param reading the reading
+ */
+void ackmgr_dropped(ackmgr_t *ack, const sensor_data_t *reading);
+
+/**
+ * Resolves all readings of a block after the group commit that made it durable and sends the acks that advanced
+ * A block that failed to commit must not be passed: its readings hold back the acks of their sensors for good.
+ * \param ack a pointer to the ack manager that is used
+ * \param block the committed readings
+ */
+void ackmgr_committed(ackmgr_t *ack, const sensor_block_t *block);
+
+/**
+ * All allocated resources are freed and cleaned up
+ * \param ack a double pointer to the ack manager that needs to be freed
+ * \return ACKMGR_SUCCESS on success and ACKMGR_FAILURE if an error occurred
+ */
+int ackmgr_free(ackmgr_t **ack);
+
+#endif  //_ACKMGR_H_
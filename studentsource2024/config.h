@@ -6,11 +6,14 @@
 #define _CONFIG_H_
 
 #include <stdint.h>
+#include <stdbool.h>
+#include <float.h>
 #include <time.h>
 
 typedef uint16_t sensor_id_t;
 typedef double sensor_value_t;
 typedef time_t sensor_ts_t;         // UTC timestamp as returned by time() - notice that the size of time_t is different on 32/64 bit machine
+typedef uint16_t room_id_t;
 
 typedef struct {
     sensor_id_t id;
@@ -18,4 +21,112 @@ typedef struct {
     sensor_ts_t ts;
 } sensor_data_t;
 
+/**
+ * Frames the gateway sends back on a sensor connection, each one sensor_ts_t in host byte order like the readings:
+ *  >= 0  ack (ACK_MODE): every reading up to this timestamp is persisted
+ *  < 0   flow control, SENSOR_FLOW_FRAME(level): the node sends at its own rate (GO), measures less often and sends
+ *        its readings in batches (SLOW), or stops measuring until the next flow frame (PAUSE)
+ * A new connection starts at SENSOR_FLOW_GO.
+ */
+typedef enum {
+    SENSOR_FLOW_GO,
+    SENSOR_FLOW_SLOW,
+    SENSOR_FLOW_PAUSE
+} sensor_flow_t;
+
+#define SENSOR_FLOW_FRAME(level) (-1 - (sensor_ts_t)(level))
+#define SENSOR_FLOW_LEVEL(frame) ((sensor_flow_t)(-1 - (frame)))
+
+#ifndef SENSOR_BLOCK_CAPACITY
+#define SENSOR_BLOCK_CAPACITY 64    // Maximum number of readings in one sensor_block_t, also what a consumer drains from a queue at once
+#endif
+
+/**
+ * A block of readings stored column by column (struct-of-arrays) instead of as an array of sensor_data_t
+ * Reading i is {id[i], value[i], ts[i]}, only the first 'count' entries of every column are valid.
+ * Loops over one field (threshold checks, aggregation, ...) then stream over one contiguous column.
+ * The room column is filled in by the 'enrich' stage and only valid while 'has_room' is set: the queues between thread
+ * groups carry sensor_data_t, so the rooms are lost at the next queue.
+ */
+typedef struct {
+    sensor_value_t value[SENSOR_BLOCK_CAPACITY];
+    sensor_ts_t ts[SENSOR_BLOCK_CAPACITY];
+    sensor_id_t id[SENSOR_BLOCK_CAPACITY];
+    room_id_t room[SENSOR_BLOCK_CAPACITY];
+    uint32_t count;
+    bool has_room;
+} sensor_block_t;
+
+/**
+ * Optional compact in-memory form of a reading, used for the readings waiting in the sbuffer
+ * Select it at compile time with -DSENSOR_COMPACT=16 or -DSENSOR_COMPACT=8; sensor_data_t stays the type of every API,
+ * readings are packed when they enter the buffer and unpacked when they leave it.
+ * The timestamp is stored relative to a base timestamp kept by the owner of the compact readings.
+ *  16: double value, 32-bit ts delta, 16-bit id  -> 16 bytes, lossless for timestamps within +-68 years of the base
+ *   8: float value, 16-bit ts delta, 16-bit id   ->  8 bytes, timestamps within +-9 hours of the base. The value is
+ *                                                    rounded to float: ~7 significant digits, e.g. 21.37 comes back
+ *                                                    as 21.3700008; values beyond the float range are not compact
+ * A reading without a compact form is not dropped: its owner stores it in full and marks the compact slot with
+ * SENSOR_TS_DELTA_ESCAPE, a delta sensor_data_pack() never produces.
+ */
+#if defined(SENSOR_COMPACT) && SENSOR_COMPACT == 16
+typedef int32_t sensor_ts_delta_t;
+typedef struct {
+    sensor_value_t value;
+    sensor_ts_delta_t ts_delta;
+    sensor_id_t id;
+    uint16_t reserved;
+} sensor_data_compact_t;
+#elif defined(SENSOR_COMPACT) && SENSOR_COMPACT == 8
+typedef int16_t sensor_ts_delta_t;
+typedef struct {
+    float value;
+    sensor_id_t id;
+    sensor_ts_delta_t ts_delta;
+} sensor_data_compact_t;
+#elif defined(SENSOR_COMPACT)
+#error SENSOR_COMPACT must be 16 or 8
+#endif
+
+#ifdef SENSOR_COMPACT
+_Static_assert(sizeof(sensor_data_compact_t) == SENSOR_COMPACT, "unexpected padding in sensor_data_compact_t");
+
+#define SENSOR_TS_DELTA_ESCAPE ((sensor_ts_delta_t)(SENSOR_COMPACT == 16 ? INT32_MIN : INT16_MIN))
+#define SENSOR_TS_DELTA_MIN ((sensor_ts_t)SENSOR_TS_DELTA_ESCAPE + 1)
+#define SENSOR_TS_DELTA_MAX ((sensor_ts_t)(SENSOR_COMPACT == 16 ? INT32_MAX : INT16_MAX))
+#define SENSOR_COMPACT_VALUE_MAX (SENSOR_COMPACT == 16 ? DBL_MAX : (double)FLT_MAX)
+
+/**
+ * Converts a reading to its compact form
+ * \param data the reading to convert
+ * \param base the base timestamp the delta is computed against
+ * \param packed the compact reading that is filled in
+ * \return 0 on success, -1 if the timestamp is too far from 'base' or the value out of range to be represented
+ */
+static inline int sensor_data_pack(const sensor_data_t *data, sensor_ts_t base, sensor_data_compact_t *packed) {
+    sensor_ts_t delta = data->ts - base;
+    if (delta < SENSOR_TS_DELTA_MIN || delta > SENSOR_TS_DELTA_MAX) return -1;
+    if (data->value > SENSOR_COMPACT_VALUE_MAX || data->value < -SENSOR_COMPACT_VALUE_MAX) return -1;
+    packed->value = data->value;
+    packed->ts_delta = (sensor_ts_delta_t)delta;
+    packed->id = data->id;
+#if SENSOR_COMPACT == 16
+    packed->reserved = 0;
+#endif
+    return 0;
+}
+
+/**
+ * Converts a compact reading back to a sensor_data_t
+ * \param packed the compact reading
+ * \param base the base timestamp that was used by sensor_data_pack()
+ * \param data the reading that is filled in
+ */
+static inline void sensor_data_unpack(const sensor_data_compact_t *packed, sensor_ts_t base, sensor_data_t *data) {
+    data->id = packed->id;
+    data->value = packed->value;
+    data->ts = base + packed->ts_delta;
+}
+#endif
+
 #endif /* _CONFIG_H_ */
@@ -0,0 +1,387 @@
+/**
+ * \author {AUTHOR}
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <unistd.h>
+#include <inttypes.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "config.h"
+
+#ifndef TIMEOUT
+#error TIMEOUT not set
+#endif
+
+#define SEND_INTERVAL ((double)TIMEOUT / 2) // Seconds between two readings of one connection, well inside the gateway timeout
+#define CONNECT_DEADLINE 10.0   // Seconds a step waits for its connects to complete
+#define IDLE_GRACE 3            // The idle phase waits up to this many times TIMEOUT for the gateway to close everything
+#define MAX_EVENTS 256          // Events handled per epoll_wait call
+#define TICK_MS 10              // Longest epoll_wait, the resolution of the trickle and of the measured close times
+#define WIRE_SIZE (sizeof(sensor_id_t) + sizeof(sensor_value_t) + sizeof(sensor_ts_t))
+
+/**
+ * one simulated sensor node: a non-blocking connection that sends a reading every SEND_INTERVAL seconds
+ */
+typedef struct conn {
+    int fd;
+    sensor_id_t id;
+    bool connected;
+    bool closed;                /**< failed to connect, closed by the gateway or broken */
+    double next_send;
+    double last_send;
+    double closed_at;           /**< when the gateway closed the connection */
+    sensor_ts_t unacked_ts;     /**< timestamp of the reading whose ack is timed, 0 when none is */
+    double unacked_sent;        /**< when that reading was sent */
+    unsigned char ack_bytes[sizeof(sensor_ts_t)];   /**< partially received ack */
+    int ack_received;
+} conn_t;
+
+typedef struct bench_stats {
+    int connecting;             /**< connects that did not complete yet */
+    int connected;              /**< connects of the current step that completed */
+    int failed;                 /**< connects of the current step that failed */
+    int dropped;                /**< connections the gateway closed while they were sending */
+    uint64_t acks;              /**< timed acks since the start of the step */
+    double ack_sum;
+    double ack_max;
+} bench_stats_t;
+
+static sensor_id_t *sensor_ids = NULL;
+static int num_sensor_ids = 0;
+
+static double now(void) {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+/**
+ * Resident set size of process 'pid' in kB, -1 when it can't be read
+ */
+static long rss_kb(pid_t pid) {
+    char path[64], line[256];
+    long kb = -1;
+
+    snprintf(path, sizeof(path), "/proc/%d/status", (int)pid);
+    FILE *fp = fopen(path, "r");
+    if (fp == NULL) return -1;
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        if (sscanf(line, "VmRSS: %ld", &kb) == 1) break;
+    }
+    fclose(fp);
+    return kb;
+}
+
+/**
+ * Pages the kernel holds in TCP socket buffers system-wide, -1 when it can't be read
+ */
+static long tcp_mem_pages(void) {
+    char line[256];
+    long inuse, orphan, tw, alloc, mem = -1;
+
+    FILE *fp = fopen("/proc/net/sockstat", "r");
+    if (fp == NULL) return -1;
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        if (sscanf(line, "TCP: inuse %ld orphan %ld tw %ld alloc %ld mem %ld", &inuse, &orphan, &tw, &alloc, &mem) == 5) break;
+    }
+    fclose(fp);
+    return mem;
+}
+
+/**
+ * Uses the sensor ids of room_sensor.map when it is in the working directory, so the gateway knows the readings
+ */
+static void load_sensor_ids(void) {
+    int room, sensor, capacity = 0;
+
+    FILE *fp = fopen("room_sensor.map", "r");
+    if (fp == NULL) return;
+    while (fscanf(fp, "%d %d", &room, &sensor) == 2) {
+        if (num_sensor_ids == capacity) {
+            capacity = capacity ? 2 * capacity : 16;
+            sensor_id_t *ids = realloc(sensor_ids, capacity * sizeof(sensor_id_t));
+            if (ids == NULL) break;
+            sensor_ids = ids;
+        }
+        sensor_ids[num_sensor_ids++] = (sensor_id_t)sensor;
+    }
+    fclose(fp);
+}
+
+static void conn_close(conn_t *c, int ep, double t) {
+    epoll_ctl(ep, EPOLL_CTL_DEL, c->fd, NULL);
+    close(c->fd);
+    c->closed = true;
+    c->closed_at = t;
+}
+
+static int start_connect(conn_t *c, const struct sockaddr_in *addr, int ep, double t, bench_stats_t *stats) {
+    c->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (c->fd < 0) return -1;
+    if (connect(c->fd, (const struct sockaddr *)addr, sizeof(*addr)) < 0 && errno != EINPROGRESS) {
+        close(c->fd);
+        return -1;
+    }
+    struct epoll_event ev = {.events = EPOLLOUT | EPOLLIN | EPOLLRDHUP, .data.ptr = c};
+    if (epoll_ctl(ep, EPOLL_CTL_ADD, c->fd, &ev) < 0) {
+        close(c->fd);
+        return -1;
+    }
+    // Spread the first readings over the interval so the trickle is even
+    c->next_send = t + SEND_INTERVAL * drand48();
+    stats->connecting++;
+    return 0;
+}
+
+/**
+ * Reads the "persisted up to" acks of a gateway in ack mode, the first ack covering the timed reading gives its latency
+ * \return false when the gateway closed the connection
+ */
+static bool read_acks(conn_t *c, double t, bench_stats_t *stats) {
+    for (;;) {
+        ssize_t got = recv(c->fd, c->ack_bytes + c->ack_received, sizeof(c->ack_bytes) - c->ack_received, 0);
+        if (got == 0) return false;
+        if (got < 0) return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+        c->ack_received += got;
+        if (c->ack_received < (int)sizeof(c->ack_bytes)) continue;
+        c->ack_received = 0;
+
+        sensor_ts_t up_to;
+        memcpy(&up_to, c->ack_bytes, sizeof(up_to));
+        if (c->unacked_ts != 0 && up_to >= c->unacked_ts) {
+            double latency = t - c->unacked_sent;
+            stats->acks++;
+            stats->ack_sum += latency;
+            if (latency > stats->ack_max) stats->ack_max = latency;
+            c->unacked_ts = 0;
+        }
+    }
+}
+
+static void handle_event(conn_t *c, uint32_t events, int ep, double t, bench_stats_t *stats) {
+    if (c->closed) return;
+
+    if (!c->connected) {
+        int error = 0;
+        socklen_t len = sizeof(error);
+        if (!(events & (EPOLLOUT | EPOLLERR | EPOLLHUP))) return;
+        stats->connecting--;
+        if (getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &error, &len) < 0 || error != 0) {
+            stats->failed++;
+            conn_close(c, ep, t);
+            return;
+        }
+        c->connected = true;
+        stats->connected++;
+        struct epoll_event ev = {.events = EPOLLIN | EPOLLRDHUP, .data.ptr = c};
+        epoll_ctl(ep, EPOLL_CTL_MOD, c->fd, &ev);
+        return;
+    }
+
+    if (!read_acks(c, t, stats) || (events & (EPOLLERR | EPOLLHUP))) {
+        conn_close(c, ep, t);
+        stats->dropped++;
+    }
+}
+
+/**
+ * Sends the readings that are due, in the order the gateway expects: <sensor_id><temperature><timestamp>
+ */
+static void send_due(conn_t *conns, int n, int ep, double t, bench_stats_t *stats) {
+    unsigned char frame[WIRE_SIZE];
+
+    for (int i = 0; i < n; i++) {
+        conn_t *c = &conns[i];
+        if (!c->connected || c->closed || c->next_send > t) continue;
+
+        sensor_data_t data = {c->id, 15.0 + 10.0 * drand48(), time(NULL)};
+        memcpy(frame, &data.id, sizeof(data.id));
+        memcpy(frame + sizeof(data.id), &data.value, sizeof(data.value));
+        memcpy(frame + sizeof(data.id) + sizeof(data.value), &data.ts, sizeof(data.ts));
+        if (send(c->fd, frame, sizeof(frame), MSG_NOSIGNAL | MSG_DONTWAIT) != (ssize_t)sizeof(frame)) {
+            conn_close(c, ep, t);
+            stats->dropped++;
+            continue;
+        }
+        c->last_send = t;
+        c->next_send += SEND_INTERVAL;
+        if (c->unacked_ts == 0) {
+            c->unacked_ts = data.ts;
+            c->unacked_sent = t;
+        }
+    }
+}
+
+/**
+ * Handles connection events (and sends the trickle when 'sending') until 'until', or earlier once every connect
+ * completed when 'until_connected' is set
+ */
+static void pump(int ep, conn_t *conns, int n, double until, bool sending, bool until_connected, bench_stats_t *stats) {
+    struct epoll_event events[MAX_EVENTS];
+    double t;
+
+    while ((t = now()) < until) {
+        if (until_connected && stats->connecting == 0) return;
+        int ready = epoll_wait(ep, events, MAX_EVENTS, TICK_MS);
+        t = now();
+        for (int i = 0; i < ready; i++) handle_event(events[i].data.ptr, events[i].events, ep, t, stats);
+        if (sending) send_due(conns, n, ep, t, stats);
+    }
+}
+
+void print_help(void);
+
+/**
+ * Connection scaling benchmark: opens a growing number of mostly idle sensor connections to a running gateway
+ *
+ * Every 'step' connections it reports how fast they were set up, what one connection costs in memory and, for a
+ * gateway in ack mode, how long a reading takes to get acknowledged. At the end all connections go quiet and the
+ * time the gateway takes to close them is compared to TIMEOUT.
+ * The connect rate is measured at the client: a connect completes when the kernel queued it on the listening
+ * socket, so once that backlog is full it is bounded by how fast the gateway accepts.
+ * Kernel memory is the system-wide TCP buffer memory, on a single host it covers both ends of every connection.
+ *
+ * argv[1] = server IP
+ * argv[2] = server port
+ * argv[3] = number of connections
+ * argv[4] = (optional) connections added per step, defaults to all at once
+ * argv[5] = (optional) process ID of the gateway, for its memory use
+ */
+int main(int argc, char *argv[]) {
+    struct sockaddr_in addr = {.sin_family = AF_INET};
+    bench_stats_t stats = {0};
+    pid_t gateway = 0;
+
+    if (argc < 4 || argc > 6 || inet_pton(AF_INET, argv[1], &addr.sin_addr) != 1) {
+        print_help();
+        exit(EXIT_SUCCESS);
+    }
+    addr.sin_port = htons(atoi(argv[2]));
+    int total = atoi(argv[3]);
+    int step = argc > 4 ? atoi(argv[4]) : total;
+    if (argc > 5) gateway = atoi(argv[5]);
+    if (total <= 0 || step <= 0) {
+        print_help();
+        exit(EXIT_FAILURE);
+    }
+
+    // One descriptor per connection plus a few for epoll and /proc
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < (rlim_t)total + 16) {
+        limit.rlim_cur = limit.rlim_max < (rlim_t)total + 16 ? limit.rlim_max : (rlim_t)total + 16;
+        setrlimit(RLIMIT_NOFILE, &limit);
+        if (limit.rlim_cur < (rlim_t)total + 16) {
+            fprintf(stderr, "Warning: the descriptor limit (%ld) allows fewer than %d connections\n", (long)limit.rlim_cur, total);
+        }
+    }
+
+    conn_t *conns = calloc(total, sizeof(conn_t));
+    int ep = epoll_create1(0);
+    if (conns == NULL || ep < 0) {
+        fprintf(stderr, "Error: Could not set up %d connections\n", total);
+        exit(EXIT_FAILURE);
+    }
+    srand48(time(NULL));
+    load_sensor_ids();
+    for (int i = 0; i < total; i++) {
+        conns[i].id = num_sensor_ids > 0 ? sensor_ids[i % num_sensor_ids] : (sensor_id_t)(i % UINT16_MAX + 1);
+    }
+
+    long rss_base = gateway > 0 ? rss_kb(gateway) : -1;
+    long mem_base = tcp_mem_pages();
+    long page = sysconf(_SC_PAGESIZE);
+    int open = 0;
+
+    printf("%8s %10s %7s %8s %12s %15s %11s %11s\n", "conns", "connect/s", "failed", "dropped",
+           "gw B/conn", "kernel B/conn", "ack avg ms", "ack max ms");
+    for (int opened = 0; opened < total; opened += step) {
+        int batch = total - opened < step ? total - opened : step;
+        stats.connected = stats.failed = stats.dropped = 0;
+        stats.acks = 0;
+        stats.ack_sum = stats.ack_max = 0;
+
+        double start = now();
+        for (int i = opened; i < opened + batch; i++) {
+            if (start_connect(&conns[i], &addr, ep, start, &stats) != 0) {
+                conns[i].closed = true;
+                stats.failed++;
+            }
+        }
+        pump(ep, conns, opened + batch, start + CONNECT_DEADLINE, true, true, &stats);
+        double elapsed = now() - start;
+        open += stats.connected;
+
+        // Let every connection send a few readings before the sample is taken
+        pump(ep, conns, opened + batch, now() + TIMEOUT, true, false, &stats);
+        open -= stats.dropped;
+        long rss = gateway > 0 ? rss_kb(gateway) : -1;
+        long mem = tcp_mem_pages();
+
+        printf("%8d %10.0f %7d %8d ", open, stats.connected / elapsed, stats.failed + stats.connecting, stats.dropped);
+        if (rss >= 0 && rss_base >= 0 && open > 0) printf("%12.0f ", (rss - rss_base) * 1024.0 / open);
+        else printf("%12s ", "-");
+        if (mem >= 0 && mem_base >= 0 && open > 0) printf("%15.0f ", (double)(mem - mem_base) * page / open);
+        else printf("%15s ", "-");
+        if (stats.acks > 0) printf("%11.1f %11.1f\n", stats.ack_sum / stats.acks * 1000, stats.ack_max * 1000);
+        else printf("%11s %11s\n", "-", "-");
+        fflush(stdout);
+    }
+
+    // Go quiet and time how long after its last reading the gateway closes every connection
+    double idle_start = now();
+    stats.dropped = 0;
+    pump(ep, conns, total, idle_start + IDLE_GRACE * TIMEOUT, false, false, &stats);
+    int closed = 0, still_open = 0;
+    double err_sum = 0, err_min = 0, err_max = 0;
+    for (int i = 0; i < total; i++) {
+        conn_t *c = &conns[i];
+        if (!c->connected || (c->closed && c->closed_at < idle_start)) continue;
+        if (!c->closed) {
+            still_open++;
+            continue;
+        }
+        double err = c->closed_at - c->last_send - TIMEOUT;
+        if (closed == 0 || err < err_min) err_min = err;
+        if (closed == 0 || err > err_max) err_max = err;
+        err_sum += err;
+        closed++;
+    }
+    printf("Timeout: %d connections closed after going idle, %d still open after %d s\n",
+           closed, still_open, IDLE_GRACE * TIMEOUT);
+    if (closed > 0) {
+        printf("Timeout: closed %+.0f ms after TIMEOUT on average, min %+.0f ms, max %+.0f ms (resolution %d ms)\n",
+               err_sum / closed * 1000, err_min * 1000, err_max * 1000, TICK_MS);
+    }
+
+    for (int i = 0; i < total; i++) {
+        if (conns[i].connected && !conns[i].closed) close(conns[i].fd);
+    }
+    close(ep);
+    free(conns);
+    free(sensor_ids);
+    exit(EXIT_SUCCESS);
+}
+
+/**
+ * Helper method to print a message on how to use this application
+ */
+void print_help(void) {
+    printf("Use this program with the following command line options: \n");
+    printf("\t%-15s : TCP server IP address of the gateway\n", "\'server IP\'");
+    printf("\t%-15s : TCP server port number\n", "\'server port\'");
+    printf("\t%-15s : number of sensor connections to open\n", "\'connections\'");
+    printf("\t%-15s : (optional) connections added per step, defaults to all at once\n", "\'step\'");
+    printf("\t%-15s : (optional) process ID of the gateway, to report its memory per connection\n", "\'gateway pid\'");
+}
@@ -0,0 +1,72 @@
+/**
+ * \author {AUTHOR}
+ */
+
+#include <string.h>
+#include <pthread.h>
+#include "crc32c.h"
+
+#define CRC32C_POLY 0x82F63B78u     // Castagnoli polynomial, bit reflected
+
+static uint32_t table[8][256];      // table[k][b]: checksum of byte b followed by k zero bytes
+static uint32_t (*crc32c_impl)(uint32_t crc, const unsigned char *p, size_t len);
+static pthread_once_t init_once = PTHREAD_ONCE_INIT;
+
+/**
+ * Slicing-by-8: eight table lookups per 8 bytes instead of eight dependent shifts
+ */
+static uint32_t crc32c_sw(uint32_t crc, const unsigned char *p, size_t len) {
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    for (; len >= 8; p += 8, len -= 8) {
+        uint64_t word;
+        memcpy(&word, p, sizeof(word));
+        word ^= crc;
+        crc = table[7][word & 0xff] ^ table[6][(word >> 8) & 0xff] ^
+              table[5][(word >> 16) & 0xff] ^ table[4][(word >> 24) & 0xff] ^
+              table[3][(word >> 32) & 0xff] ^ table[2][(word >> 40) & 0xff] ^
+              table[1][(word >> 48) & 0xff] ^ table[0][word >> 56];
+    }
+#endif
+    for (; len > 0; p++, len--) crc = table[0][(crc ^ *p) & 0xff] ^ (crc >> 8);
+    return crc;
+}
+
+#if defined(__x86_64__) && defined(__GNUC__)
+/**
+ * SSE4.2 crc32 instruction, 8 bytes at a time; compiled for SSE4.2 but only called when the CPU has it
+ */
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_hw(uint32_t crc, const unsigned char *p, size_t len) {
+    uint64_t crc64 = crc;
+    for (; len >= 8; p += 8, len -= 8) {
+        uint64_t word;
+        memcpy(&word, p, sizeof(word));
+        crc64 = __builtin_ia32_crc32di(crc64, word);
+    }
+    crc = (uint32_t)crc64;
+    for (; len > 0; p++, len--) crc = __builtin_ia32_crc32qi(crc, *p);
+    return crc;
+}
+#endif
+
+static void crc32c_init(void) {
+    for (uint32_t b = 0; b < 256; b++) {
+        uint32_t crc = b;
+        for (int bit = 0; bit < 8; bit++) crc = (crc >> 1) ^ (CRC32C_POLY & -(crc & 1));
+        table[0][b] = crc;
+    }
+    for (uint32_t b = 0; b < 256; b++) {
+        for (int k = 1; k < 8; k++) table[k][b] = (table[k - 1][b] >> 8) ^ table[0][table[k - 1][b] & 0xff];
+    }
+
+    crc32c_impl = crc32c_sw;
+#if defined(__x86_64__) && defined(__GNUC__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse4.2")) crc32c_impl = crc32c_hw;
+#endif
+}
+
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len) {
+    pthread_once(&init_once, crc32c_init);
+    return ~crc32c_impl(~crc, buf, len);
+}
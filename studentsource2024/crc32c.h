@@ -0,0 +1,21 @@
+/**
+ * \author {AUTHOR}
+ */
+
+#ifndef _CRC32C_H_
+#define _CRC32C_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Computes the CRC32C (Castagnoli) checksum of a buffer, continuing from 'crc' (0 for a new checksum)
+ * Uses the SSE4.2 crc32 instruction when the CPU has it, a slicing-by-8 table otherwise. Thread-safe.
+ * \param crc the checksum of the data before 'buf', 0 at the start
+ * \param buf the data
+ * \param len the number of bytes in 'buf'
+ * \return the checksum of all data so far
+ */
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len);
+
+#endif  //_CRC32C_H_
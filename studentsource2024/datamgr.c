@@ -0,0 +1,515 @@
+/**
+ * \author {AUTHOR}
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <inttypes.h>
+#include <math.h>
+#include <pthread.h>
+#include "datamgr.h"
+#include "topk.h"
+#include "mphash.h"
+
+typedef enum {
+    ROOM_OK,
+    ROOM_TOO_COLD,
+    ROOM_TOO_HOT
+} room_alert_t;
+
+/**
+ * fused estimate of a room
+ * 'weighted_sum' and 'weight' are the sums over the member sensors of w * last_value and w, with
+ * w = 2^(-(ts - last_ts) / FUSION_HALF_LIFE). Moving 'ts' forward scales both sums by the same factor,
+ * so a new reading only needs to swap the contribution of its own sensor.
+ */
+typedef struct room_state {
+    _Alignas(DATAMGR_CACHE_LINE) room_id_t room_id;
+    int num_sensors;            /**< sensors of this room in the map */
+    int reporting;              /**< sensors of this room that reported at least once */
+    sensor_ts_t ts;             /**< time the weights are relative to: newest reading in the room */
+    double weighted_sum;
+    double weight;
+    room_alert_t alert;         /**< alert state of the fused value, alerts are printed on changes only */
+    pthread_mutex_t mutex;      /**< protects this room and the sensor_hot_t of every sensor in it */
+} room_state_t;
+
+/**
+ * working arrays of one block update, allocated once per worker thread so a larger SENSOR_BLOCK_CAPACITY does not
+ * grow the stack of the consumer threads
+ */
+typedef struct {
+    uint32_t order[SENSOR_BLOCK_CAPACITY];          /**< reading indices sorted on sensor id */
+    uint32_t sort_scratch[SENSOR_BLOCK_CAPACITY];   /**< second buffer of the radix sort */
+    int owner[SENSOR_BLOCK_CAPACITY];               /**< index of the sensor of every reading, -1 for unknown ones */
+    room_id_t rooms[SENSOR_BLOCK_CAPACITY];
+    sensor_value_t room_values[SENSOR_BLOCK_CAPACITY];
+    sensor_ts_t room_ts[SENSOR_BLOCK_CAPACITY];
+} block_scratch_t;
+
+static pthread_key_t scratch_key;              // block_scratch_t of the calling thread, freed when it exits
+static pthread_once_t scratch_once = PTHREAD_ONCE_INIT;
+static int scratch_key_ok = 0;
+
+/**
+ * a structure to keep track of the data manager
+ * The sensor map ('sensors', 'index', the room ids) is only written by datamgr_init() and read without a lock. The
+ * changing state is locked per room, so consumer threads that update sensors of different rooms run in parallel and
+ * the per-sensor cache lines of sensor_hot_t are not serialized behind one lock.
+ */
+struct datamgr {
+    sensor_cold_t *sensors;     /**< one entry per sensor in the map, at the slot 'index' gives its id */
+    sensor_hot_t *state;        /**< state[i] is the changing state of sensors[i] */
+    int num_sensors;
+    mphash_t *index;            /**< minimal perfect hash of the sensor ids onto 0..num_sensors-1, NULL without sensors, never rebuilt */
+    room_state_t *rooms;        /**< one entry per room in the map, each on its own cache line like the sensor state */
+    int num_rooms;
+    topk_t *top_sensors;        /**< readings per sensor over the sliding window */
+    topk_t *top_rooms;          /**< readings and temperature per room over the sliding window */
+    pthread_mutex_t top_mutex;  /**< protects the trackers, never held together with a room lock */
+};
+
+static int compare_sensor_id(const void *x, const void *y) {
+    const sensor_cold_t *a = x, *b = y;
+    return (int)a->sensor_id - (int)b->sensor_id;
+}
+
+/**
+ * The perfect hash gives the only slot the sensor can be in, one compare rejects ids that are not in the map
+ * \return the index of the sensor in 'sensors' and 'state', -1 when it is not in the map
+ */
+static int find_sensor(datamgr_t *mgr, sensor_id_t sensor_id) {
+    if (mgr->index == NULL) return -1;
+    int slot = (int)mphash_lookup(mgr->index, sensor_id);
+    return mgr->sensors[slot].sensor_id == sensor_id ? slot : -1;
+}
+
+static double fusion_weight(sensor_ts_t age) {
+    return exp2(-(double)age / FUSION_HALF_LIFE);
+}
+
+/**
+ * Replaces the contribution of sensor 's' to the estimate of its room by the reading ('value', 'ts')
+ * \return the room the sensor belongs to
+ */
+static room_state_t *fuse_reading(datamgr_t *mgr, int s, sensor_value_t value, sensor_ts_t ts) {
+    const sensor_hot_t *sensor = &mgr->state[s];
+    room_state_t *room = &mgr->rooms[mgr->sensors[s].room_index];
+
+    if (room->reporting == 0 || ts > room->ts) {
+        // Age every contribution to the new reference time
+        if (room->reporting > 0) {
+            double decay = fusion_weight(ts - room->ts);
+            room->weighted_sum *= decay;
+            room->weight *= decay;
+        }
+        room->ts = ts;
+    }
+
+    if (sensor->history_count > 0) {
+        double old = fusion_weight(room->ts - sensor->last_ts);
+        room->weighted_sum -= old * sensor->history[(sensor->history_pos + RUN_AVG_LENGTH - 1) % RUN_AVG_LENGTH];
+        room->weight -= old;
+    } else {
+        room->reporting++;
+    }
+
+    double w = fusion_weight(room->ts - ts); // An out-of-order reading counts less than the newest one
+    room->weighted_sum += w * value;
+    room->weight += w;
+
+    // Only this sensor contributes: drop the rounding error the subtraction above may have left
+    if (room->reporting == 1) {
+        room->weighted_sum = w * value;
+        room->weight = w;
+    }
+    return room;
+}
+
+static void check_room_alert(room_state_t *room) {
+    if (room->weight <= 0) return;
+    sensor_value_t fused = room->weighted_sum / room->weight;
+    room_alert_t alert = fused < SET_MIN_TEMP ? ROOM_TOO_COLD : (fused > SET_MAX_TEMP ? ROOM_TOO_HOT : ROOM_OK);
+    if (alert == room->alert) return;
+
+    room->alert = alert;
+    if (alert == ROOM_TOO_COLD) {
+        printf("Room %" PRIu16 " is too cold (%.2f from %d sensors)\n", room->room_id, fused, room->reporting);
+    } else if (alert == ROOM_TOO_HOT) {
+        printf("Room %" PRIu16 " is too hot (%.2f from %d sensors)\n", room->room_id, fused, room->reporting);
+    } else {
+        printf("Room %" PRIu16 " is back in range (%.2f from %d sensors)\n", room->room_id, fused, room->reporting);
+    }
+}
+
+/**
+ * Appends a reading to the history of a sensor and keeps the sum of the ring up to date: the new reading replaces the
+ * entry it overwrites (0 while unused). Once per turn of the ring the sum is recomputed from the entries, so rounding
+ * errors do not add up and an infinite reading that left the ring does not leave a NaN behind.
+ */
+static void update_history(sensor_hot_t *sensor, sensor_value_t value, sensor_ts_t ts) {
+    sensor_value_t replaced = sensor->history[sensor->history_pos];
+
+    sensor->history[sensor->history_pos] = value;
+    sensor->history_pos = sensor->history_pos + 1 == RUN_AVG_LENGTH ? 0 : sensor->history_pos + 1;
+    if (sensor->history_count < RUN_AVG_LENGTH) sensor->history_count++;
+    sensor->last_ts = ts;
+
+    if (sensor->history_pos == 0) {
+        sensor_value_t sum = 0;
+        for (int i = 0; i < RUN_AVG_LENGTH; i++) sum += sensor->history[i];
+        sensor->sum = sum;
+    } else {
+        sensor->sum += value - replaced;
+    }
+}
+
+int datamgr_init(datamgr_t **mgr, FILE *fp_sensor_map) {
+    unsigned int room, sensor;
+    int capacity = 16;
+    int locks = 0;
+
+    if (mgr == NULL || fp_sensor_map == NULL) return DATAMGR_FAILURE;
+
+    datamgr_t *m = calloc(1, sizeof(datamgr_t));
+    if (m == NULL) return DATAMGR_FAILURE;
+    m->sensors = malloc(capacity * sizeof(sensor_cold_t));
+    if (m->sensors == NULL) goto error;
+
+    while (fscanf(fp_sensor_map, "%u %u", &room, &sensor) == 2) {
+        if (m->num_sensors == capacity) {
+            capacity *= 2;
+            sensor_cold_t *grown = realloc(m->sensors, capacity * sizeof(sensor_cold_t));
+            if (grown == NULL) goto error;
+            m->sensors = grown;
+        }
+        m->sensors[m->num_sensors++] = (sensor_cold_t){.sensor_id = sensor, .room_id = room};
+    }
+    qsort(m->sensors, m->num_sensors, sizeof(sensor_cold_t), compare_sensor_id);
+
+    // A sensor listed twice is kept once: the perfect hash needs distinct ids
+    int unique = 0;
+    for (int i = 0; i < m->num_sensors; i++) {
+        if (unique > 0 && m->sensors[unique - 1].sensor_id == m->sensors[i].sensor_id) {
+            fprintf(stderr, "Sensor %" PRIu16 " appears more than once in the sensor map, room %" PRIu16 " ignored\n",
+                    m->sensors[i].sensor_id, m->sensors[i].room_id);
+            continue;
+        }
+        m->sensors[unique++] = m->sensors[i];
+    }
+    m->num_sensors = unique;
+
+    // The sizes of both structs are multiples of their cache-line alignment, as aligned_alloc() requires
+    size_t slots = m->num_sensors > 0 ? m->num_sensors : 1;
+    m->state = aligned_alloc(DATAMGR_CACHE_LINE, slots * sizeof(sensor_hot_t));
+    if (m->state == NULL) goto error;
+    memset(m->state, 0, slots * sizeof(sensor_hot_t));
+
+    // One room entry per distinct room id, every sensor remembers the index of its room
+    m->rooms = aligned_alloc(DATAMGR_CACHE_LINE, slots * sizeof(room_state_t));
+    if (m->rooms == NULL) goto error;
+    memset(m->rooms, 0, slots * sizeof(room_state_t));
+    for (int i = 0; i < m->num_sensors; i++) {
+        int r;
+        for (r = 0; r < m->num_rooms && m->rooms[r].room_id != m->sensors[i].room_id; r++);
+        if (r == m->num_rooms) {
+            m->rooms[m->num_rooms++] = (room_state_t){.room_id = m->sensors[i].room_id, .alert = ROOM_OK};
+        }
+        m->rooms[r].num_sensors++;
+        m->sensors[i].room_index = r;
+    }
+
+    // Move every sensor to its slot in the perfect hash
+    if (m->num_sensors > 0) {
+        uint16_t *ids = malloc(m->num_sensors * sizeof(uint16_t));
+        sensor_cold_t *placed = malloc(m->num_sensors * sizeof(sensor_cold_t));
+        bool built = false;
+        if (ids != NULL && placed != NULL) {
+            for (int i = 0; i < m->num_sensors; i++) ids[i] = m->sensors[i].sensor_id;
+            built = mphash_build(&m->index, ids, m->num_sensors) == MPHASH_SUCCESS;
+        }
+        if (built) {
+            for (int i = 0; i < m->num_sensors; i++) placed[mphash_lookup(m->index, ids[i])] = m->sensors[i];
+            free(m->sensors);
+            m->sensors = placed;
+        } else {
+            free(placed);
+        }
+        free(ids);
+        if (!built) goto error;
+    }
+
+    if (topk_init(&m->top_sensors, TOPK_CAPACITY, TOPK_EPOCHS, TOPK_EPOCH_LENGTH) != TOPK_SUCCESS) goto error;
+    if (topk_init(&m->top_rooms, TOPK_CAPACITY, TOPK_EPOCHS, TOPK_EPOCH_LENGTH) != TOPK_SUCCESS) goto error;
+    if (pthread_mutex_init(&m->top_mutex, NULL) != 0) goto error;
+    for (; locks < m->num_rooms; locks++) {
+        if (pthread_mutex_init(&m->rooms[locks].mutex, NULL) != 0) goto error_locks;
+    }
+
+    *mgr = m;
+    return DATAMGR_SUCCESS;
+
+error_locks:
+    for (int r = 0; r < locks; r++) pthread_mutex_destroy(&m->rooms[r].mutex);
+    pthread_mutex_destroy(&m->top_mutex);
+error:
+    if (m->top_sensors != NULL) topk_free(&m->top_sensors);
+    if (m->top_rooms != NULL) topk_free(&m->top_rooms);
+    if (m->index != NULL) mphash_free(&m->index);
+    free(m->rooms);
+    free(m->state);
+    free(m->sensors);
+    free(m);
+    return DATAMGR_FAILURE;
+}
+
+static void create_scratch_key(void) {
+    scratch_key_ok = pthread_key_create(&scratch_key, free) == 0;
+}
+
+/**
+ * Returns the working arrays of the calling thread, allocated on its first block
+ * \return NULL if they could not be allocated
+ */
+static block_scratch_t *thread_scratch(void) {
+    pthread_once(&scratch_once, create_scratch_key);
+    if (!scratch_key_ok) return NULL;
+
+    block_scratch_t *scratch = pthread_getspecific(scratch_key);
+    if (scratch != NULL) return scratch;
+    scratch = malloc(sizeof(block_scratch_t));
+    if (scratch == NULL) return NULL;
+    if (pthread_setspecific(scratch_key, scratch) != 0) {
+        free(scratch);
+        return NULL;
+    }
+    return scratch;
+}
+
+/**
+ * Sorts the indices 0..count-1 of the readings in 'block' on sensor id into 'order', using 'scratch' as second buffer, a stable LSD radix sort with one
+ * counting pass per byte of the id; a pass is skipped when all ids share that byte (e.g. the high byte of small ids)
+ */
+static void group_by_sensor(const sensor_block_t *block, uint32_t *order, uint32_t *scratch) {
+    uint32_t counts[2][256] = {{0}};
+    uint32_t *from = order, *to = scratch;
+
+    for (uint32_t i = 0; i < block->count; i++) {
+        order[i] = i;
+        counts[0][block->id[i] & 0xff]++;
+        counts[1][block->id[i] >> 8]++;
+    }
+
+    for (int pass = 0; pass < 2; pass++) {
+        int shift = 8 * pass;
+        if (counts[pass][(block->id[0] >> shift) & 0xff] == block->count) continue;
+
+        uint32_t offset = 0;
+        for (int b = 0; b < 256; b++) {
+            uint32_t n = counts[pass][b];
+            counts[pass][b] = offset;
+            offset += n;
+        }
+        for (uint32_t i = 0; i < block->count; i++) {
+            uint32_t r = from[i];
+            to[counts[pass][(block->id[r] >> shift) & 0xff]++] = r;
+        }
+        uint32_t *swap = from;
+        from = to;
+        to = swap;
+    }
+    if (from != order) memcpy(order, from, block->count * sizeof(uint32_t));
+}
+
+/**
+ * Updates the sensors and rooms with the readings of 'block' one group of readings of the same sensor at a time, each
+ * group under the lock of its room
+ * The owner of every reading is filled in 'scratch->owner'.
+ */
+static void process_grouped(datamgr_t *mgr, const sensor_block_t *block, block_scratch_t *scratch) {
+    uint32_t *order = scratch->order;
+    int *owner = scratch->owner;
+
+    group_by_sensor(block, order, scratch->sort_scratch);
+
+    for (uint32_t start = 0, end; start < block->count; start = end) {
+        sensor_id_t id = block->id[order[start]];
+        end = start + 1;
+        while (end < block->count && block->id[order[end]] == id) end++;
+
+        int sensor = find_sensor(mgr, id);
+        for (uint32_t k = start; k < end; k++) owner[order[k]] = sensor;
+        if (sensor < 0) {
+            for (uint32_t k = start; k < end; k++) {
+                fprintf(stderr, "Received sensor data with invalid sensor node ID %" PRIu16 "\n", id);
+            }
+            continue;
+        }
+
+        // One lock per group, but every reading is fused and checked against the thresholds as in the ungrouped path,
+        // in arrival order (the sort is stable), so a short excursion inside a group still raises its alert
+        room_state_t *room = &mgr->rooms[mgr->sensors[sensor].room_index];
+        pthread_mutex_lock(&room->mutex);
+        for (uint32_t k = start; k < end; k++) {
+            uint32_t i = order[k];
+            fuse_reading(mgr, sensor, block->value[i], block->ts[i]);
+            check_room_alert(room);
+            update_history(&mgr->state[sensor], block->value[i], block->ts[i]);
+        }
+        pthread_mutex_unlock(&room->mutex);
+    }
+}
+
+/**
+ * Prints the current top sensors and rooms, the caller holds 'top_mutex'
+ */
+static void print_top(datamgr_t *mgr, FILE *out) {
+    topk_entry_t top[TOPK_REPORT_N];
+    int n;
+
+    n = topk_top_by_count(mgr->top_sensors, top, TOPK_REPORT_N);
+    fprintf(out, "Top sensors by readings (last %ds):", TOPK_EPOCHS * TOPK_EPOCH_LENGTH);
+    for (int i = 0; i < n; i++) {
+        fprintf(out, " %" PRIu16 " (%" PRIu32 ")", top[i].key, top[i].count);
+    }
+    fprintf(out, "\n");
+
+    n = topk_top_by_average(mgr->top_rooms, top, TOPK_REPORT_N);
+    fprintf(out, "Hottest rooms (last %ds):", TOPK_EPOCHS * TOPK_EPOCH_LENGTH);
+    for (int i = 0; i < n; i++) {
+        fprintf(out, " %" PRIu16 " (%.2f)", top[i].key, top[i].average);
+    }
+    fprintf(out, "\n");
+}
+
+int datamgr_process_block(datamgr_t *mgr, const sensor_block_t *block) {
+    uint32_t known = 0;
+
+    if (mgr == NULL || block == NULL) return DATAMGR_FAILURE;
+    block_scratch_t *scratch = thread_scratch();
+    if (scratch == NULL) return DATAMGR_FAILURE;
+    room_id_t *rooms = scratch->rooms;
+    sensor_value_t *room_values = scratch->room_values;
+    sensor_ts_t *room_ts = scratch->room_ts;
+    int *owner = scratch->owner;
+
+    if (block->count >= DATAMGR_GROUP_MIN) {
+        process_grouped(mgr, block, scratch);
+    } else {
+        for (uint32_t i = 0; i < block->count; i++) {
+            int sensor = find_sensor(mgr, block->id[i]);
+            owner[i] = sensor;
+            if (sensor < 0) {
+                fprintf(stderr, "Received sensor data with invalid sensor node ID %" PRIu16 "\n", block->id[i]);
+                continue;
+            }
+
+            room_state_t *room = &mgr->rooms[mgr->sensors[sensor].room_index];
+            pthread_mutex_lock(&room->mutex);
+            fuse_reading(mgr, sensor, block->value[i], block->ts[i]);
+            check_room_alert(room);
+            update_history(&mgr->state[sensor], block->value[i], block->ts[i]);
+            pthread_mutex_unlock(&room->mutex);
+        }
+    }
+
+    // Collect the room columns in arrival order for the batched tracker update below
+    for (uint32_t i = 0; i < block->count; i++) {
+        if (owner[i] < 0) continue;
+        rooms[known] = mgr->sensors[owner[i]].room_id;
+        room_values[known] = block->value[i];
+        room_ts[known] = block->ts[i];
+        known++;
+    }
+
+    pthread_mutex_lock(&mgr->top_mutex);
+    int moved = topk_update(mgr->top_sensors, block->id, block->value, block->ts, block->count);
+    topk_update(mgr->top_rooms, rooms, room_values, room_ts, known);
+
+    // A new sub-window started, report the window as it is now
+    if (moved > 0) print_top(mgr, stdout);
+    pthread_mutex_unlock(&mgr->top_mutex);
+    return DATAMGR_SUCCESS;
+}
+
+int datamgr_get_room_id(datamgr_t *mgr, sensor_id_t sensor_id, room_id_t *room_id) {
+    if (mgr == NULL || room_id == NULL) return DATAMGR_FAILURE;
+    int sensor = find_sensor(mgr, sensor_id);
+    if (sensor >= 0) *room_id = mgr->sensors[sensor].room_id;
+    return sensor >= 0 ? DATAMGR_SUCCESS : DATAMGR_FAILURE;
+}
+
+int datamgr_enrich_block(datamgr_t *mgr, sensor_block_t *block) {
+    uint32_t kept = 0;
+
+    if (mgr == NULL || block == NULL) return DATAMGR_FAILURE;
+    for (uint32_t i = 0; i < block->count; i++) {
+        int sensor = find_sensor(mgr, block->id[i]);
+        if (sensor < 0) {
+            fprintf(stderr, "Received sensor data with invalid sensor node ID %" PRIu16 "\n", block->id[i]);
+            continue;
+        }
+        block->id[kept] = block->id[i];
+        block->value[kept] = block->value[i];
+        block->ts[kept] = block->ts[i];
+        block->room[kept] = mgr->sensors[sensor].room_id;
+        kept++;
+    }
+    block->count = kept;
+    block->has_room = true;
+    return DATAMGR_SUCCESS;
+}
+
+int datamgr_get_avg(datamgr_t *mgr, sensor_id_t sensor_id, sensor_value_t *avg) {
+    if (mgr == NULL || avg == NULL) return DATAMGR_FAILURE;
+    int sensor = find_sensor(mgr, sensor_id);
+    if (sensor < 0) return DATAMGR_FAILURE;
+    room_state_t *room = &mgr->rooms[mgr->sensors[sensor].room_index];
+    pthread_mutex_lock(&room->mutex);
+    const sensor_hot_t *state = &mgr->state[sensor];
+    *avg = state->history_count > 0 ? state->sum / state->history_count : 0;
+    pthread_mutex_unlock(&room->mutex);
+    return DATAMGR_SUCCESS;
+}
+
+int datamgr_get_room_value(datamgr_t *mgr, room_id_t room_id, sensor_value_t *value) {
+    int result = DATAMGR_FAILURE;
+
+    if (mgr == NULL || value == NULL) return DATAMGR_FAILURE;
+    for (int r = 0; r < mgr->num_rooms; r++) {
+        room_state_t *room = &mgr->rooms[r];
+        if (room->room_id != room_id) continue;
+        pthread_mutex_lock(&room->mutex);
+        if (room->reporting > 0 && room->weight > 0) {
+            *value = room->weighted_sum / room->weight;
+            result = DATAMGR_SUCCESS;
+        }
+        pthread_mutex_unlock(&room->mutex);
+        break;
+    }
+    return result;
+}
+
+void datamgr_print_top(datamgr_t *mgr, FILE *out) {
+    if (mgr == NULL || out == NULL) return;
+    pthread_mutex_lock(&mgr->top_mutex);
+    print_top(mgr, out);
+    pthread_mutex_unlock(&mgr->top_mutex);
+}
+
+int datamgr_free(datamgr_t **mgr) {
+    if ((mgr == NULL) || (*mgr == NULL)) return DATAMGR_FAILURE;
+    topk_free(&(*mgr)->top_sensors);
+    topk_free(&(*mgr)->top_rooms);
+    if ((*mgr)->index != NULL) mphash_free(&(*mgr)->index);
+    pthread_mutex_destroy(&(*mgr)->top_mutex);
+    for (int r = 0; r < (*mgr)->num_rooms; r++) pthread_mutex_destroy(&(*mgr)->rooms[r].mutex);
+    free((*mgr)->rooms);
+    free((*mgr)->state);
+    free((*mgr)->sensors);
+    free(*mgr);
+    *mgr = NULL;
+    return DATAMGR_SUCCESS;
+}
@@ -0,0 +1,175 @@
+/**
+ * \author {AUTHOR}
+ */
+
+#ifndef _DATAMGR_H_
+#define _DATAMGR_H_
+
+#include <stdio.h>
+#include "config.h"
+
+#ifndef RUN_AVG_LENGTH
+#define RUN_AVG_LENGTH 5
+#endif
+
+#ifndef SET_MAX_TEMP
+#error SET_MAX_TEMP not set
+#endif
+
+#ifndef SET_MIN_TEMP
+#error SET_MIN_TEMP not set
+#endif
+
+// Heavy-hitter tracking: TOPK_CAPACITY counters per sub-window of TOPK_EPOCH_LENGTH seconds, TOPK_EPOCHS sub-windows
+#ifndef TOPK_CAPACITY
+#define TOPK_CAPACITY 32
+#endif
+
+#ifndef TOPK_EPOCHS
+#define TOPK_EPOCHS 5
+#endif
+
+#ifndef TOPK_EPOCH_LENGTH
+#define TOPK_EPOCH_LENGTH 60
+#endif
+
+#ifndef TOPK_REPORT_N
+#define TOPK_REPORT_N 3         // Number of sensors/rooms in a report
+#endif
+
+#ifndef FUSION_HALF_LIFE
+#define FUSION_HALF_LIFE 60     // Seconds after which the weight of a sensor's last reading in its room estimate halves
+#endif
+
+#ifndef DATAMGR_GROUP_MIN
+#define DATAMGR_GROUP_MIN 16    // Blocks of at least this many readings are grouped by sensor before they are processed
+#endif
+
+#define DATAMGR_CACHE_LINE 64
+
+#define DATAMGR_FAILURE -1
+#define DATAMGR_SUCCESS 0
+
+typedef struct datamgr datamgr_t;
+
+/*
+ * Per-sensor state is split by how often it changes. The fields every reading writes live in an array of
+ * sensor_hot_t, every element on its own cache line(s), so threads that update neighbouring sensors never write to
+ * the same line. Each element is written under the lock of the sensor's room, so those threads do not wait for each
+ * other either. The metadata that only changes at startup lives in a separate, densely packed array of sensor_cold_t,
+ * so the lookup of a sensor touches as few cache lines as possible. Element i of both arrays describes the same
+ * sensor. The layout is public for layout_bench, which compares it with the packed layout and also measures the
+ * whole datamgr_process_block() path.
+ */
+
+/**
+ * state of a sensor that changes with every reading, exactly one cache line with the default RUN_AVG_LENGTH
+ * The running sum is updated one sensor at a time, there is no vector kernel: with the sum kept up to date an update
+ * is one load, one add and two stores on the sensor's cache line, and packing four sensors into AVX lanes measured
+ * slower than the scalar update (5.8 vs 4.7 ns per update, AVX2 gathers 10.5 ns).
+ */
+typedef struct sensor_hot {
+    _Alignas(DATAMGR_CACHE_LINE) sensor_value_t history[RUN_AVG_LENGTH];   /**< ring of the last readings, 0 where unused */
+    sensor_value_t sum;             /**< sum of the valid 'history' entries, kept up to date with every reading */
+    sensor_ts_t last_ts;            /**< timestamp of the last reading, which is history[history_pos - 1] */
+    int history_count;              /**< valid entries in 'history' */
+    int history_pos;                /**< slot the next reading is written to */
+} sensor_hot_t;
+
+_Static_assert(sizeof(sensor_hot_t) % DATAMGR_CACHE_LINE == 0, "sensor_hot_t must fill whole cache lines");
+
+/**
+ * metadata of a sensor, written once when the map is read
+ */
+typedef struct sensor_cold {
+    sensor_id_t sensor_id;
+    room_id_t room_id;
+    int room_index;                 /**< index of the room in the rooms array of the data manager */
+} sensor_cold_t;
+
+/**
+ * Allocates a data manager and reads the sensor-room mapping from 'fp_sensor_map'
+ * Every line of the map holds '<room id> <sensor id>'
+ * The sensor ids are indexed with a minimal perfect hash (see mphash.h): a lookup is two hash mixes, one table read
+ * and one compare
+ * The map and its hash are built once and stay fixed for the lifetime of the data manager, which is the lifetime of
+ * the gateway process: there is no reload. That is what lets lookups run without a lock. Unlike the room map of the
+ * database (sensor_db_load_room_map()), a changed room_sensor.map only applies after a restart.
+ * \param mgr a double pointer to the data manager that needs to be initialized
+ * \param fp_sensor_map the opened room_sensor.map file
+ * \return DATAMGR_SUCCESS on success and DATAMGR_FAILURE if an error occurred
+ */
+int datamgr_init(datamgr_t **mgr, FILE *fp_sensor_map);
+
+/**
+ * Processes a block of readings: the running average of every sensor and the fused estimate of its room are updated
+ * and the heavy-hitter trackers are fed with the whole block at once. Readings of sensors that are not in the map are
+ * reported and skipped. A room alert is printed when the fused room value leaves or re-enters [SET_MIN_TEMP, SET_MAX_TEMP].
+ * Whenever the sliding window moves forward, the current top sensors and rooms are printed.
+ * A block of DATAMGR_GROUP_MIN or more readings (a consumer that drained a backlog) is first grouped by sensor id with
+ * a radix sort that keeps the order of the readings of each sensor. Every sensor is then looked up and its room locked
+ * once per group; its readings are still fused and checked against the thresholds one by one, so the alerts are the
+ * same as without grouping.
+ * Thread-safe. Every sensor (or group) is updated under the lock of its room and the trackers under a lock of their
+ * own, so threads that process readings of different rooms only meet at the trackers. The working arrays of a block live on the heap, one
+ * set per calling thread that is freed when the thread exits, so a large SENSOR_BLOCK_CAPACITY does not grow the stack.
+ * \param mgr a pointer to the data manager that is used
+ * \param block the readings to process
+ * \return DATAMGR_SUCCESS on success and DATAMGR_FAILURE if an error occurred
+ */
+int datamgr_process_block(datamgr_t *mgr, const sensor_block_t *block);
+
+/**
+ * Looks up the room of a sensor
+ * \param mgr a pointer to the data manager that is used
+ * \param sensor_id the sensor to look up
+ * \param room_id filled in with the room of the sensor
+ * \return DATAMGR_SUCCESS on success and DATAMGR_FAILURE if the sensor is unknown
+ */
+int datamgr_get_room_id(datamgr_t *mgr, sensor_id_t sensor_id, room_id_t *room_id);
+
+/**
+ * Fills in the room column of a block: sets block->room of every reading and block->has_room. Readings of sensors that
+ * are not in the map are reported and dropped, the remaining readings keep their order.
+ * Thread-safe, the map does not change after datamgr_init() so no lock is taken.
+ * \param mgr a pointer to the data manager that is used
+ * \param block the readings to enrich
+ * \return DATAMGR_SUCCESS on success and DATAMGR_FAILURE if an error occurred
+ */
+int datamgr_enrich_block(datamgr_t *mgr, sensor_block_t *block);
+
+/**
+ * Returns the running average over the last (up to) RUN_AVG_LENGTH readings of a sensor
+ * \param mgr a pointer to the data manager that is used
+ * \param sensor_id the sensor to look up
+ * \param avg filled in with the running average, 0 when the sensor did not report yet
+ * \return DATAMGR_SUCCESS on success and DATAMGR_FAILURE if the sensor is unknown
+ */
+int datamgr_get_avg(datamgr_t *mgr, sensor_id_t sensor_id, sensor_value_t *avg);
+
+/**
+ * Returns the fused temperature estimate of a room: the average of the last reading of every sensor in the room,
+ * each weighted by 2^(-age / FUSION_HALF_LIFE) where age is measured against the newest reading in the room
+ * \param mgr a pointer to the data manager that is used
+ * \param room_id the room to look up
+ * \param value filled in with the fused estimate
+ * \return DATAMGR_SUCCESS on success and DATAMGR_FAILURE if the room is unknown or none of its sensors reported yet
+ */
+int datamgr_get_room_value(datamgr_t *mgr, room_id_t room_id, sensor_value_t *value);
+
+/**
+ * Prints the TOPK_REPORT_N sensors with the most readings and the TOPK_REPORT_N rooms with the highest average
+ * temperature over the sliding window
+ * \param mgr a pointer to the data manager that is used
+ * \param out the stream to print to
+ */
+void datamgr_print_top(datamgr_t *mgr, FILE *out);
+
+/**
+ * All allocated resources are freed and cleaned up
+ * \param mgr a double pointer to the data manager that needs to be freed
+ * \return DATAMGR_SUCCESS on success and DATAMGR_FAILURE if an error occurred
+ */
+int datamgr_free(datamgr_t **mgr);
+
+#endif  //_DATAMGR_H_
@@ -18,7 +18,9 @@
                     } while(0)
 
 
+#ifndef NUM_MEASUREMENTS
 #define NUM_MEASUREMENTS    100
+#endif
 #define SLEEP_TIME          30      // every SLEEP_TIME seconds, sensors wake up and measure temperature
 #define NUM_SENSORS         8       // also defines number of rooms (currently 1 room = 1 sensor)
 #define TEMP_DEV            5       // max afwijking vorige temperatuur in 0.1 celsius
@@ -0,0 +1,215 @@
+/**
+ * \author {AUTHOR}
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include "handover.h"
+
+#define HANDOVER_MAGIC "SGWHO1"     // First bytes of the header message, changes with the wire format
+#define HANDOVER_ACK_TIMEOUT 5      // Seconds the old process waits for the new one to confirm
+
+/**
+ * first message: the number of connections that follow, carries the listening socket
+ */
+typedef struct handover_header {
+    char magic[8];
+    uint32_t num_conns;
+} handover_header_t;
+
+/**
+ * state of one connection as it is sent, its descriptor travels in the control data of the same message
+ */
+typedef struct handover_wire {
+    sensor_id_t sensor_id;
+    sensor_ts_t last_active;
+    uint32_t partial_len;
+    unsigned char partial[HANDOVER_FRAME_SIZE];
+} handover_wire_t;
+
+static int unix_address(const char *path, struct sockaddr_un *addr) {
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    if (path == NULL || strlen(path) >= sizeof(addr->sun_path)) return HANDOVER_FAILURE;
+    strcpy(addr->sun_path, path);
+    return HANDOVER_SUCCESS;
+}
+
+/**
+ * Sends one message of 'len' bytes with 'num_fds' descriptors attached
+ */
+static int send_with_fds(int sock, const void *data, size_t len, const int *fds, uint32_t num_fds) {
+    char control[CMSG_SPACE(HANDOVER_FDS_PER_MSG * sizeof(int))];
+    struct iovec iov = {.iov_base = (void *)data, .iov_len = len};
+    struct msghdr msg = {.msg_iov = &iov, .msg_iovlen = 1};
+
+    if (num_fds > 0) {
+        memset(control, 0, sizeof(control));
+        msg.msg_control = control;
+        msg.msg_controllen = CMSG_SPACE(num_fds * sizeof(int));
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(num_fds * sizeof(int));
+        memcpy(CMSG_DATA(cmsg), fds, num_fds * sizeof(int));
+    }
+    return sendmsg(sock, &msg, MSG_NOSIGNAL) == (ssize_t)len ? HANDOVER_SUCCESS : HANDOVER_FAILURE;
+}
+
+/**
+ * Receives one message into 'data', the attached descriptors are stored in 'fds'
+ * \return the number of bytes received, -1 on an error; descriptors that did arrive are in 'fds' either way
+ */
+static ssize_t recv_with_fds(int sock, void *data, size_t len, int *fds, uint32_t *num_fds) {
+    char control[CMSG_SPACE(HANDOVER_FDS_PER_MSG * sizeof(int))];
+    struct iovec iov = {.iov_base = data, .iov_len = len};
+    struct msghdr msg = {.msg_iov = &iov, .msg_iovlen = 1, .msg_control = control, .msg_controllen = sizeof(control)};
+
+    *num_fds = 0;
+    ssize_t got = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+    if (got < 0) return -1;
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) continue;
+        uint32_t n = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        memcpy(fds + *num_fds, CMSG_DATA(cmsg), n * sizeof(int));
+        *num_fds += n;
+    }
+    if (msg.msg_flags & (MSG_TRUNC | MSG_CTRUNC)) return -1;
+    return got;
+}
+
+int handover_offer(const char *path, int *control_fd) {
+    struct sockaddr_un addr;
+
+    if (control_fd == NULL || unix_address(path, &addr) != HANDOVER_SUCCESS) return HANDOVER_FAILURE;
+    int sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (sock < 0) return HANDOVER_FAILURE;
+    unlink(path);   // Left behind by a gateway that did not hand over, or already taken over from
+    if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(sock, 1) < 0) {
+        fprintf(stderr, "Handover socket %s: %s\n", path, strerror(errno));
+        close(sock);
+        return HANDOVER_FAILURE;
+    }
+    *control_fd = sock;
+    return HANDOVER_SUCCESS;
+}
+
+int handover_accept(int control_fd, int *peer) {
+    if (peer == NULL) return HANDOVER_FAILURE;
+    int sock = accept4(control_fd, NULL, NULL, SOCK_CLOEXEC);
+    if (sock < 0) {
+        return (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) ? HANDOVER_NO_REQUEST : HANDOVER_FAILURE;
+    }
+    *peer = sock;
+    return HANDOVER_SUCCESS;
+}
+
+int handover_send(int peer, int listen_fd, const handover_conn_t *conns, uint32_t num_conns) {
+    handover_header_t header = {.magic = HANDOVER_MAGIC, .num_conns = num_conns};
+    handover_wire_t wire[HANDOVER_FDS_PER_MSG];
+    int fds[HANDOVER_FDS_PER_MSG];
+    int result = HANDOVER_FAILURE;
+    char ack;
+
+    if (send_with_fds(peer, &header, sizeof(header), &listen_fd, 1) != HANDOVER_SUCCESS) goto done;
+
+    for (uint32_t sent = 0; sent < num_conns;) {
+        uint32_t n = num_conns - sent < HANDOVER_FDS_PER_MSG ? num_conns - sent : HANDOVER_FDS_PER_MSG;
+        memset(wire, 0, n * sizeof(handover_wire_t));
+        for (uint32_t i = 0; i < n; i++) {
+            const handover_conn_t *c = &conns[sent + i];
+            if (c->partial_len > HANDOVER_FRAME_SIZE) goto done;
+            fds[i] = c->fd;
+            wire[i].sensor_id = c->sensor_id;
+            wire[i].last_active = c->last_active;
+            wire[i].partial_len = c->partial_len;
+            memcpy(wire[i].partial, c->partial, c->partial_len);
+        }
+        if (send_with_fds(peer, wire, n * sizeof(handover_wire_t), fds, n) != HANDOVER_SUCCESS) goto done;
+        sent += n;
+    }
+
+    // Only a confirmed handover lets the caller give up the connections, a crashed new process leaves them here
+    struct timeval timeout = {HANDOVER_ACK_TIMEOUT, 0};
+    setsockopt(peer, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    if (recv(peer, &ack, 1, 0) == 1 && ack == 'K') result = HANDOVER_SUCCESS;
+
+done:
+    if (result != HANDOVER_SUCCESS) fprintf(stderr, "Handover of %u connections failed\n", num_conns);
+    close(peer);
+    return result;
+}
+
+int handover_request(const char *path, int *listen_fd, handover_conn_t **conns, uint32_t *num_conns) {
+    struct sockaddr_un addr;
+    handover_header_t header;
+    handover_wire_t wire[HANDOVER_FDS_PER_MSG];
+    int fds[HANDOVER_FDS_PER_MSG];
+    uint32_t num_fds, received = 0;
+    handover_conn_t *list = NULL;
+    int listener = -1;
+
+    if (listen_fd == NULL || conns == NULL || num_conns == NULL || unix_address(path, &addr) != HANDOVER_SUCCESS) {
+        return HANDOVER_FAILURE;
+    }
+    int sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (sock < 0) return HANDOVER_FAILURE;
+    if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        fprintf(stderr, "No gateway to take over at %s: %s\n", path, strerror(errno));
+        close(sock);
+        return HANDOVER_FAILURE;
+    }
+
+    ssize_t got = recv_with_fds(sock, &header, sizeof(header), fds, &num_fds);
+    if (num_fds > 0) listener = fds[0];
+    for (uint32_t i = 1; i < num_fds; i++) close(fds[i]);
+    if (got != sizeof(header) || num_fds != 1 || memcmp(header.magic, HANDOVER_MAGIC, sizeof(HANDOVER_MAGIC)) != 0) {
+        goto fail;
+    }
+
+    if (header.num_conns > 0) {
+        list = calloc(header.num_conns, sizeof(handover_conn_t));
+        if (list == NULL) goto fail;
+    }
+    while (received < header.num_conns) {
+        got = recv_with_fds(sock, wire, sizeof(wire), fds, &num_fds);
+        uint32_t n = got > 0 ? (uint32_t)(got / sizeof(handover_wire_t)) : 0;
+        if (got <= 0 || got % sizeof(handover_wire_t) != 0 || n != num_fds || received + n > header.num_conns) {
+            for (uint32_t i = 0; i < num_fds; i++) close(fds[i]);
+            goto fail;
+        }
+        for (uint32_t i = 0; i < n; i++) {
+            handover_conn_t *c = &list[received + i];
+            c->fd = fds[i];
+            c->sensor_id = wire[i].sensor_id;
+            c->last_active = wire[i].last_active;
+            c->partial_len = wire[i].partial_len <= HANDOVER_FRAME_SIZE ? wire[i].partial_len : 0;
+            memcpy(c->partial, wire[i].partial, c->partial_len);
+        }
+        received += n;
+    }
+
+    if (send(sock, "K", 1, MSG_NOSIGNAL) != 1) goto fail;
+    close(sock);
+    *listen_fd = listener;
+    *conns = list;
+    *num_conns = received;
+    return HANDOVER_SUCCESS;
+
+fail:
+    // The old process keeps serving when it gets no confirmation, so drop our copies of everything
+    fprintf(stderr, "Takeover from %s failed\n", path);
+    for (uint32_t i = 0; i < received; i++) close(list[i].fd);
+    free(list);
+    if (listener >= 0) close(listener);
+    close(sock);
+    return HANDOVER_FAILURE;
+}
@@ -0,0 +1,84 @@
+/**
+ * \author {AUTHOR}
+ */
+
+#ifndef _HANDOVER_H_
+#define _HANDOVER_H_
+
+#include <stdint.h>
+#include "config.h"
+
+#define HANDOVER_FAILURE -1
+#define HANDOVER_SUCCESS 0
+#define HANDOVER_NO_REQUEST 1
+
+#define HANDOVER_FRAME_SIZE (sizeof(sensor_id_t) + sizeof(sensor_value_t) + sizeof(sensor_ts_t))  // One reading on the wire
+#define HANDOVER_FDS_PER_MSG 64     // Connections passed per message, well below the SCM_RIGHTS limit of the kernel
+
+/*
+ * Zero-downtime restart: the running gateway offers a Unix socket at a well-known path and polls it together with
+ * its connections. A new gateway started in takeover mode connects to it and receives the listening socket and
+ * every established connection (SCM_RIGHTS), each with the bytes of a reading that was only partly received. Once
+ * the new process confirmed, the old one closes its copies of the descriptors - the connections stay open in the
+ * new process, the sensors don't notice - drains its sbuffer and exits.
+ *
+ * Old process                                  New process
+ *   handover_offer(path, &ctl)                   handover_request(path, &listen_fd, &conns, &n)
+ *   ... handover_accept(ctl, &peer) == SUCCESS
+ *   stop reading, handover_send(peer, ...)       ... continues accept() and reading where the old one stopped
+ *   close the descriptors, drain, exit           handover_offer(path, &ctl) for the next upgrade
+ *
+ * The gateway in this tree has no connection manager to call this yet, so the module is not linked into
+ * sensor_gateway; 'make handover_test' runs the sequence above between two processes.
+ */
+
+/**
+ * state of one connection that moves to the new process
+ */
+typedef struct handover_conn {
+    int fd;                                         /**< the connection, a new descriptor in the receiving process */
+    sensor_id_t sensor_id;                          /**< sensor of the connection, 0 when it did not send a reading yet */
+    sensor_ts_t last_active;                        /**< time() of the last data, so the receiver keeps the TIMEOUT running */
+    uint32_t partial_len;                           /**< bytes of the next reading received so far */
+    unsigned char partial[HANDOVER_FRAME_SIZE];     /**< those bytes */
+} handover_conn_t;
+
+/**
+ * Creates the non-blocking control socket a new process connects to, replacing a stale socket file at 'path'
+ * \param path file system path of the Unix socket
+ * \param control_fd filled in with the listening control socket, to be polled for readability
+ * \return HANDOVER_SUCCESS on success and HANDOVER_FAILURE if an error occurred
+ */
+int handover_offer(const char *path, int *control_fd);
+
+/**
+ * Accepts a pending takeover request, does not block
+ * \param control_fd the control socket of handover_offer()
+ * \param peer filled in with the connection to the new process
+ * \return HANDOVER_SUCCESS if a new process is waiting, HANDOVER_NO_REQUEST if none is and HANDOVER_FAILURE on an error
+ */
+int handover_accept(int control_fd, int *peer);
+
+/**
+ * Passes the listening socket and the connections to the new process and waits until it confirmed
+ * The caller must have stopped reading from the connections. On success it only has to close its own descriptors;
+ * on failure it still owns everything and keeps serving.
+ * \param peer the connection of handover_accept(), closed by this call
+ * \param listen_fd the listening socket of the sensors
+ * \param conns the connections and their state
+ * \param num_conns the number of elements in 'conns'
+ * \return HANDOVER_SUCCESS on success and HANDOVER_FAILURE if an error occurred
+ */
+int handover_send(int peer, int listen_fd, const handover_conn_t *conns, uint32_t num_conns);
+
+/**
+ * Takes over from the gateway that offers a control socket at 'path', blocks until everything was received
+ * \param path file system path of the Unix socket of the running gateway
+ * \param listen_fd filled in with the listening socket of the sensors
+ * \param conns filled in with a heap allocated array of the connections, to be freed by the caller (NULL if none)
+ * \param num_conns filled in with the number of connections
+ * \return HANDOVER_SUCCESS on success and HANDOVER_FAILURE if an error occurred (nothing was taken over then)
+ */
+int handover_request(const char *path, int *listen_fd, handover_conn_t **conns, uint32_t *num_conns);
+
+#endif  //_HANDOVER_H_
@@ -0,0 +1,222 @@
+/**
+ * \author {AUTHOR}
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <poll.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include "handover.h"
+
+#define TEST_SOCKET "handover_test.sock"
+#define TEST_CONNS (2 * HANDOVER_FDS_PER_MSG + 3)   // Three messages of connections, the last one not full
+
+/**
+ * The reading connection 'i' sends, with the sensor id i + 1
+ */
+static void make_frame(uint32_t i, unsigned char *frame) {
+    sensor_id_t id = (sensor_id_t)(i + 1);
+    sensor_value_t value = 15 + i / 4.0;
+    sensor_ts_t ts = 1700000000 + i;
+    memcpy(frame, &id, sizeof(id));
+    memcpy(frame + sizeof(id), &value, sizeof(value));
+    memcpy(frame + sizeof(id) + sizeof(value), &ts, sizeof(ts));
+}
+
+/**
+ * Bytes of its reading that connection 'i' sends before the handover, every split of a frame is covered
+ */
+static uint32_t partial_len(uint32_t i) {
+    return i % HANDOVER_FRAME_SIZE;
+}
+
+static int tcp_listener(uint16_t *port) {
+    struct sockaddr_in addr = {.sin_family = AF_INET, .sin_addr.s_addr = htonl(INADDR_LOOPBACK)};
+    socklen_t len = sizeof(addr);
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0 || bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(fd, TEST_CONNS + 1) != 0
+        || getsockname(fd, (struct sockaddr *)&addr, &len) != 0) {
+        perror("FAIL: listening socket");
+        exit(EXIT_FAILURE);
+    }
+    *port = ntohs(addr.sin_port);
+    return fd;
+}
+
+static int tcp_connect(uint16_t port) {
+    struct sockaddr_in addr = {.sin_family = AF_INET, .sin_port = htons(port), .sin_addr.s_addr = htonl(INADDR_LOOPBACK)};
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        perror("FAIL: sensor connection");
+        exit(EXIT_FAILURE);
+    }
+    return fd;
+}
+
+/**
+ * Waits until a new process connected to the control socket
+ */
+static int accept_request(int control_fd) {
+    struct pollfd pfd = {.fd = control_fd, .events = POLLIN};
+    int peer;
+    while (poll(&pfd, 1, 5000) == 1) {
+        int status = handover_accept(control_fd, &peer);
+        if (status == HANDOVER_SUCCESS) return peer;
+        if (status == HANDOVER_FAILURE) break;
+    }
+    fprintf(stderr, "FAIL: no takeover request\n");
+    exit(EXIT_FAILURE);
+}
+
+/**
+ * A new process that connects, reads the first message and dies before it confirmed
+ */
+static void crashing_taker(void) {
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    char header[64];
+    strcpy(addr.sun_path, TEST_SOCKET);
+    int sock = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+    if (sock < 0 || connect(sock, (struct sockaddr *)&addr, sizeof(addr)) != 0) _exit(EXIT_FAILURE);
+    recv(sock, header, sizeof(header), 0);
+    _exit(EXIT_SUCCESS);
+}
+
+/**
+ * The new process: takes over, checks the state of every connection, finishes the readings that were cut by the
+ * handover (the old process closed its copies by then) and accepts a fresh connection on the listener it received
+ */
+static void taker(void) {
+    handover_conn_t *conns;
+    uint32_t num_conns;
+    int listen_fd, failed = 0;
+
+    if (handover_request(TEST_SOCKET, &listen_fd, &conns, &num_conns) != HANDOVER_SUCCESS) _exit(EXIT_FAILURE);
+    if (num_conns != TEST_CONNS) {
+        fprintf(stderr, "FAIL: %" PRIu32 " of %d connections taken over\n", num_conns, TEST_CONNS);
+        _exit(EXIT_FAILURE);
+    }
+    for (uint32_t i = 0; i < num_conns; i++) {
+        unsigned char expected[HANDOVER_FRAME_SIZE], frame[HANDOVER_FRAME_SIZE];
+        handover_conn_t *c = &conns[i];
+        make_frame(i, expected);
+        if (c->sensor_id != i + 1 || c->last_active != 1700000000 + (sensor_ts_t)i || c->partial_len != partial_len(i)
+            || memcmp(c->partial, expected, c->partial_len) != 0) {
+            fprintf(stderr, "FAIL: state of connection %" PRIu32 " was not handed over\n", i);
+            failed = 1;
+            continue;
+        }
+        memcpy(frame, c->partial, c->partial_len);
+        uint32_t rest = HANDOVER_FRAME_SIZE - c->partial_len;
+        if (recv(c->fd, frame + c->partial_len, rest, MSG_WAITALL) != (ssize_t)rest
+            || memcmp(frame, expected, HANDOVER_FRAME_SIZE) != 0) {
+            fprintf(stderr, "FAIL: reading of connection %" PRIu32 " is not complete after the handover\n", i);
+            failed = 1;
+        }
+        close(c->fd);
+    }
+    free(conns);
+
+    unsigned char expected[HANDOVER_FRAME_SIZE], frame[HANDOVER_FRAME_SIZE];
+    make_frame(TEST_CONNS, expected);
+    int fresh = accept(listen_fd, NULL, NULL);
+    if (fresh < 0 || recv(fresh, frame, sizeof(frame), MSG_WAITALL) != sizeof(frame)
+        || memcmp(frame, expected, sizeof(frame)) != 0) {
+        fprintf(stderr, "FAIL: no new connection on the listener that was handed over\n");
+        failed = 1;
+    }
+    close(fresh);
+    close(listen_fd);
+    _exit(failed ? EXIT_FAILURE : EXIT_SUCCESS);
+}
+
+static int wait_child(pid_t pid) {
+    int status;
+    return pid > 0 && waitpid(pid, &status, 0) == pid && WIFEXITED(status) ? WEXITSTATUS(status) : EXIT_FAILURE;
+}
+
+/**
+ * Moves TEST_CONNS sensor connections, each cut in the middle of a reading, and the listening socket to a new process.
+ * A new process that dies before it confirmed must leave everything with the old one, which keeps serving.
+ */
+int main(void) {
+    int clients[TEST_CONNS], control_fd, failed = 0;
+    handover_conn_t conns[TEST_CONNS];
+    uint16_t port;
+
+    int listen_fd = tcp_listener(&port);
+    for (uint32_t i = 0; i < TEST_CONNS; i++) {
+        unsigned char frame[HANDOVER_FRAME_SIZE];
+        clients[i] = tcp_connect(port);
+        conns[i] = (handover_conn_t){.fd = accept(listen_fd, NULL, NULL), .sensor_id = (sensor_id_t)(i + 1),
+                                     .last_active = 1700000000 + (sensor_ts_t)i, .partial_len = partial_len(i)};
+        make_frame(i, frame);
+        ssize_t n = partial_len(i);
+        if (conns[i].fd < 0 || (n > 0 && (send(clients[i], frame, n, 0) != n
+                                          || recv(conns[i].fd, conns[i].partial, n, MSG_WAITALL) != n))) {
+            perror("FAIL: partial reading");
+            return EXIT_FAILURE;
+        }
+    }
+    if (handover_offer(TEST_SOCKET, &control_fd) != HANDOVER_SUCCESS) return EXIT_FAILURE;
+
+    // No confirmation: the send fails and the connections still work in the old process
+    pid_t pid = fork();
+    if (pid == 0) crashing_taker();
+    if (handover_send(accept_request(control_fd), listen_fd, conns, TEST_CONNS) != HANDOVER_FAILURE) {
+        fprintf(stderr, "FAIL: handover without a confirmation succeeded\n");
+        failed = 1;
+    }
+    wait_child(pid);
+    char byte = 0;
+    if (send(conns[0].fd, "x", 1, MSG_NOSIGNAL) != 1 || recv(clients[0], &byte, 1, 0) != 1 || byte != 'x') {
+        fprintf(stderr, "FAIL: the old process lost its connections after a failed handover\n");
+        failed = 1;
+    } else {
+        printf("ok: unconfirmed handover left the connections with the old process\n");
+    }
+
+    // Confirmed: the old process closes its copies only then, the sensors finish their readings with the new one
+    pid = fork();
+    if (pid == 0) {
+        close(control_fd);
+        taker();
+    }
+    if (handover_send(accept_request(control_fd), listen_fd, conns, TEST_CONNS) != HANDOVER_SUCCESS) {
+        fprintf(stderr, "FAIL: confirmed handover failed\n");
+        failed = 1;
+    }
+    for (uint32_t i = 0; i < TEST_CONNS; i++) close(conns[i].fd);
+    close(listen_fd);
+    for (uint32_t i = 0; i < TEST_CONNS; i++) {
+        unsigned char frame[HANDOVER_FRAME_SIZE];
+        make_frame(i, frame);
+        send(clients[i], frame + partial_len(i), HANDOVER_FRAME_SIZE - partial_len(i), MSG_NOSIGNAL);
+    }
+    unsigned char frame[HANDOVER_FRAME_SIZE];
+    make_frame(TEST_CONNS, frame);
+    int fresh = tcp_connect(port);
+    send(fresh, frame, sizeof(frame), MSG_NOSIGNAL);
+    if (wait_child(pid) != EXIT_SUCCESS) {
+        failed = 1;
+    } else {
+        printf("ok: %d connections in %d messages and the listener taken over, partial readings completed\n",
+               TEST_CONNS, (TEST_CONNS + HANDOVER_FDS_PER_MSG - 1) / HANDOVER_FDS_PER_MSG);
+    }
+    close(fresh);
+    for (uint32_t i = 0; i < TEST_CONNS; i++) close(clients[i]);
+    close(control_fd);
+    unlink(TEST_SOCKET);
+
+    printf("%s\n", failed ? "FAILED" : "PASSED");
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
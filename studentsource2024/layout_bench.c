@@ -0,0 +1,234 @@
+/**
+ * \author {AUTHOR}
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include "datamgr.h"
+
+#define UPDATES_PER_THREAD 20000000 // Readings every thread applies per run
+#define BLOCKS_PER_THREAD 100000    // Blocks every thread hands to datamgr_process_block() per run
+#define SENSORS_PER_ROOM 4
+#define BENCH_TS 1700000000         // Timestamp of every reading, the trackers' window never moves
+#define DEFAULT_SENSORS 1024
+
+/**
+ * the per-sensor state as the data manager kept it before the hot/cold split: metadata and history in one packed
+ * struct, so a cache line holds parts of neighbouring sensors
+ */
+typedef struct sensor_packed {
+    sensor_id_t sensor_id;
+    room_id_t room_id;
+    int room_index;
+    int history_count;
+    int history_pos;
+    sensor_value_t history[RUN_AVG_LENGTH];
+    sensor_value_t last_value;
+    sensor_ts_t last_ts;
+} sensor_packed_t;
+
+typedef struct bench_thread {
+    pthread_t thread;
+    int index;
+    int num_threads;
+    int num_sensors;
+    sensor_packed_t *packed;    /**< the layout under test, the other pointer is NULL */
+    sensor_hot_t *hot;
+    pthread_barrier_t *start;
+} bench_thread_t;
+
+typedef struct gateway_thread {
+    pthread_t thread;
+    int index;
+    int num_threads;
+    int num_sensors;
+    datamgr_t *mgr;
+    pthread_barrier_t *start;
+} gateway_thread_t;
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * Applies readings to the sensors of one thread: index, index + threads, index + 2 * threads, ... so neighbouring
+ * sensors belong to different threads, the way readings of interleaved sensors are spread over consumer threads
+ */
+static void *bench_run(void *arg) {
+    bench_thread_t *t = arg;
+    uint64_t rng = 0x9e3779b97f4a7c15ULL * (t->index + 1);
+    int s = t->index;
+
+    pthread_barrier_wait(t->start);
+    for (long i = 0; i < UPDATES_PER_THREAD; i++) {
+        rng ^= rng << 13;
+        rng ^= rng >> 7;
+        rng ^= rng << 17;
+        sensor_value_t value = (rng & 0xffff) / 1000.0;
+
+        if (t->packed != NULL) {
+            sensor_packed_t *sensor = &t->packed[s];
+            sensor->history[sensor->history_pos] = value;
+            sensor->history_pos = (sensor->history_pos + 1) % RUN_AVG_LENGTH;
+            if (sensor->history_count < RUN_AVG_LENGTH) sensor->history_count++;
+            sensor->last_value = value;
+            sensor->last_ts = i;
+        } else {
+            sensor_hot_t *sensor = &t->hot[s];
+            sensor->history[sensor->history_pos] = value;
+            sensor->history_pos = (sensor->history_pos + 1) % RUN_AVG_LENGTH;
+            if (sensor->history_count < RUN_AVG_LENGTH) sensor->history_count++;
+            sensor->sum += value;
+            sensor->last_ts = i;
+        }
+
+        s += t->num_threads;
+        if (s >= t->num_sensors) s = t->index;
+    }
+    return NULL;
+}
+
+/**
+ * Runs 'num_threads' threads over one layout
+ * \return nanoseconds per update, seen from the whole run
+ */
+static double bench_layout(int num_threads, int num_sensors, sensor_packed_t *packed, sensor_hot_t *hot) {
+    bench_thread_t threads[num_threads];
+    pthread_barrier_t start;
+
+    pthread_barrier_init(&start, NULL, num_threads + 1);
+    for (int i = 0; i < num_threads; i++) {
+        threads[i] = (bench_thread_t){.index = i, .num_threads = num_threads, .num_sensors = num_sensors,
+                                      .packed = packed, .hot = hot, .start = &start};
+        if (pthread_create(&threads[i].thread, NULL, bench_run, &threads[i]) != 0) {
+            fprintf(stderr, "Could not start benchmark thread %d.\n", i);
+            exit(EXIT_FAILURE);
+        }
+    }
+    pthread_barrier_wait(&start);
+    double begin = now();
+    for (int i = 0; i < num_threads; i++) pthread_join(threads[i].thread, NULL);
+    double elapsed = now() - begin;
+    pthread_barrier_destroy(&start);
+    return elapsed * 1e9 / ((double)UPDATES_PER_THREAD * num_threads);
+}
+
+/**
+ * Hands full blocks to the data manager the way a datamgr consumer thread does. Thread i owns rooms i, i + threads,
+ * ... and every block cycles over all sensors of its rooms, so neighbouring sensors and rooms belong to different
+ * threads. The values stay within [SET_MIN_TEMP, SET_MAX_TEMP] so no alerts are printed.
+ */
+static void *gateway_run(void *arg) {
+    gateway_thread_t *t = arg;
+    sensor_block_t block = {.count = SENSOR_BLOCK_CAPACITY};
+    int first = t->index * SENSORS_PER_ROOM, s = first;
+
+    pthread_barrier_wait(t->start);
+    for (long b = 0; b < BLOCKS_PER_THREAD; b++) {
+        for (uint32_t i = 0; i < SENSOR_BLOCK_CAPACITY; i++) {
+            block.id[i] = s + 1;
+            block.value[i] = SET_MIN_TEMP + (double)((b + i) % 100) * (SET_MAX_TEMP - SET_MIN_TEMP) / 100;
+            block.ts[i] = BENCH_TS;
+            s++;
+            if (s % SENSORS_PER_ROOM == 0) s += (t->num_threads - 1) * SENSORS_PER_ROOM;
+            if (s >= t->num_sensors) s = first;
+        }
+        datamgr_process_block(t->mgr, &block);
+    }
+    return NULL;
+}
+
+/**
+ * Runs 'num_threads' threads through datamgr_process_block() on one data manager
+ * \return nanoseconds per reading, seen from the whole run
+ */
+static double bench_gateway(int num_threads, int num_sensors, datamgr_t *mgr) {
+    gateway_thread_t threads[num_threads];
+    pthread_barrier_t start;
+
+    pthread_barrier_init(&start, NULL, num_threads + 1);
+    for (int i = 0; i < num_threads; i++) {
+        threads[i] = (gateway_thread_t){.index = i, .num_threads = num_threads, .num_sensors = num_sensors,
+                                        .mgr = mgr, .start = &start};
+        if (pthread_create(&threads[i].thread, NULL, gateway_run, &threads[i]) != 0) {
+            fprintf(stderr, "Could not start benchmark thread %d.\n", i);
+            exit(EXIT_FAILURE);
+        }
+    }
+    pthread_barrier_wait(&start);
+    double begin = now();
+    for (int i = 0; i < num_threads; i++) pthread_join(threads[i].thread, NULL);
+    double elapsed = now() - begin;
+    pthread_barrier_destroy(&start);
+    return elapsed * 1e9 / ((double)BLOCKS_PER_THREAD * SENSOR_BLOCK_CAPACITY * num_threads);
+}
+
+/**
+ * Creates a data manager for sensors 1..num_sensors, SENSORS_PER_ROOM consecutive sensors per room
+ */
+static datamgr_t *gateway_init(int num_sensors) {
+    datamgr_t *mgr = NULL;
+    FILE *map = tmpfile();
+
+    if (map == NULL) return NULL;
+    for (int s = 0; s < num_sensors; s++) fprintf(map, "%d %d\n", s / SENSORS_PER_ROOM + 1, s + 1);
+    rewind(map);
+    if (datamgr_init(&mgr, map) != DATAMGR_SUCCESS) mgr = NULL;
+    fclose(map);
+    return mgr;
+}
+
+int main(int argc, char *argv[]) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int num_threads = argc > 1 ? atoi(argv[1]) : (cpus > 1 ? (int)cpus : 2);
+    int num_sensors = argc > 2 ? atoi(argv[2]) : DEFAULT_SENSORS;
+
+    if (argc > 3 || num_threads < 1 || num_sensors < num_threads * SENSORS_PER_ROOM || num_sensors > UINT16_MAX) {
+        fprintf(stderr, "Usage: %s [threads] [sensors (>= %d * threads, < 65536)]\n", argv[0], SENSORS_PER_ROOM);
+        return EXIT_FAILURE;
+    }
+
+    sensor_packed_t *packed = calloc(num_sensors, sizeof(sensor_packed_t));
+    sensor_hot_t *hot = aligned_alloc(DATAMGR_CACHE_LINE, num_sensors * sizeof(sensor_hot_t));
+    if (packed == NULL || hot == NULL) {
+        fprintf(stderr, "Out of memory.\n");
+        return EXIT_FAILURE;
+    }
+    memset(hot, 0, num_sensors * sizeof(sensor_hot_t));
+
+    printf("%d sensors, %d updates per thread, %ld CPUs\n", num_sensors, UPDATES_PER_THREAD, cpus);
+    printf("packed: %zu bytes per sensor, hot/cold: %zu + %zu bytes per sensor\n",
+           sizeof(sensor_packed_t), sizeof(sensor_hot_t), sizeof(sensor_cold_t));
+    printf("%8s %14s %14s\n", "threads", "packed ns/op", "hot/cold ns/op");
+    for (int n = 1; n <= num_threads; n = (n < num_threads && n * 2 > num_threads) ? num_threads : n * 2) {
+        double ns_packed = bench_layout(n, num_sensors, packed, NULL);
+        double ns_hot = bench_layout(n, num_sensors, NULL, hot);
+        printf("%8d %14.2f %14.2f\n", n, ns_packed, ns_hot);
+    }
+
+    // The whole per-block path: lookup, room fusion and alert check under the room locks, trackers under their own
+    datamgr_t *mgr = gateway_init(num_sensors);
+    if (mgr == NULL) {
+        fprintf(stderr, "Could not create the data manager.\n");
+        return EXIT_FAILURE;
+    }
+    printf("datamgr_process_block, blocks of %d readings, %d sensors per room\n", SENSOR_BLOCK_CAPACITY,
+           SENSORS_PER_ROOM);
+    printf("%8s %14s\n", "threads", "ns/reading");
+    for (int n = 1; n <= num_threads; n = (n < num_threads && n * 2 > num_threads) ? num_threads : n * 2) {
+        printf("%8d %14.2f\n", n, bench_gateway(n, num_sensors, mgr));
+    }
+    datamgr_free(&mgr);
+
+    free(hot);
+    free(packed);
+    return EXIT_SUCCESS;
+}
@@ -1,192 +1,769 @@
+#define _GNU_SOURCE
 
-#include "sbuffer.h"
 #include "config.h"
+#include "threadpool.h"
+#include "pipeline.h"
+#include "datamgr.h"
+#include "sensor_db.h"
+#include "ackmgr.h"
+#include "stats.h"
 #include <stdlib.h>
 #include <stdio.h>
 #include <pthread.h>
 #include <unistd.h>
 #include <stdbool.h>
+#include <string.h>
+#include <inttypes.h>
+#include <stdatomic.h>
+#include <time.h>
+
+#define NUM_WORKERS 2 // Worker threads in the pool executing the storage tasks
+#define TASK_BATCH_SIZE 8 // Number of readings collected before they are handed to the pool in one task
+#ifndef DECODE_DELAY_US
+#define DECODE_DELAY_US 10000 // Simulated production delay of one reading, 0 replays the input as fast as possible
+#endif
+#ifndef STORE_DELAY_US
+#define STORE_DELAY_US 25000 // Simulated processing time of one stored reading, 0 stores as fast as possible
+#endif
+#define DECODE_SLOW_FACTOR 4 // The production delay is multiplied by this while the pipeline asks the source to slow down
+#define REORDER_WINDOW 64 // Readings the 'reorder' stage holds back to sort interleaved readings by timestamp
+#ifndef AGGREGATE_WINDOW_S
+#define AGGREGATE_WINDOW_S 3600 // Length of the windows the 'aggregate' stage summarizes every room over
+#endif
+#define PIPELINE_CONFIG "pipeline.cfg" // Stage graph, the built-in DEFAULT_PIPELINE is used when it is missing
+#define DEFAULT_PIPELINE "decode 1\nstore 1\n"
+#ifndef ACK_MODE
+#define ACK_MODE 0 // 1: acknowledge stored readings with "persisted up to" per sensor once they are durable
+#endif
+#ifndef STORAGE_DURABILITY
+#if ACK_MODE
+#define STORAGE_DURABILITY SENSOR_DB_SYNC_GROUP // Durability mode of the database, see sensor_db_durability_t
+#else
+#define STORAGE_DURABILITY SENSOR_DB_SYNC_NONE // Durability mode of the database, see sensor_db_durability_t
+#endif
+#endif
+
+// An ack promises the sensor that it may discard its readings, so it is only sent for readings an fdatasync covered
+_Static_assert(!ACK_MODE || STORAGE_DURABILITY != SENSOR_DB_SYNC_NONE, "ACK_MODE needs a STORAGE_DURABILITY that syncs");
+
+// Stored batches whose acks wait for the next fdatasync of the database (SENSOR_DB_SYNC_PERIODIC), oldest first
+typedef struct ack_queue {
+    pthread_mutex_t mutex;    // Protects the queue and 'stop'
+    pthread_cond_t wake;      // Wakes the syncer when it has to stop
+    bool stop;                // Set when the syncer has to end
+    sensor_db_t *db;          // Database the syncer syncs
+    pthread_t syncer;         // Syncs a database that is no longer written, see ack_syncer()
+    struct storage_batch *head;
+    struct storage_batch *tail;
+} ack_queue_t;
+
+// A batch of readings handed to the pool as a single task, freed by the task itself (or once its acks are sent)
+typedef struct storage_batch {
+    sensor_db_t *db;          // Database the readings are stored in
+    ackmgr_t *ack;            // Acknowledges the readings once durable, NULL when ACK_MODE is off
+    ack_queue_t *acks;        // Where the batch waits for a sync in SENSOR_DB_SYNC_PERIODIC mode
+    struct storage_batch *next; // Next batch in 'acks'
+    uint32_t syncs;           // Syncs of the database right after the batch was written, the next one covers it
+    sensor_block_t readings;  // The readings, column by column
+} storage_batch_t;
+
+// State of the 'store' stage, shared by all threads the stage runs on
+typedef struct store_stage {
+    sensor_db_t *db;          // Database the readings are stored in
+    ackmgr_t *ack;            // Acknowledges the readings once durable, NULL when ACK_MODE is off
+    ack_queue_t *acks;        // Batches waiting for a sync before their acks are sent
+    threadpool_t *pool;       // Pool executing the batched storage work
+    pthread_mutex_t mutex;    // Protects 'batch'
+    storage_batch_t *batch;   // Batch being filled, NULL when none is open
+} store_stage_t;
+
+// State of the 'decode' stage
+typedef struct decode_stage {
+    FILE *input;              // The binary sensor data file
+    ackmgr_t *ack;            // Registers every decoded reading, NULL when ACK_MODE is off
+    useconds_t base_delay;    // Production delay at full rate
+    useconds_t delay;         // Current production delay, raised under flow control
+    uint32_t slowdowns;       // Number of times the pipeline asked to slow down
+    uint32_t pauses;          // Number of times the pipeline paused the stage
+} decode_stage_t;
+
+// When the last reading of every sensor was decoded, sampled by the 'alert' stage for the ingest-to-alert latency
+typedef struct latency_probe {
+    _Atomic uint64_t decoded_ns;
+    _Atomic sensor_ts_t ts;   // Timestamp of that reading, a newer reading of the sensor invalidates the sample
+} latency_probe_t;
+
+static latency_probe_t latency_probes[UINT16_MAX + 1];
+
+static uint64_t monotonic_ns(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000ull + now.tv_nsec;
+}
+
+// State of the 'dedup' stage: the timestamp of the last reading of every sensor id
+typedef struct dedup_stage {
+    ackmgr_t *ack;            // Resolves the dropped readings, NULL when ACK_MODE is off
+    pthread_mutex_t mutex;
+    sensor_ts_t last_ts[UINT16_MAX + 1];
+} dedup_stage_t;
+
+// A reading held back by the 'reorder' stage, 'seq' keeps readings with the same timestamp in arrival order
+typedef struct reorder_entry {
+    sensor_ts_t ts;
+    uint64_t seq;
+    sensor_value_t value;
+    sensor_id_t id;
+} reorder_entry_t;
+
+// State of the 'reorder' stage: a min-heap on (ts, seq) of the readings held back
+typedef struct reorder_stage {
+    pthread_mutex_t mutex;
+    reorder_entry_t heap[REORDER_WINDOW + SENSOR_BLOCK_CAPACITY];
+    uint32_t size;
+    uint64_t next_seq;
+    sensor_ts_t released;     // Newest timestamp passed on so far
+    uint32_t late;            // Readings that arrived after a newer reading was passed on already
+} reorder_stage_t;
+
+// Summary of the readings of one room in the current window
+typedef struct aggregate_window {
+    sensor_ts_t start;        // First second of the window
+    uint32_t count;           // Readings in the window, 0 when the room has no open window
+    sensor_value_t sum;
+    sensor_value_t min;
+    sensor_value_t max;
+} aggregate_window_t;
+
+// State of the 'aggregate' stage: the open window of every room id
+typedef struct aggregate_stage {
+    datamgr_t *datamgr;       // Resolves the rooms of blocks that did not go through 'enrich'
+    pthread_mutex_t mutex;
+    uint32_t late;            // Readings for a window that was closed already
+    aggregate_window_t windows[UINT16_MAX + 1];
+} aggregate_stage_t;
 
-#define NUM_THREADS 3 // One producer and two consumers
+/**
+ * 'decode' source stage
+ * Reads the next sensor reading from the binary input file
+ * @param ctx Pointer to the decode_stage_t
+ * @param reading Filled with the decoded reading
+ * @return 1 if a reading was decoded, 0 at the end of the file
+ */
+int decode_stage(void *ctx, sensor_data_t *reading) {
+    decode_stage_t *decode = (decode_stage_t *)ctx;
+    FILE *sensor_input = decode->input;
+
+    if ((fread(&reading->id, sizeof(sensor_id_t), 1, sensor_input) != 1) ||
+        (fread(&reading->value, sizeof(sensor_value_t), 1, sensor_input) != 1) ||
+        (fread(&reading->ts, sizeof(sensor_ts_t), 1, sensor_input) != 1)) {
+        return 0;
+    }
+    stats_add(STATS_READINGS, 1);
+    stats_add(STATS_BYTES, sizeof(reading->id) + sizeof(reading->value) + sizeof(reading->ts));
+    if (decode->ack != NULL && ackmgr_received(decode->ack, reading) != ACKMGR_SUCCESS) {
+        fprintf(stderr, "Failed to track reading of SensorID=%d for acknowledgement\n", reading->id);
+    }
 
-pthread_mutex_t csv_mutex; // Mutex for synchronizing access to the output file
+    if (decode->delay > 0) usleep(decode->delay); // Simulate delay in data production
+    atomic_store_explicit(&latency_probes[reading->id].decoded_ns, monotonic_ns(), memory_order_relaxed);
+    atomic_store_explicit(&latency_probes[reading->id].ts, reading->ts, memory_order_release);
+    return 1;
+}
 
-// Struct to hold arguments for thread functions
-typedef struct thread_parameters {
-    sbuffer_t *shared_buf;    // Pointer to the shared buffer
-    FILE *sensor_file;        // Pointer to the sensor data file
-} thread_parameters_t;
+// The flow control levels of the pipeline go to the sensor nodes as they are
+_Static_assert((int)PIPELINE_FLOW_GO == SENSOR_FLOW_GO && (int)PIPELINE_FLOW_SLOW == SENSOR_FLOW_SLOW
+               && (int)PIPELINE_FLOW_PAUSE == SENSOR_FLOW_PAUSE, "pipeline and sensor flow levels differ");
 
 /**
- * Opens a file for reading or appending
- * @param filename The file name
- * @param append Flag to indicate append mode (true for append, false for overwrite)
- * @return FILE pointer on success, NULL on failure
+ * Tells the sensors to change their rate, see sensor_flow_t. Like the acks, the frame is printed: the readings come from
+ * a file, a connection manager would send SENSOR_FLOW_FRAME(level) on the connection of every sensor.
  */
-FILE *initialize_file(const char *filename, bool append) {
-    FILE *file_ptr;
-    file_ptr = fopen(filename, append ? "a" : "w");
-    if (!file_ptr) {
-        perror("Unable to open the specified file");
-    }
-    return file_ptr;
+static void send_flow(pipeline_flow_t level) {
+    static const char *const names[] = {"go", "slow down", "pause"};
+    printf("Flow: sensors told to %s (frame %ld)\n", names[level], (long)SENSOR_FLOW_FRAME(level));
 }
 
 /**
- * Writes sensor data into a CSV file
- * @param output_file File pointer to the output CSV
- * @param sensor_id ID of the sensor
- * @param sensor_value Value recorded by the sensor
- * @param timestamp Timestamp of the sensor data
- * @return 0 if successful, -1 if an error occurs
+ * Flow control of the 'decode' stage, called by the pipeline when its queues fill up or drain
+ * The pipeline does not call a paused source, so only the production rate has to follow the level here
+ * @param ctx Pointer to the decode_stage_t
+ * @param level The new flow control level
  */
-int log_sensor_data(FILE *output_file, sensor_id_t sensor_id, sensor_value_t sensor_value, sensor_ts_t timestamp) {
-    if (output_file == NULL) return -1;
+void decode_stage_flow(void *ctx, pipeline_flow_t level) {
+    decode_stage_t *decode = (decode_stage_t *)ctx;
 
-    if (fprintf(output_file, "%d,%.2f,%ld\n", sensor_id, sensor_value, timestamp) < 0) {
-        perror("Error occurred while writing to file");
-        return -1;
+    if (level == PIPELINE_FLOW_SLOW && decode->delay == decode->base_delay) decode->slowdowns++;
+    if (level == PIPELINE_FLOW_PAUSE) decode->pauses++;
+    decode->delay = level == PIPELINE_FLOW_GO ? decode->base_delay : decode->base_delay * DECODE_SLOW_FACTOR;
+    send_flow(level);
+}
+
+/**
+ * 'dedup' stage
+ * Drops a reading when the same sensor already delivered a reading with the same timestamp right before
+ * @param ctx Pointer to the dedup_stage_t
+ * @param reading The reading to check
+ * @return false for a duplicate
+ */
+bool dedup_stage(void *ctx, sensor_data_t *reading) {
+    dedup_stage_t *dedup = (dedup_stage_t *)ctx;
+    bool duplicate;
+
+    pthread_mutex_lock(&dedup->mutex);
+    duplicate = dedup->last_ts[reading->id] == reading->ts;
+    dedup->last_ts[reading->id] = reading->ts;
+    pthread_mutex_unlock(&dedup->mutex);
+
+    if (duplicate) {
+        stats_add(STATS_DUPLICATES, 1); // Counted in the thread's own shard, the total is printed at shutdown
+        if (dedup->ack != NULL) ackmgr_dropped(dedup->ack, reading);
     }
+    return !duplicate;
+}
+
+static bool reorder_before(const reorder_entry_t *a, const reorder_entry_t *b) {
+    return a->ts < b->ts || (a->ts == b->ts && a->seq < b->seq);
+}
 
-    if (fflush(output_file) != 0) {
-        perror("Failed to flush data to file");
-        return -1;
+static void reorder_push(reorder_stage_t *reorder, reorder_entry_t entry) {
+    uint32_t i = reorder->size++;
+    while (i > 0 && reorder_before(&entry, &reorder->heap[(i - 1) / 2])) {
+        reorder->heap[i] = reorder->heap[(i - 1) / 2];
+        i = (i - 1) / 2;
     }
+    reorder->heap[i] = entry;
+}
 
-    return 0;
+static reorder_entry_t reorder_pop(reorder_stage_t *reorder) {
+    reorder_entry_t oldest = reorder->heap[0];
+    reorder_entry_t last = reorder->heap[--reorder->size];
+    uint32_t i = 0;
+    while (2 * i + 1 < reorder->size) {
+        uint32_t child = 2 * i + 1;
+        if (child + 1 < reorder->size && reorder_before(&reorder->heap[child + 1], &reorder->heap[child])) child++;
+        if (!reorder_before(&reorder->heap[child], &last)) break;
+        reorder->heap[i] = reorder->heap[child];
+        i = child;
+    }
+    reorder->heap[i] = last;
+    return oldest;
 }
 
 /**
- * Producer thread function
- * Reads sensor data from a binary file and pushes it to the shared buffer
- * @param args Pointer to the thread parameters
- * @return NULL
+ * Moves the oldest held back readings into 'block' until at most 'keep' are held back
  */
-void *producer_thread(void *args) {
-    thread_parameters_t *parameters = (thread_parameters_t *)args;
-    sbuffer_t *buffer = parameters->shared_buf;
-    FILE *sensor_input = parameters->sensor_file;
+static void reorder_release(reorder_stage_t *reorder, sensor_block_t *block, uint32_t keep) {
+    block->count = 0;
+    block->has_room = false;
+    while (reorder->size > keep && block->count < SENSOR_BLOCK_CAPACITY) {
+        reorder_entry_t entry = reorder_pop(reorder);
+        if (entry.ts < reorder->released) reorder->late++;
+        else reorder->released = entry.ts;
+        block->id[block->count] = entry.id;
+        block->value[block->count] = entry.value;
+        block->ts[block->count] = entry.ts;
+        block->count++;
+    }
+}
 
-    sensor_data_t sensor_entry;
+/**
+ * 'reorder' stage
+ * Readings of several connections interleave, so a reading can arrive after newer ones. The stage holds back the last
+ * REORDER_WINDOW readings and passes on the oldest one for every new one, which sorts readings by timestamp as long as
+ * none of them is more than REORDER_WINDOW readings late. A reading that is later than that is passed on as soon as
+ * possible and counted. Only keeps the order on a single thread.
+ * @param ctx Pointer to the reorder_stage_t
+ * @param block The readings that arrived, replaced by the readings that leave the window
+ */
+void reorder_stage(void *ctx, sensor_block_t *block) {
+    reorder_stage_t *reorder = (reorder_stage_t *)ctx;
 
-    if (sensor_input == NULL) {
-        fprintf(stderr, "Error: Input file is not available.\n");
-        pthread_exit(NULL);
+    pthread_mutex_lock(&reorder->mutex);
+    for (uint32_t i = 0; i < block->count; i++) {
+        reorder_push(reorder, (reorder_entry_t){block->ts[i], reorder->next_seq++, block->value[i], block->id[i]});
     }
+    reorder_release(reorder, block, REORDER_WINDOW);
+    pthread_mutex_unlock(&reorder->mutex);
+}
+
+/**
+ * Hands out the readings the 'reorder' stage still holds at the end of the stream, oldest first
+ */
+void reorder_stage_drain(void *ctx, sensor_block_t *block) {
+    reorder_stage_t *reorder = (reorder_stage_t *)ctx;
+
+    pthread_mutex_lock(&reorder->mutex);
+    reorder_release(reorder, block, 0);
+    pthread_mutex_unlock(&reorder->mutex);
+}
+
+void reorder_stage_finish(void *ctx) {
+    reorder_stage_t *reorder = (reorder_stage_t *)ctx;
+    if (reorder->late > 0) printf("Reorder: %" PRIu32 " readings arrived too late to be put in order\n", reorder->late);
+}
+
+/**
+ * 'enrich' stage
+ * Fills in the room of every reading from the sensor map, for the stages fused behind it, and drops readings of
+ * sensors that are not in the map
+ * @param ctx Pointer to the data manager
+ * @param block The readings to enrich
+ */
+void enrich_stage(void *ctx, sensor_block_t *block) {
+    datamgr_enrich_block((datamgr_t *)ctx, block);
+}
+
+static void aggregate_print(room_id_t room, const aggregate_window_t *window) {
+    printf("Room %d: %ld to %ld avg %.2f min %.2f max %.2f over %" PRIu32 " readings\n", room, window->start,
+           window->start + AGGREGATE_WINDOW_S, window->sum / window->count, window->min, window->max, window->count);
+}
 
-    // Read data from file and insert into shared buffer
-    while ((fread(&sensor_entry.id, sizeof(sensor_id_t), 1, sensor_input) == 1) &&
-           (fread(&sensor_entry.value, sizeof(sensor_value_t), 1, sensor_input) == 1) &&
-           (fread(&sensor_entry.ts, sizeof(sensor_ts_t), 1, sensor_input) == 1)) {
+/**
+ * 'aggregate' stage
+ * Summarizes the readings of every room over windows of AGGREGATE_WINDOW_S seconds and prints a window once the first
+ * reading of a later one arrives. The readings must come in timestamp order (see 'reorder'), a reading for a window
+ * that was printed already is counted and left out. The rooms come from 'enrich' when it is fused in front, otherwise
+ * they are looked up here.
+ * @param ctx Pointer to the aggregate_stage_t
+ * @param block The readings to add, passed on unchanged
+ */
+void aggregate_stage(void *ctx, sensor_block_t *block) {
+    aggregate_stage_t *aggregate = (aggregate_stage_t *)ctx;
 
-        if (sbuffer_insert(buffer, &sensor_entry) != SBUFFER_SUCCESS) {
-            fprintf(stderr, "Buffer insertion failed for data: ID=%d\n", sensor_entry.id);
+    pthread_mutex_lock(&aggregate->mutex);
+    for (uint32_t i = 0; i < block->count; i++) {
+        room_id_t room = block->room[i];
+        if (!block->has_room && datamgr_get_room_id(aggregate->datamgr, block->id[i], &room) != DATAMGR_SUCCESS) {
+            continue;
         }
+        aggregate_window_t *window = &aggregate->windows[room];
+        sensor_ts_t start = block->ts[i] - block->ts[i] % AGGREGATE_WINDOW_S;
+        if (window->count > 0 && start < window->start) {
+            aggregate->late++;
+            continue;
+        }
+        if (window->count > 0 && start > window->start) {
+            aggregate_print(room, window);
+            window->count = 0;
+        }
+        if (window->count == 0) {
+            *window = (aggregate_window_t){start, 0, 0.0, block->value[i], block->value[i]};
+        }
+        window->count++;
+        window->sum += block->value[i];
+        if (block->value[i] < window->min) window->min = block->value[i];
+        if (block->value[i] > window->max) window->max = block->value[i];
+    }
+    pthread_mutex_unlock(&aggregate->mutex);
+}
 
-        usleep(10000); // Simulate delay in data production
+/**
+ * Prints the windows that are still open once all readings went through the 'aggregate' stage
+ */
+void aggregate_stage_finish(void *ctx) {
+    aggregate_stage_t *aggregate = (aggregate_stage_t *)ctx;
+
+    for (uint32_t room = 0; room <= UINT16_MAX; room++) {
+        if (aggregate->windows[room].count > 0) aggregate_print((room_id_t)room, &aggregate->windows[room]);
+    }
+    if (aggregate->late > 0) {
+        printf("Aggregate: %" PRIu32 " readings arrived after their window was closed\n", aggregate->late);
     }
+}
 
-    // Signal end-of-stream to consumers
-    sensor_data_t end_signal = {0, 0.0, 0};
-    for (int i = 0; i < NUM_THREADS - 1; i++) {
-        sbuffer_insert(buffer, &end_signal);
+/**
+ * 'alert' stage
+ * Reports readings outside [SET_MIN_TEMP, SET_MAX_TEMP], the readings themselves are always passed on
+ * The range check runs branch-free over the value column first, only flagged readings are looked at again
+ */
+void alert_stage(void *ctx, sensor_block_t *block) {
+    uint8_t too_cold[SENSOR_BLOCK_CAPACITY];
+    uint8_t too_hot[SENSOR_BLOCK_CAPACITY];
+    uint32_t flagged = 0;
+    (void)ctx;
+
+    for (uint32_t i = 0; i < block->count; i++) {
+        too_cold[i] = block->value[i] < SET_MIN_TEMP;
+        too_hot[i] = block->value[i] > SET_MAX_TEMP;
+        flagged += too_cold[i] | too_hot[i];
     }
 
-    pthread_exit(NULL);
+    uint64_t now = monotonic_ns();
+    for (uint32_t i = 0; i < block->count; i++) {
+        latency_probe_t *probe = &latency_probes[block->id[i]];
+        if (atomic_load_explicit(&probe->ts, memory_order_acquire) != block->ts[i]) continue;
+        uint64_t decoded = atomic_load_explicit(&probe->decoded_ns, memory_order_relaxed);
+        if (decoded > now) continue;
+        stats_record(STATS_CHECK_NS, now - decoded);
+        if (too_cold[i] | too_hot[i]) stats_record(STATS_ALERT_NS, now - decoded);
+    }
+    if (flagged == 0) return;
+    stats_add(STATS_ALERTS, flagged);
+
+    for (uint32_t i = 0; i < block->count; i++) {
+        if (too_cold[i]) {
+            printf("Sensor %d reports it's too cold (%.2f)\n", block->id[i], block->value[i]);
+        } else if (too_hot[i]) {
+            printf("Sensor %d reports it's too hot (%.2f)\n", block->id[i], block->value[i]);
+        }
+    }
 }
 
 /**
- * Consumer thread function
- * Consumes sensor data from the shared buffer and writes it to the CSV file
- * @param args Pointer to the thread parameters
- * @return NULL
+ * 'forward' stage
+ * Passes every reading on unchanged, used to add a queue (and threads) at a point in the graph
  */
-void *consumer_thread(void *args) {
-    thread_parameters_t *parameters = (thread_parameters_t *)args;
-    sbuffer_t *buffer = parameters->shared_buf;
-    FILE *output_csv = parameters->sensor_file;
+bool forward_stage(void *ctx, sensor_data_t *reading) {
+    (void)ctx;
+    (void)reading;
+    return true;
+}
 
-    sensor_data_t retrieved_data;
+/**
+ * 'datamgr' stage
+ * Hands the block to the data manager (running averages, heavy-hitter tracking), the readings are passed on unchanged
+ */
+void datamgr_stage(void *ctx, sensor_block_t *block) {
+    datamgr_process_block((datamgr_t *)ctx, block);
+}
 
-    while (true) {
-        int status = sbuffer_remove(buffer, &retrieved_data);
+/**
+ * Prints the final top sensors and rooms once all readings went through the 'datamgr' stage
+ */
+void datamgr_stage_finish(void *ctx) {
+    datamgr_print_top((datamgr_t *)ctx, stdout);
+}
 
-        if (status == SBUFFER_FAILURE) {
-            fprintf(stderr, "Buffer read encountered an error.\n");
-            continue;
+/**
+ * Delivers a "persisted up to" ack. There is no connection back to the sensors in this gateway (the readings come
+ * from a file), so the ack is printed; a connection manager would send 'up_to' on the connection of the sensor.
+ */
+static void send_ack(void *arg, sensor_id_t sensor_id, sensor_ts_t up_to) {
+    (void)arg;
+    printf("Ack: SensorID=%d persisted up to Timestamp=%ld\n", sensor_id, up_to);
+}
+
+/**
+ * Sends the acks of the queued batches that an fdatasync covered: a sync counted after a batch was written started
+ * after its write, the database holds its lock for both
+ * @param acks The queue of batches waiting for a sync
+ * @param db The database, NULL when it is closed (and synced) already: all batches are released
+ */
+static void release_acks(ack_queue_t *acks, sensor_db_t *db) {
+    sensor_db_sync_stats_t sync_stats = {.syncs = 0};
+    if (db != NULL) sensor_db_get_sync_stats(db, &sync_stats);
+
+    pthread_mutex_lock(&acks->mutex);
+    while (acks->head != NULL && (db == NULL || acks->head->syncs < sync_stats.syncs)) {
+        storage_batch_t *batch = acks->head;
+        acks->head = batch->next;
+        ackmgr_committed(batch->ack, &batch->readings);
+        free(batch);
+    }
+    if (acks->head == NULL) acks->tail = NULL;
+    pthread_mutex_unlock(&acks->mutex);
+}
+
+/**
+ * Timer of the 'store' stage in SENSOR_DB_SYNC_PERIODIC mode: a write only syncs when it finds the sync interval passed,
+ * so once the input goes quiet the last batches would wait for the close. Every sync interval the database is synced
+ * here if it is due, and the acks of the batches that sync covered are sent, within two intervals of their write.
+ * @param arg Pointer to the ack_queue_t
+ */
+static void *ack_syncer(void *arg) {
+    ack_queue_t *acks = (ack_queue_t *)arg;
+
+    pthread_mutex_lock(&acks->mutex);
+    while (!acks->stop) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += SENSOR_DB_SYNC_INTERVAL_MS / 1000;
+        deadline.tv_nsec += SENSOR_DB_SYNC_INTERVAL_MS % 1000 * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
         }
+        pthread_cond_timedwait(&acks->wake, &acks->mutex, &deadline);
+        if (acks->stop) break;
+        pthread_mutex_unlock(&acks->mutex);
+        if (sensor_db_sync_due(acks->db) != SENSOR_DB_SUCCESS) fprintf(stderr, "Failed to sync the database\n");
+        release_acks(acks, acks->db);
+        pthread_mutex_lock(&acks->mutex);
+    }
+    pthread_mutex_unlock(&acks->mutex);
+    return NULL;
+}
 
-        if (retrieved_data.id == 0) {
-            break; // End-of-stream signal
+/**
+ * Storage task executed by a pool worker
+ * Stores a whole batch of readings as one block in the database and acknowledges them once they are durable
+ * @param args Pointer to a heap allocated storage_batch_t, freed here or when its acks are sent
+ */
+void storage_batch_task(void *args) {
+    storage_batch_t *batch = (storage_batch_t *)args;
+    sensor_block_t *readings = &batch->readings;
+    sensor_db_t *db = batch->db;
+    ack_queue_t *acks = batch->ack != NULL ? batch->acks : NULL;
+    uint32_t count = readings->count;
+
+    // The database serializes concurrent writers itself
+    uint64_t start = monotonic_ns();
+    int status = sensor_db_write_block(db, readings);
+    stats_record(STATS_STORE_NS, monotonic_ns() - start);
+    if (status != SENSOR_DB_SUCCESS) {
+        fprintf(stderr, "Failed to log a batch of %u readings\n", count);
+    } else {
+        stats_add(STATS_STORED, count);
+        for (uint32_t i = 0; i < count; i++) {
+            printf("Logged: SensorID=%d, Value=%.2f, Timestamp=%ld\n",
+                   readings->id[i], readings->value[i], readings->ts[i]);
         }
+    }
+
+    if (status == SENSOR_DB_SUCCESS && acks != NULL && STORAGE_DURABILITY == SENSOR_DB_SYNC_PERIODIC) {
+        // In the page cache only, the acks wait for the next periodic sync (which this write may have done)
+        sensor_db_sync_stats_t sync_stats;
+        sensor_db_get_sync_stats(db, &sync_stats);
+        batch->syncs = sync_stats.syncs;
+        batch->next = NULL;
+        pthread_mutex_lock(&acks->mutex);
+        if (acks->tail != NULL) acks->tail->next = batch;
+        else acks->head = batch;
+        acks->tail = batch;
+        pthread_mutex_unlock(&acks->mutex);
+        batch = NULL;
+    } else if (status == SENSOR_DB_SUCCESS && acks != NULL) {
+        ackmgr_committed(batch->ack, readings);   // SENSOR_DB_SYNC_GROUP and _DIRECT synced the block already
+    }
+    if (acks != NULL && STORAGE_DURABILITY == SENSOR_DB_SYNC_PERIODIC) release_acks(acks, db);
+
+    usleep(STORE_DELAY_US * count); // Simulate data processing time
 
-        // Protect file write with mutex
-        pthread_mutex_lock(&csv_mutex);
+    free(batch);
+}
 
-        if (log_sensor_data(output_csv, retrieved_data.id, retrieved_data.value, retrieved_data.ts) != 0) {
-            fprintf(stderr, "Failed to log data: ID=%d\n", retrieved_data.id);
-        } else {
-            printf("Logged: SensorID=%d, Value=%.2f, Timestamp=%ld\n", 
-                   retrieved_data.id, retrieved_data.value, retrieved_data.ts);
+/**
+ * Hands a filled batch to the pool, the batch is owned by the task from then on
+ * @param pool The pool executing the task
+ * @param batch The batch to submit
+ */
+static void submit_batch(threadpool_t *pool, storage_batch_t *batch) {
+    if (threadpool_submit(pool, storage_batch_task, batch) != THREADPOOL_SUCCESS) {
+        fprintf(stderr, "Failed to submit a batch of %u readings, running it inline.\n", batch->readings.count);
+        storage_batch_task(batch);
+    }
+}
+
+/**
+ * 'store' stage
+ * Appends the block to the open batch and submits the batch as a storage task to the pool once it holds TASK_BATCH_SIZE readings
+ * @param ctx Pointer to the store_stage_t
+ * @param block The readings to store, passed on unchanged to a next stage if there is one
+ */
+void store_stage(void *ctx, sensor_block_t *block) {
+    store_stage_t *store = (store_stage_t *)ctx;
+    uint32_t copied = 0;
+
+    pthread_mutex_lock(&store->mutex);
+    while (copied < block->count) {
+        if (store->batch == NULL) {
+            store->batch = malloc(sizeof(storage_batch_t));
+            if (store->batch == NULL) {
+                fprintf(stderr, "Failed to allocate a batch, dropping %u readings\n", block->count - copied);
+                break;
+            }
+            store->batch->db = store->db;
+            store->batch->ack = store->ack;
+            store->batch->acks = store->acks;
+            store->batch->readings.count = 0;
+            store->batch->readings.has_room = false;
         }
 
-        pthread_mutex_unlock(&csv_mutex);
+        // Copy column by column, as much as fits in the batch
+        sensor_block_t *readings = &store->batch->readings;
+        uint32_t n = block->count - copied;
+        if (n > SENSOR_BLOCK_CAPACITY - readings->count) n = SENSOR_BLOCK_CAPACITY - readings->count;
+        memcpy(&readings->id[readings->count], &block->id[copied], n * sizeof(sensor_id_t));
+        memcpy(&readings->value[readings->count], &block->value[copied], n * sizeof(sensor_value_t));
+        memcpy(&readings->ts[readings->count], &block->ts[copied], n * sizeof(sensor_ts_t));
+        readings->count += n;
+        copied += n;
+
+        if (readings->count >= TASK_BATCH_SIZE) {
+            submit_batch(store->pool, store->batch);
+            store->batch = NULL;
+        }
+    }
+    pthread_mutex_unlock(&store->mutex);
+}
 
-        usleep(25000); // Simulate data processing time
+/**
+ * Flushes the last, partially filled batch of the 'store' stage
+ */
+void store_stage_finish(void *ctx) {
+    store_stage_t *store = (store_stage_t *)ctx;
+    if (store->batch != NULL) {
+        submit_batch(store->pool, store->batch);
+        store->batch = NULL;
     }
+}
 
-    pthread_exit(NULL);
+/**
+ * Readings the 'store' stage handed to the pool that are not stored yet, estimated from the unfinished tasks
+ */
+size_t store_stage_backlog(void *ctx) {
+    store_stage_t *store = (store_stage_t *)ctx;
+    return (size_t)threadpool_pending(store->pool) * TASK_BATCH_SIZE;
 }
 
 /**
  * Main function
- * Sets up the shared buffer, threads, and synchronization primitives
+ * Sets up the thread pool, loads the stage graph and runs it
  */
 int main() {
-    // Initialize the mutex for file access
-    pthread_mutex_init(&csv_mutex, NULL);
-
-    // Open the input and output files
+    // Open the input file and the database
     FILE *sensor_data_file = fopen("sensor_data", "rb");
-    FILE *csv_output_file = initialize_file("sensor_data_out.csv", false);
+    sensor_db_t *db;
 
-    if (!sensor_data_file || !csv_output_file) {
+    if (!sensor_data_file || sensor_db_open(&db, "sensor_data_out.csv", false) != SENSOR_DB_SUCCESS) {
         fprintf(stderr, "Error: Could not open required files.\n");
         exit(EXIT_FAILURE);
     }
 
-    // Initialize the shared buffer
-    sbuffer_t *shared_buffer;
-    if (sbuffer_init(&shared_buffer) != SBUFFER_SUCCESS) {
-        fprintf(stderr, "Error: Failed to initialize shared buffer.\n");
+    if (sensor_db_set_durability(db, STORAGE_DURABILITY, SENSOR_DB_SYNC_INTERVAL_MS) != SENSOR_DB_SUCCESS) {
+        fprintf(stderr, "Error: Could not set the durability mode of the database.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    // Load the sensor-room map into the data manager and the room index of the database
+    FILE *sensor_map_file = fopen("room_sensor.map", "r");
+    datamgr_t *datamgr;
+    if (!sensor_map_file || datamgr_init(&datamgr, sensor_map_file) != DATAMGR_SUCCESS) {
+        fprintf(stderr, "Error: Could not load room_sensor.map.\n");
+        exit(EXIT_FAILURE);
+    }
+    rewind(sensor_map_file);
+    if (sensor_db_load_room_map(db, sensor_map_file) != SENSOR_DB_SUCCESS) {
+        fprintf(stderr, "Error: Could not load room_sensor.map into the database.\n");
+        exit(EXIT_FAILURE);
+    }
+    fclose(sensor_map_file);
+
+    // Track the readings for persistence acknowledgements
+    ackmgr_t *ack = NULL;
+    if (ACK_MODE && ackmgr_init(&ack, send_ack, NULL) != ACKMGR_SUCCESS) {
+        fprintf(stderr, "Error: Failed to initialize the ack manager.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    // Start the pool executing the storage work
+    threadpool_t *pool;
+    if (threadpool_init(&pool, NUM_WORKERS) != THREADPOOL_SUCCESS) {
+        fprintf(stderr, "Error: Failed to initialize the thread pool.\n");
         exit(EXIT_FAILURE);
     }
 
-    // Prepare thread arguments
-    thread_parameters_t producer_args = {shared_buffer, sensor_data_file};
-    thread_parameters_t consumer_args = {shared_buffer, csv_output_file};
+    // Stages that can be used in the pipeline configuration
+    static dedup_stage_t dedup_state;
+    static reorder_stage_t reorder_state = {.mutex = PTHREAD_MUTEX_INITIALIZER};
+    static aggregate_stage_t aggregate_state = {.mutex = PTHREAD_MUTEX_INITIALIZER};
+    decode_stage_t decode_state = {sensor_data_file, ack, DECODE_DELAY_US, DECODE_DELAY_US, 0, 0};
+    static ack_queue_t ack_queue = {.mutex = PTHREAD_MUTEX_INITIALIZER, .wake = PTHREAD_COND_INITIALIZER};
+    store_stage_t store_state = {db, ack, &ack_queue, pool, PTHREAD_MUTEX_INITIALIZER, NULL};
+    dedup_state.ack = ack;
+    aggregate_state.datamgr = datamgr;
+    pthread_mutex_init(&dedup_state.mutex, NULL);
+    const pipeline_stage_def_t stages[] = {
+        {.name = "decode", .produce = decode_stage, .flow = decode_stage_flow, .ctx = &decode_state},
+        {.name = "dedup", .process = dedup_stage, .ctx = &dedup_state},
+        {.name = "reorder", .process_block = reorder_stage, .drain = reorder_stage_drain, .finish = reorder_stage_finish,
+         .ctx = &reorder_state, .single_thread = true},
+        {.name = "enrich", .process_block = enrich_stage, .ctx = datamgr},
+        {.name = "aggregate", .process_block = aggregate_stage, .finish = aggregate_stage_finish,
+         .ctx = &aggregate_state},
+        {.name = "alert", .process_block = alert_stage},
+        {.name = "datamgr", .process_block = datamgr_stage, .finish = datamgr_stage_finish, .ctx = datamgr},
+        {.name = "forward", .process = forward_stage},
+        {.name = "store", .process_block = store_stage, .finish = store_stage_finish, .backlog = store_stage_backlog,
+         .ctx = &store_state},
+    };
+
+    bool syncing = ack != NULL && STORAGE_DURABILITY == SENSOR_DB_SYNC_PERIODIC;
+    ack_queue.db = db;
+    if (syncing && pthread_create(&ack_queue.syncer, NULL, ack_syncer, &ack_queue) != 0) {
+        fprintf(stderr, "Error: Failed to start the periodic sync.\n");
+        exit(EXIT_FAILURE);
+    }
 
-    // Create threads
-    pthread_t threads[NUM_THREADS];
-    pthread_create(&threads[0], NULL, producer_thread, &producer_args); // Producer thread
-    pthread_create(&threads[1], NULL, consumer_thread, &consumer_args); // Consumer thread 1
-    pthread_create(&threads[2], NULL, consumer_thread, &consumer_args); // Consumer thread 2
+    pipeline_t *pipeline;
+    if (pipeline_init(&pipeline, stages, sizeof(stages) / sizeof(stages[0])) != PIPELINE_SUCCESS) {
+        fprintf(stderr, "Error: Failed to initialize the pipeline.\n");
+        exit(EXIT_FAILURE);
+    }
 
-    // Wait for all threads to complete
-    for (int i = 0; i < NUM_THREADS; i++) {
-        pthread_join(threads[i], NULL);
+    // Load the stage graph, fall back to the built-in one when there is no configuration file
+    FILE *pipeline_config = fopen(PIPELINE_CONFIG, "r");
+    if (pipeline_config == NULL) {
+        printf("No %s found, using the default pipeline.\n", PIPELINE_CONFIG);
+        pipeline_config = fmemopen(DEFAULT_PIPELINE, sizeof(DEFAULT_PIPELINE) - 1, "r");
+    }
+    if (pipeline_load(pipeline, pipeline_config) != PIPELINE_SUCCESS) {
+        fprintf(stderr, "Error: Invalid pipeline configuration.\n");
+        exit(EXIT_FAILURE);
     }
+    fclose(pipeline_config);
+    pipeline_print(pipeline, stdout);
 
-    // Cleanup resources
-    if (sbuffer_free(&shared_buffer) != SBUFFER_SUCCESS) {
-        fprintf(stderr, "Error: Could not free the shared buffer.\n");
+    // Run the stages until the whole input went through the graph
+    uint64_t run_start = monotonic_ns();
+    if (pipeline_run(pipeline) != PIPELINE_SUCCESS) {
+        fprintf(stderr, "Error: Could not run the pipeline.\n");
         exit(EXIT_FAILURE);
     }
+    pipeline_free(&pipeline);
+
+    // Wait for the submitted batches to be stored and stop the workers, the close syncs what the syncer did not
+    threadpool_free(&pool);
+    if (syncing) {
+        pthread_mutex_lock(&ack_queue.mutex);
+        ack_queue.stop = true;
+        pthread_cond_signal(&ack_queue.wake);
+        pthread_mutex_unlock(&ack_queue.mutex);
+        pthread_join(ack_queue.syncer, NULL);
+    }
+    double run_s = (monotonic_ns() - run_start) / 1e9;
+    datamgr_free(&datamgr);
+    pthread_mutex_destroy(&store_state.mutex);
+    pthread_mutex_destroy(&dedup_state.mutex);
+
     fclose(sensor_data_file);
-    fclose(csv_output_file);
+    if (decode_state.slowdowns > 0 || decode_state.pauses > 0) {
+        printf("Flow control: source slowed down %" PRIu32 " times, paused %" PRIu32 " times\n",
+               decode_state.slowdowns, decode_state.pauses);
+    }
+    uint64_t duplicates = stats_get(STATS_DUPLICATES);
+    if (duplicates > 0) printf("Dedup: dropped %" PRIu64 " duplicate readings\n", duplicates);
+    uint64_t readings = stats_get(STATS_READINGS);
+    printf("Replay: %" PRIu64 " readings in %.3f s (%.0f readings/s)\n", readings, run_s, readings / run_s);
+    stats_print(stdout);
+    stats_free();
+    sensor_db_sync_stats_t sync_stats;
+    sensor_db_get_sync_stats(db, &sync_stats);
+    if (sync_stats.syncs > 0) {
+        printf("Storage: %" PRIu32 " syncs, fdatasync latency avg %.1f us, max %.1f us\n", sync_stats.syncs,
+               sync_stats.total_ns / 1000.0 / sync_stats.syncs, sync_stats.max_ns / 1000.0);
+    }
+    if (sensor_db_close(&db) != SENSOR_DB_SUCCESS) {
+        fprintf(stderr, "Error: Could not close the database.\n");
+        exit(EXIT_FAILURE);
+    }
 
-    // Destroy the mutex
-    pthread_mutex_destroy(&csv_mutex);
+    // The close synced the database, the acks that waited for a periodic sync go out now
+    if (ack != NULL) {
+        release_acks(&ack_queue, NULL);
+        ackmgr_free(&ack);
+    }
 
     return 0;
 }
\ No newline at end of file
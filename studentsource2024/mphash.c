@@ -0,0 +1,173 @@
+/**
+ * \author {AUTHOR}
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+#include "mphash.h"
+
+#define SLOT_SEED 0x6a09e667u       // Separates the slot hash from the bucket hash of the same seed
+
+struct mphash {
+    uint32_t num_keys;
+    uint32_t num_buckets;
+    uint32_t seed;
+    uint16_t *displacement;     /**< one per bucket, the keys of bucket b sit in slot(key, displacement[b]) */
+};
+
+/**
+ * murmur3 finalizer over the key mixed with a seed, every output bit depends on every input bit
+ */
+static inline uint32_t mix(uint32_t key, uint32_t seed) {
+    uint32_t h = (key ^ seed) * 0x9e3779b1u;
+    h ^= h >> 16;
+    h *= 0x85ebca6bu;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35u;
+    h ^= h >> 16;
+    return h;
+}
+
+/**
+ * Maps a 32-bit hash onto 0..n-1 with a multiply and a shift instead of a division
+ */
+static inline uint32_t reduce(uint32_t h, uint32_t n) {
+    return (uint32_t)(((uint64_t)h * n) >> 32);
+}
+
+static inline uint32_t bucket_of(const mphash_t *hash, uint16_t key) {
+    return reduce(mix(key, hash->seed), hash->num_buckets);
+}
+
+/**
+ * The keys are 16 bits wide, so key and displacement together are a unique 32-bit input to the mix
+ */
+static inline uint32_t slot_of(const mphash_t *hash, uint16_t key, uint32_t displacement) {
+    return reduce(mix(key | displacement << 16, hash->seed + SLOT_SEED), hash->num_keys);
+}
+
+/**
+ * One attempt with the current seed
+ * \param sorted scratch for the keys grouped by bucket (n entries)
+ * \param start scratch for the bucket boundaries in 'sorted' (num_buckets + 1 entries)
+ * \param order scratch for the buckets from the largest to the smallest (num_buckets entries)
+ * \param taken scratch for the occupied slots (n entries)
+ * \param slots scratch for the slots of the keys of one bucket (n entries)
+ * \return true when every bucket found a displacement
+ */
+static bool try_build(mphash_t *hash, const uint16_t *keys, uint16_t *sorted, uint32_t *start, uint32_t *order,
+                      bool *taken, uint32_t *slots) {
+    uint32_t n = hash->num_keys, buckets = hash->num_buckets, max_size = 0;
+
+    // Group the keys by bucket (counting sort)
+    memset(start, 0, (buckets + 1) * sizeof(uint32_t));
+    for (uint32_t i = 0; i < n; i++) start[bucket_of(hash, keys[i]) + 1]++;
+    for (uint32_t b = 0; b < buckets; b++) {
+        if (start[b + 1] > max_size) max_size = start[b + 1];
+        start[b + 1] += start[b];
+    }
+    uint32_t *fill = order;  // 'order' is not needed yet, borrow it as the write cursors
+    memcpy(fill, start, buckets * sizeof(uint32_t));
+    for (uint32_t i = 0; i < n; i++) sorted[fill[bucket_of(hash, keys[i])]++] = keys[i];
+
+    // Largest buckets first, while most slots are still free (counting sort on size, descending)
+    uint32_t *by_size = calloc(max_size + 2, sizeof(uint32_t));
+    if (by_size == NULL) return false;
+    for (uint32_t b = 0; b < buckets; b++) by_size[max_size - (start[b + 1] - start[b]) + 1]++;
+    for (uint32_t s = 0; s <= max_size; s++) by_size[s + 1] += by_size[s];
+    for (uint32_t b = 0; b < buckets; b++) order[by_size[max_size - (start[b + 1] - start[b])]++] = b;
+    free(by_size);
+
+    memset(taken, 0, n * sizeof(bool));
+    for (uint32_t i = 0; i < buckets; i++) {
+        uint32_t b = order[i], size = start[b + 1] - start[b];
+        if (size == 0) break;   // Only empty buckets left
+        uint32_t d;
+        for (d = 0; d <= MPHASH_MAX_DISPLACEMENT; d++) {
+            uint32_t placed = 0;
+            for (; placed < size; placed++) {
+                uint32_t slot = slot_of(hash, sorted[start[b] + placed], d);
+                if (taken[slot]) break;
+                taken[slot] = true;   // Also catches two keys of this bucket in the same slot
+                slots[placed] = slot;
+            }
+            if (placed == size) break;
+            while (placed > 0) taken[slots[--placed]] = false;
+        }
+        if (d > MPHASH_MAX_DISPLACEMENT) return false;
+        hash->displacement[b] = (uint16_t)d;
+    }
+    return true;
+}
+
+int mphash_build(mphash_t **hash, const uint16_t *keys, uint32_t n) {
+    bool *seen = NULL, *taken = NULL;
+    uint16_t *sorted = NULL;
+    uint32_t *start = NULL, *order = NULL, *slots = NULL;
+    int result = MPHASH_FAILURE;
+
+    if (hash == NULL || (keys == NULL && n > 0) || n > UINT16_MAX + 1) return MPHASH_FAILURE;
+
+    mphash_t *h = calloc(1, sizeof(mphash_t));
+    if (h == NULL) return MPHASH_FAILURE;
+    h->num_keys = n;
+    h->num_buckets = n / MPHASH_BUCKET_SIZE + 1;
+    h->displacement = calloc(h->num_buckets, sizeof(uint16_t));
+
+    // A duplicate would never find a displacement, reject it up front instead of trying every seed
+    seen = calloc(UINT16_MAX + 1, sizeof(bool));
+    sorted = malloc((n + 1) * sizeof(uint16_t));
+    start = malloc((h->num_buckets + 1) * sizeof(uint32_t));
+    order = malloc(h->num_buckets * sizeof(uint32_t));
+    taken = malloc((n + 1) * sizeof(bool));
+    slots = malloc((n + 1) * sizeof(uint32_t));
+    if (h->displacement == NULL || seen == NULL || sorted == NULL || start == NULL || order == NULL ||
+        taken == NULL || slots == NULL) {
+        goto done;
+    }
+    for (uint32_t i = 0; i < n; i++) {
+        if (seen[keys[i]]) {
+            fprintf(stderr, "Perfect hash: key %u appears more than once.\n", keys[i]);
+            goto done;
+        }
+        seen[keys[i]] = true;
+    }
+
+    for (uint32_t attempt = 0; attempt < MPHASH_MAX_SEEDS; attempt++) {
+        h->seed = mix(attempt, 0x243f6a88u);
+        if (try_build(h, keys, sorted, start, order, taken, slots)) {
+            result = MPHASH_SUCCESS;
+            break;
+        }
+    }
+    if (result != MPHASH_SUCCESS) fprintf(stderr, "Perfect hash: no displacements found for %u keys.\n", n);
+
+done:
+    free(slots);
+    free(taken);
+    free(order);
+    free(start);
+    free(sorted);
+    free(seen);
+    if (result == MPHASH_SUCCESS) {
+        *hash = h;
+    } else {
+        free(h->displacement);
+        free(h);
+    }
+    return result;
+}
+
+uint32_t mphash_lookup(const mphash_t *hash, uint16_t key) {
+    return slot_of(hash, key, hash->displacement[bucket_of(hash, key)]);
+}
+
+int mphash_free(mphash_t **hash) {
+    if ((hash == NULL) || (*hash == NULL)) return MPHASH_FAILURE;
+    free((*hash)->displacement);
+    free(*hash);
+    *hash = NULL;
+    return MPHASH_SUCCESS;
+}
@@ -0,0 +1,52 @@
+/**
+ * \author {AUTHOR}
+ */
+
+#ifndef _MPHASH_H_
+#define _MPHASH_H_
+
+#include <stdint.h>
+
+#define MPHASH_FAILURE -1
+#define MPHASH_SUCCESS 0
+
+#define MPHASH_BUCKET_SIZE 4        // Average number of keys per bucket: fewer buckets make the hash smaller, the build slower
+#define MPHASH_MAX_DISPLACEMENT 65535   // Displacements tried per bucket before the build starts over with a new seed
+#define MPHASH_MAX_SEEDS 32         // Seeds tried before the build gives up
+
+/*
+ * Minimal perfect hash of a fixed set of 16-bit keys, built with the CHD (compress, hash, displace) algorithm: the
+ * keys are spread over n / MPHASH_BUCKET_SIZE buckets, and starting with the largest bucket every bucket gets the
+ * first displacement that sends all of its keys to slots that are still free. The n keys end up in the n slots
+ * 0..n-1 without collisions, and all the hash stores is one 16-bit displacement per bucket (about half a byte per
+ * key). A lookup costs two hash mixes and one read of the displacement table.
+ * Any key maps to some slot, so the caller stores the key in its slot and compares to reject keys outside the set.
+ */
+
+typedef struct mphash mphash_t;
+
+/**
+ * Builds the hash of 'n' distinct keys
+ * \param hash a double pointer to the hash that needs to be initialized
+ * \param keys the keys, duplicates make the build fail
+ * \param n the number of keys, may be 0
+ * \return MPHASH_SUCCESS on success and MPHASH_FAILURE if an error occurred
+ */
+int mphash_build(mphash_t **hash, const uint16_t *keys, uint32_t n);
+
+/**
+ * Looks up the slot of a key
+ * \param hash a pointer to the hash that is used, built over at least one key
+ * \param key the key to look up
+ * \return the slot of the key in 0..n-1 when it is one of the keys of the build, an arbitrary slot in 0..n-1 otherwise
+ */
+uint32_t mphash_lookup(const mphash_t *hash, uint16_t key);
+
+/**
+ * All allocated resources are freed and cleaned up
+ * \param hash a double pointer to the hash that needs to be freed
+ * \return MPHASH_SUCCESS on success and MPHASH_FAILURE if an error occurred
+ */
+int mphash_free(mphash_t **hash);
+
+#endif  //_MPHASH_H_
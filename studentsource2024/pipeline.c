@@ -0,0 +1,536 @@
+/**
+ * \author {AUTHOR}
+ */
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <unistd.h>
+#include "pipeline.h"
+#include "sbuffer.h"
+#include "stats.h"
+
+#define SPSC_SPIN_LIMIT 64          // Yields before an idle side of an SPSC ring starts sleeping
+#define SPSC_SLEEP_NS 100000        // Sleep of an idle side of an SPSC ring (100 us)
+#define FLOW_POLL_NS 1000000        // Sleep of a paused source between two looks at the queues (1 ms)
+
+#if defined(__x86_64__) || defined(__i386__)
+#define cpu_relax() __builtin_ia32_pause()     // Tells the core it is spinning, frees resources for the sibling thread
+#else
+#define cpu_relax() ((void)0)
+#endif
+
+typedef enum {
+    QUEUE_SPSC,     // One producer thread and one consumer thread
+    QUEUE_MPMC      // Shared sbuffer, any number of threads on both sides
+} pipeline_queue_type_t;
+
+/**
+ * bounded single-producer/single-consumer ring, head and tail are padded apart so both sides don't share a cache line
+ */
+typedef struct spsc_ring {
+    sensor_data_t *slots;
+    size_t mask;
+    atomic_size_t head;                 /**< next slot to read, only written by the consumer */
+    char pad[64];                       /**< keeps 'head' and 'tail' on different cache lines */
+    atomic_size_t tail;                 /**< next slot to write, only written by the producer */
+} spsc_ring_t;
+
+typedef struct pipeline_queue {
+    pipeline_queue_type_t type;
+    spsc_ring_t ring;           /**< used when type == QUEUE_SPSC */
+    sbuffer_t *buffer;          /**< used when type == QUEUE_MPMC */
+} pipeline_queue_t;
+
+/**
+ * one line of the configuration: fused stages sharing input queue, output queue and threads
+ */
+typedef struct pipeline_group {
+    const pipeline_stage_def_t *stages[PIPELINE_MAX_FUSED];
+    int num_stages;
+    int num_threads;
+    bool busy;                  /**< the threads spin on their input queue instead of sleeping and are pinned to a CPU */
+    pipeline_queue_t *in;       /**< NULL for the source group */
+    pipeline_queue_t *out;      /**< NULL for the last group */
+    int out_consumers;          /**< number of threads reading from 'out' */
+    atomic_int running;         /**< threads of this group that did not see the end of the stream yet */
+    pipeline_t *pipeline;       /**< the graph, the source group watches all of its queues */
+    pthread_t threads[PIPELINE_MAX_THREADS];
+} pipeline_group_t;
+
+struct pipeline {
+    const pipeline_stage_def_t *defs;
+    int num_defs;
+    pipeline_group_t groups[PIPELINE_MAX_GROUPS];
+    int num_groups;
+    pipeline_queue_t queues[PIPELINE_MAX_GROUPS - 1];  /**< queues[i] connects groups[i] and groups[i + 1] */
+    atomic_int pinned;          /**< busy threads pinned so far, they take the CPUs from the last one down */
+};
+
+static void idle_wait(int *spins) {
+    if (++(*spins) < SPSC_SPIN_LIMIT) {
+        sched_yield();
+    } else {
+        struct timespec pause = {0, SPSC_SLEEP_NS};
+        nanosleep(&pause, NULL);
+    }
+}
+
+static void ring_push(spsc_ring_t *ring, sensor_data_t *reading) {
+    size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    int spins = 0;
+    while (tail - atomic_load_explicit(&ring->head, memory_order_acquire) > ring->mask) {
+        idle_wait(&spins); // Ring full, wait for the consumer
+    }
+    ring->slots[tail & ring->mask] = *reading;
+    atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+}
+
+static void queue_push_block(pipeline_queue_t *queue, sensor_block_t *block) {
+    if (queue->type == QUEUE_MPMC) {
+        if (sbuffer_insert_block(queue->buffer, block) != SBUFFER_SUCCESS) {
+            fprintf(stderr, "Pipeline queue insertion failed for a block of %u readings\n", block->count);
+        }
+        return;
+    }
+
+    for (uint32_t i = 0; i < block->count; i++) {
+        sensor_data_t reading = {block->id[i], block->value[i], block->ts[i]};
+        ring_push(&queue->ring, &reading);
+    }
+}
+
+/**
+ * Sends the end-of-stream marker, once for every consumer thread: each sbuffer insert only wakes up one waiting consumer
+ */
+static void queue_push_end(pipeline_queue_t *queue, int consumers) {
+    sensor_data_t end_signal = {0, 0.0, 0};
+    if (queue->type == QUEUE_MPMC) {
+        for (int i = 0; i < consumers; i++) {
+            sbuffer_insert(queue->buffer, &end_signal);
+        }
+    } else {
+        ring_push(&queue->ring, &end_signal);
+    }
+}
+
+/**
+ * Takes everything that is available (at least one reading, at most one block) from 'queue'
+ * \return false when the end-of-stream marker (id == 0) was reached and no readings are left in front of it
+ */
+static bool queue_pop_block(pipeline_queue_t *queue, sensor_block_t *block, bool busy) {
+    if (queue->type == QUEUE_MPMC) {
+        int status;
+        // The sbuffer leaves the marker at the head, so every consumer thread of the group sees it
+        while (true) {
+            status = busy ? sbuffer_poll_block(queue->buffer, block) : sbuffer_remove_block(queue->buffer, block);
+            if (status == SBUFFER_EMPTY) {
+                cpu_relax();
+            } else if (status == SBUFFER_FAILURE) {
+                fprintf(stderr, "Pipeline queue read encountered an error.\n");
+            } else {
+                break;
+            }
+        }
+        return status == SBUFFER_SUCCESS;
+    }
+
+    spsc_ring_t *ring = &queue->ring;
+    size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    size_t tail;
+    int spins = 0;
+    while ((tail = atomic_load_explicit(&ring->tail, memory_order_acquire)) == head) {
+        // Ring empty, wait for the producer
+        if (busy) cpu_relax();
+        else idle_wait(&spins);
+    }
+
+    block->count = 0;
+    while (head != tail && block->count < SENSOR_BLOCK_CAPACITY) {
+        sensor_data_t *slot = &ring->slots[head & ring->mask];
+        if (slot->id == 0) {
+            // Consume the marker only when it is the first thing we see, otherwise hand out the readings first
+            if (block->count == 0) head++;
+            break;
+        }
+        block->id[block->count] = slot->id;
+        block->value[block->count] = slot->value;
+        block->ts[block->count] = slot->ts;
+        block->count++;
+        head++;
+    }
+    atomic_store_explicit(&ring->head, head, memory_order_release);
+    return block->count > 0;
+}
+
+/**
+ * Number of readings waiting in 'queue', may be outdated by the time it is used
+ */
+static size_t queue_depth(pipeline_queue_t *queue) {
+    if (queue->type == QUEUE_MPMC) return sbuffer_size(queue->buffer);
+    // 'head' first: it never passes 'tail', so the difference cannot wrap around
+    size_t head = atomic_load_explicit(&queue->ring.head, memory_order_acquire);
+    return atomic_load_explicit(&queue->ring.tail, memory_order_acquire) - head;
+}
+
+static int queue_init(pipeline_queue_t *queue, pipeline_queue_type_t type) {
+    queue->type = type;
+    queue->buffer = NULL;
+    queue->ring.slots = NULL;
+    if (type == QUEUE_MPMC) {
+        return sbuffer_init(&queue->buffer) == SBUFFER_SUCCESS ? PIPELINE_SUCCESS : PIPELINE_FAILURE;
+    }
+    queue->ring.slots = malloc(PIPELINE_SPSC_CAPACITY * sizeof(sensor_data_t));
+    if (queue->ring.slots == NULL) return PIPELINE_FAILURE;
+    queue->ring.mask = PIPELINE_SPSC_CAPACITY - 1;
+    atomic_init(&queue->ring.head, 0);
+    atomic_init(&queue->ring.tail, 0);
+    return PIPELINE_SUCCESS;
+}
+
+static void queue_destroy(pipeline_queue_t *queue) {
+    if (queue->type == QUEUE_MPMC) {
+        sbuffer_free(&queue->buffer);
+    } else {
+        free(queue->ring.slots);
+        queue->ring.slots = NULL;
+    }
+}
+
+/**
+ * Runs one stage over a block, stages without a block callback see the readings one by one and the dropped ones are compacted away
+ */
+static void run_stage(const pipeline_stage_def_t *stage, sensor_block_t *block) {
+    if (stage->process_block != NULL) {
+        stage->process_block(stage->ctx, block);
+        return;
+    }
+
+    uint32_t kept = 0;
+    for (uint32_t i = 0; i < block->count; i++) {
+        sensor_data_t reading = {block->id[i], block->value[i], block->ts[i]};
+        if (!stage->process(stage->ctx, &reading)) continue;
+        block->id[kept] = reading.id;
+        block->value[kept] = reading.value;
+        block->ts[kept] = reading.ts;
+        block->room[kept] = block->room[i];
+        kept++;
+    }
+    block->count = kept;
+}
+
+/**
+ * Flow control level for the current fill of the queues and stage backlogs
+ * A paused source stays paused until everything is below the low watermark again, so it does not flap at the high one
+ */
+static pipeline_flow_t flow_level(pipeline_t *pipeline, pipeline_flow_t current) {
+    size_t deepest = 0;
+
+    for (int q = 0; q + 1 < pipeline->num_groups; q++) {
+        size_t depth = queue_depth(&pipeline->queues[q]);
+        if (depth > deepest) deepest = depth;
+    }
+    for (int g = 0; g < pipeline->num_groups; g++) {
+        for (int i = 0; i < pipeline->groups[g].num_stages; i++) {
+            const pipeline_stage_def_t *stage = pipeline->groups[g].stages[i];
+            if (stage->backlog == NULL) continue;
+            size_t depth = stage->backlog(stage->ctx);
+            if (depth > deepest) deepest = depth;
+        }
+    }
+
+    if (deepest >= PIPELINE_FLOW_HIGH) return PIPELINE_FLOW_PAUSE;
+    if (deepest >= PIPELINE_FLOW_LOW) return current == PIPELINE_FLOW_PAUSE ? PIPELINE_FLOW_PAUSE : PIPELINE_FLOW_SLOW;
+    return PIPELINE_FLOW_GO;
+}
+
+/**
+ * Fills 'block' from the source under flow control: a single reading at full rate to keep latency low, up to
+ * PIPELINE_FLOW_BATCH readings while slowed down, and no call to the source at all while paused
+ * \return false at the end of the stream, 'block' may still hold the last readings then
+ */
+static bool source_fill(pipeline_group_t *group, sensor_block_t *block, pipeline_flow_t *level) {
+    const pipeline_stage_def_t *source = group->stages[0];
+    sensor_data_t reading;
+
+    block->count = 0;
+    while (true) {
+        pipeline_flow_t next = flow_level(group->pipeline, *level);
+        if (next != *level) {
+            *level = next;
+            if (source->flow != NULL) source->flow(source->ctx, next);
+        }
+
+        if (*level == PIPELINE_FLOW_PAUSE) {
+            if (block->count > 0) return true; // Send on what was collected before waiting
+            struct timespec pause = {0, FLOW_POLL_NS};
+            nanosleep(&pause, NULL);
+            continue;
+        }
+        if (*level == PIPELINE_FLOW_GO && block->count > 0) return true; // Back to full rate, stop batching
+
+        if (source->produce(source->ctx, &reading) == 0) return false;
+        block->id[block->count] = reading.id;
+        block->value[block->count] = reading.value;
+        block->ts[block->count] = reading.ts;
+        block->count++;
+        if (*level == PIPELINE_FLOW_GO || block->count == PIPELINE_FLOW_BATCH) return true;
+    }
+}
+
+/**
+ * Runs the stages of a group from 'first' on over a block and passes what is left on to the next group
+ */
+static void run_stages(pipeline_group_t *group, int first, sensor_block_t *block) {
+    for (int i = first; i < group->num_stages && block->count > 0; i++) {
+        run_stage(group->stages[i], block);
+    }
+    if (block->count > 0 && group->out != NULL) {
+        queue_push_block(group->out, block);
+    }
+}
+
+/**
+ * Pins the calling thread of a busy group to its own CPU, counting down from the last one so the low CPUs stay free
+ * for threads that are pinned from the bottom up (reactors)
+ */
+static void pin_busy_thread(pipeline_t *pipeline) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int n = atomic_fetch_add(&pipeline->pinned, 1);
+    if (cpus <= 0) return;
+
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpus - 1 - n % cpus, &set);
+    if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0) {
+        fprintf(stderr, "Pipeline could not pin a busy thread to CPU %ld.\n", cpus - 1 - n % cpus);
+    }
+}
+
+static void *group_thread(void *args) {
+    pipeline_group_t *group = (pipeline_group_t *)args;
+    const pipeline_stage_def_t *source = group->in == NULL ? group->stages[0] : NULL;
+    int first = source != NULL ? 1 : 0;
+    sensor_block_t *block = malloc(sizeof(sensor_block_t));
+    pipeline_flow_t level = PIPELINE_FLOW_GO;
+    bool more = true;
+
+    if (block == NULL) {
+        fprintf(stderr, "Error: Could not allocate a pipeline block, aborting.\n");
+        exit(EXIT_FAILURE);
+    }
+    stats_register_thread();
+    if (group->busy) pin_busy_thread(group->pipeline);
+
+    while (more) {
+        if (source != NULL) {
+            more = source_fill(group, block, &level);
+        } else if (!queue_pop_block(group->in, block, group->busy)) {
+            break; // End-of-stream signal
+        }
+        if (block->count > 0) stats_record(STATS_BLOCK_SIZE, block->count);
+        block->has_room = false;
+        run_stages(group, first, block);
+    }
+
+    // The last thread of the group to stop drains and finishes the stages in order, so readings a stage held back
+    // still go through the stages behind it, and passes the end of the stream on
+    if (atomic_fetch_sub(&group->running, 1) == 1) {
+        for (int i = 0; i < group->num_stages; i++) {
+            const pipeline_stage_def_t *stage = group->stages[i];
+            while (stage->drain != NULL) {
+                block->count = 0;
+                block->has_room = false;
+                stage->drain(stage->ctx, block);
+                if (block->count == 0) break;
+                run_stages(group, i + 1, block);
+            }
+            if (stage->finish != NULL) stage->finish(stage->ctx);
+        }
+        if (group->out != NULL) {
+            queue_push_end(group->out, group->out_consumers);
+        }
+    }
+    free(block);
+
+    pthread_exit(NULL);
+}
+
+static const pipeline_stage_def_t *find_stage(pipeline_t *pipeline, const char *name) {
+    for (int i = 0; i < pipeline->num_defs; i++) {
+        if (strcmp(pipeline->defs[i].name, name) == 0) return &pipeline->defs[i];
+    }
+    return NULL;
+}
+
+int pipeline_init(pipeline_t **pipeline, const pipeline_stage_def_t *stages, int num_stages) {
+    if (pipeline == NULL || stages == NULL || num_stages <= 0) return PIPELINE_FAILURE;
+    *pipeline = calloc(1, sizeof(pipeline_t));
+    if (*pipeline == NULL) return PIPELINE_FAILURE;
+    (*pipeline)->defs = stages;
+    (*pipeline)->num_defs = num_stages;
+    return PIPELINE_SUCCESS;
+}
+
+int pipeline_load(pipeline_t *pipeline, FILE *config) {
+    char line[256];
+    int line_nr = 0;
+
+    if (pipeline == NULL || config == NULL) return PIPELINE_FAILURE;
+    pipeline->num_groups = 0;
+
+    while (fgets(line, sizeof(line), config) != NULL) {
+        char stage_list[200], mode[16] = "";
+        int threads = 1;
+        line_nr++;
+
+        char *comment = strchr(line, '#');
+        if (comment != NULL) *comment = '\0';
+        int fields = sscanf(line, "%199s %d %15s", stage_list, &threads, mode);
+        if (fields < 1) continue; // Empty line
+        if (fields == 3 && strcmp(mode, "busy") != 0) {
+            fprintf(stderr, "Pipeline config line %d: unknown mode '%s'.\n", line_nr, mode);
+            return PIPELINE_FAILURE;
+        }
+
+        if (pipeline->num_groups == PIPELINE_MAX_GROUPS) {
+            fprintf(stderr, "Pipeline config line %d: more than %d groups.\n", line_nr, PIPELINE_MAX_GROUPS);
+            return PIPELINE_FAILURE;
+        }
+        if (threads < 1 || threads > PIPELINE_MAX_THREADS) {
+            fprintf(stderr, "Pipeline config line %d: thread count must be between 1 and %d.\n", line_nr, PIPELINE_MAX_THREADS);
+            return PIPELINE_FAILURE;
+        }
+
+        pipeline_group_t *group = &pipeline->groups[pipeline->num_groups];
+        group->num_stages = 0;
+        group->num_threads = threads;
+        group->busy = fields == 3;
+
+        char *saveptr = NULL;
+        for (char *name = strtok_r(stage_list, "+", &saveptr); name != NULL; name = strtok_r(NULL, "+", &saveptr)) {
+            const pipeline_stage_def_t *def = find_stage(pipeline, name);
+            if (def == NULL) {
+                fprintf(stderr, "Pipeline config line %d: unknown stage '%s'.\n", line_nr, name);
+                return PIPELINE_FAILURE;
+            }
+            if (group->num_stages == PIPELINE_MAX_FUSED) {
+                fprintf(stderr, "Pipeline config line %d: more than %d fused stages.\n", line_nr, PIPELINE_MAX_FUSED);
+                return PIPELINE_FAILURE;
+            }
+            bool first_of_graph = pipeline->num_groups == 0 && group->num_stages == 0;
+            if (def->produce == NULL && def->process == NULL && def->process_block == NULL) {
+                fprintf(stderr, "Pipeline config line %d: stage '%s' has no callbacks.\n", line_nr, name);
+                return PIPELINE_FAILURE;
+            }
+            if (first_of_graph != (def->produce != NULL)) {
+                fprintf(stderr, "Pipeline config line %d: '%s' %s.\n", line_nr, name,
+                        first_of_graph ? "is not a source stage" : "is a source stage and must come first");
+                return PIPELINE_FAILURE;
+            }
+            group->stages[group->num_stages++] = def;
+        }
+
+        if (pipeline->num_groups == 0 && threads != 1) {
+            fprintf(stderr, "Pipeline config line %d: the source group must run on one thread.\n", line_nr);
+            return PIPELINE_FAILURE;
+        }
+        for (int i = 0; i < group->num_stages && threads != 1; i++) {
+            if (group->stages[i]->single_thread) {
+                fprintf(stderr, "Pipeline config line %d: '%s' must run on one thread.\n", line_nr, group->stages[i]->name);
+                return PIPELINE_FAILURE;
+            }
+        }
+        pipeline->num_groups++;
+    }
+
+    if (pipeline->num_groups == 0) {
+        fprintf(stderr, "Pipeline config does not declare any stage.\n");
+        return PIPELINE_FAILURE;
+    }
+    return PIPELINE_SUCCESS;
+}
+
+static pipeline_queue_type_t queue_type_between(pipeline_group_t *from, pipeline_group_t *to) {
+    return (from->num_threads == 1 && to->num_threads == 1) ? QUEUE_SPSC : QUEUE_MPMC;
+}
+
+void pipeline_print(pipeline_t *pipeline, FILE *out) {
+    if (pipeline == NULL || out == NULL) return;
+    for (int g = 0; g < pipeline->num_groups; g++) {
+        pipeline_group_t *group = &pipeline->groups[g];
+        for (int i = 0; i < group->num_stages; i++) {
+            fprintf(out, "%s%s", i > 0 ? "+" : "", group->stages[i]->name);
+        }
+        fprintf(out, " x%d%s", group->num_threads, group->busy ? " busy" : "");
+        if (g + 1 < pipeline->num_groups) {
+            fprintf(out, " -> %s", queue_type_between(group, &pipeline->groups[g + 1]) == QUEUE_SPSC ? "spsc" : "mpmc");
+        }
+        fprintf(out, "\n");
+    }
+}
+
+int pipeline_run(pipeline_t *pipeline) {
+    int result = PIPELINE_SUCCESS;
+    int queues_ready = 0;
+
+    if (pipeline == NULL || pipeline->num_groups == 0) return PIPELINE_FAILURE;
+
+    for (int g = 0; g + 1 < pipeline->num_groups; g++) {
+        pipeline_group_t *from = &pipeline->groups[g];
+        pipeline_group_t *to = &pipeline->groups[g + 1];
+        if (queue_init(&pipeline->queues[g], queue_type_between(from, to)) != PIPELINE_SUCCESS) {
+            result = PIPELINE_FAILURE;
+            goto cleanup;
+        }
+        queues_ready++;
+    }
+
+    for (int g = 0; g < pipeline->num_groups; g++) {
+        pipeline_group_t *group = &pipeline->groups[g];
+        group->in = g > 0 ? &pipeline->queues[g - 1] : NULL;
+        group->out = g + 1 < pipeline->num_groups ? &pipeline->queues[g] : NULL;
+        group->out_consumers = g + 1 < pipeline->num_groups ? pipeline->groups[g + 1].num_threads : 0;
+        atomic_init(&group->running, group->num_threads);
+        group->pipeline = pipeline;
+    }
+    atomic_init(&pipeline->pinned, 0);
+
+    // Start the sinks first so no queue fills up before its consumers exist
+    for (int g = pipeline->num_groups - 1; g >= 0; g--) {
+        pipeline_group_t *group = &pipeline->groups[g];
+        for (int t = 0; t < group->num_threads; t++) {
+            if (pthread_create(&group->threads[t], NULL, group_thread, group) != 0) {
+                // Threads that are already running cannot be told to stop without the end of the stream
+                fprintf(stderr, "Error: Could not start pipeline thread, aborting.\n");
+                exit(EXIT_FAILURE);
+            }
+        }
+    }
+
+    for (int g = 0; g < pipeline->num_groups; g++) {
+        pipeline_group_t *group = &pipeline->groups[g];
+        for (int t = 0; t < group->num_threads; t++) {
+            pthread_join(group->threads[t], NULL);
+        }
+    }
+
+cleanup:
+    for (int g = 0; g < queues_ready; g++) {
+        queue_destroy(&pipeline->queues[g]);
+    }
+    return result;
+}
+
+int pipeline_free(pipeline_t **pipeline) {
+    if ((pipeline == NULL) || (*pipeline == NULL)) return PIPELINE_FAILURE;
+    free(*pipeline);
+    *pipeline = NULL;
+    return PIPELINE_SUCCESS;
+}
@@ -0,0 +1,110 @@
+/**
+ * \author {AUTHOR}
+ */
+
+#ifndef _PIPELINE_H_
+#define _PIPELINE_H_
+
+#include <stdio.h>
+#include <stdbool.h>
+#include "config.h"
+
+#define PIPELINE_FAILURE -1
+#define PIPELINE_SUCCESS 0
+
+#define PIPELINE_MAX_GROUPS 16          // Maximum number of thread groups (lines) in a configuration
+#define PIPELINE_MAX_FUSED 8            // Maximum number of stages fused in one group
+#define PIPELINE_MAX_THREADS 16         // Maximum number of threads assigned to one group
+#define PIPELINE_SPSC_CAPACITY 1024     // Slots in a single-producer/single-consumer queue (power of 2)
+
+#ifndef PIPELINE_FLOW_LOW
+#define PIPELINE_FLOW_LOW 256           // Readings waiting in one queue before the source is told to slow down
+#endif
+
+#ifndef PIPELINE_FLOW_HIGH
+#define PIPELINE_FLOW_HIGH 768          // Readings waiting in one queue before the source is paused
+#endif
+
+#define PIPELINE_FLOW_BATCH 16          // Readings the source group collects per block while it is slowed down
+
+/**
+ * Flow control level of the source, derived from the fullest queue of the graph
+ */
+typedef enum {
+    PIPELINE_FLOW_GO,       /**< every queue is below PIPELINE_FLOW_LOW: produce at full rate */
+    PIPELINE_FLOW_SLOW,     /**< a queue reached PIPELINE_FLOW_LOW: produce slower, readings are sent on in batches */
+    PIPELINE_FLOW_PAUSE     /**< a queue reached PIPELINE_FLOW_HIGH: nothing is produced until all are below PIPELINE_FLOW_LOW again */
+} pipeline_flow_t;
+
+typedef struct pipeline pipeline_t;
+
+/**
+ * Describes a stage that can be referred to by name in a pipeline configuration
+ * A source stage only implements 'produce', every other stage implements 'process' and/or 'process_block'
+ * Readings travel through a group as a sensor_block_t: a stage with 'process_block' gets the whole block at once,
+ * otherwise 'process' is called for every reading in the block.
+ * The callbacks are called concurrently when the group of the stage runs on several threads, so they must be thread-safe then
+ */
+typedef struct pipeline_stage_def {
+    const char *name;                                   /**< name used in the configuration file */
+    int (*produce)(void *ctx, sensor_data_t *reading);  /**< source: fills 'reading', returns 1 on success and 0 at the end of the stream */
+    bool (*process)(void *ctx, sensor_data_t *reading); /**< may modify 'reading', returns false to drop it */
+    void (*process_block)(void *ctx, sensor_block_t *block); /**< optional, may modify or drop (compact) readings of 'block' */
+    void (*drain)(void *ctx, sensor_block_t *block);    /**< optional, called after the end of the stream until it leaves 'block' empty: hands out readings the stage held back, they go through the rest of the group */
+    void (*finish)(void *ctx);                          /**< optional, called once after the last reading went through the stage */
+    size_t (*backlog)(void *ctx);                       /**< optional, readings the stage accepted but did not finish yet (e.g. queued work), counted like a queue by flow control */
+    void (*flow)(void *ctx, pipeline_flow_t level);     /**< optional, source: called from the source thread when the flow control level changes */
+    void *ctx;                                          /**< user data passed to the callbacks */
+    bool single_thread;                                 /**< the stage keeps its readings in order, which only holds on one thread */
+} pipeline_stage_def_t;
+
+/**
+ * Allocates a new, empty pipeline that knows the given stages
+ * \param pipeline a double pointer to the pipeline that needs to be initialized
+ * \param stages array of stage definitions, the array must outlive the pipeline
+ * \param num_stages number of elements in 'stages'
+ * \return PIPELINE_SUCCESS on success and PIPELINE_FAILURE if an error occurred
+ */
+int pipeline_init(pipeline_t **pipeline, const pipeline_stage_def_t *stages, int num_stages);
+
+/**
+ * Reads the stage graph from 'config'. Every non-empty line that does not start with '#' declares one thread group:
+ *      <stage>[+<stage>...] [threads] [busy]
+ * Stages joined with '+' are fused: they run one after the other on the same thread without a queue in between.
+ * Consecutive groups are connected by a queue: a lock-free SPSC ring when both sides run on one thread, the shared sbuffer (MPMC) otherwise.
+ * A group takes everything that is available in its input queue (up to SENSOR_BLOCK_CAPACITY readings) as one block.
+ * A 'busy' group trades CPU for latency: its threads spin on the input queue instead of sleeping when it is empty and
+ * each one is pinned to its own CPU, counting down from the last CPU. Only useful with a spare core per busy thread.
+ * The first group has to start with the (only) source stage and must run on a single thread, and so must every group
+ * with a 'single_thread' stage.
+ * Flow control: before every reading the source group checks how full the queues are. From PIPELINE_FLOW_LOW readings in
+ * any queue on it batches its output and asks the source to slow down, from PIPELINE_FLOW_HIGH on it stops calling the
+ * source until every queue drained below PIPELINE_FLOW_LOW. The 'backlog' of a stage counts as one more queue. The source hears about every change through its 'flow' callback.
+ * \param pipeline a pointer to the pipeline that is used
+ * \param config the configuration to read
+ * \return PIPELINE_SUCCESS on success and PIPELINE_FAILURE if the configuration is invalid
+ */
+int pipeline_load(pipeline_t *pipeline, FILE *config);
+
+/**
+ * Creates the queues and threads of the loaded graph and blocks until the end of the stream reached the last group
+ * \param pipeline a pointer to the pipeline that is used
+ * \return PIPELINE_SUCCESS on success and PIPELINE_FAILURE if an error occurred
+ */
+int pipeline_run(pipeline_t *pipeline);
+
+/**
+ * Prints the loaded graph, one group per line, including the queue type that connects it to the next group
+ * \param pipeline a pointer to the pipeline that is used
+ * \param out the stream to print to
+ */
+void pipeline_print(pipeline_t *pipeline, FILE *out);
+
+/**
+ * All allocated resources are freed and cleaned up
+ * \param pipeline a double pointer to the pipeline that needs to be freed
+ * \return PIPELINE_SUCCESS on success and PIPELINE_FAILURE if an error occurred
+ */
+int pipeline_free(pipeline_t **pipeline);
+
+#endif  //_PIPELINE_H_
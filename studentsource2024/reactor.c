@@ -0,0 +1,456 @@
+/**
+ * \author {AUTHOR}
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include "reactor.h"
+
+#define REACTOR_EVENTS 64           // Events handled per epoll_wait call
+#define REACTOR_READ_BYTES 4096     // Bytes read from a connection per event, so one chatty sensor can't starve the others
+
+#if defined(__x86_64__) || defined(__i386__)
+#define cpu_relax() __builtin_ia32_pause()
+#else
+#define cpu_relax() ((void)0)
+#endif
+
+/**
+ * a connection and its load, owned by exactly one reactor at a time
+ */
+typedef struct reactor_conn {
+    handover_conn_t state;          /**< descriptor, sensor and partial frame */
+    uint32_t readings;              /**< readings decoded so far */
+    uint32_t mark;                  /**< 'readings' at the previous sample */
+    uint32_t recent;                /**< readings decoded between the last two samples */
+    struct reactor_conn *prev;
+    struct reactor_conn *next;
+} reactor_conn_t;
+
+typedef enum {
+    REACTOR_CMD_ADD,                // Start serving 'conn'
+    REACTOR_CMD_SAMPLE,             // Publish the load of the interval that just ended
+    REACTOR_CMD_MIGRATE             // Move a connection to reactor 'target', 'gap' is their difference in load
+} reactor_cmd_type_t;
+
+/**
+ * entry of the handoff queue of a reactor
+ */
+typedef struct reactor_cmd {
+    reactor_cmd_type_t type;
+    reactor_conn_t *conn;
+    int target;
+    uint32_t gap;
+    struct reactor_cmd *next;
+} reactor_cmd_t;
+
+typedef struct reactor {
+    struct reactor_pool *pool;
+    pthread_t thread;
+    int epoll_fd;
+    int wake_fd;                    /**< eventfd in the epoll set, written after every post to the handoff queue */
+    pthread_mutex_t mutex;          /**< protects the handoff queue */
+    reactor_cmd_t *inbox_head;
+    reactor_cmd_t *inbox_tail;
+    reactor_conn_t *conns;          /**< connections served, only touched by the reactor thread */
+    uint32_t total;                 /**< readings decoded so far */
+    uint32_t total_mark;            /**< 'total' at the previous sample */
+    atomic_bool stop;
+    atomic_uint connections;
+    atomic_uint load;               /**< readings in the last interval */
+    atomic_uint migrated_in;
+    atomic_uint migrated_out;
+} reactor_t;
+
+struct reactor_pool {
+    reactor_t reactors[REACTOR_MAX];
+    int num_reactors;
+    atomic_uint next;               /**< round-robin cursor for new connections */
+    atomic_int busy_poll_us;        /**< > 0: the reactors busy poll, see reactor_pool_set_busy_poll() */
+    reactor_reading_fn_t on_reading;
+    reactor_closed_fn_t on_closed;
+    void *arg;
+    pthread_t balancer;
+    pthread_mutex_t mutex;          /**< protects 'stop' */
+    pthread_cond_t stop_signal;
+    bool stop;
+};
+
+static int post(reactor_t *reactor, reactor_cmd_type_t type, reactor_conn_t *conn, int target, uint32_t gap) {
+    reactor_cmd_t *cmd = malloc(sizeof(reactor_cmd_t));
+    if (cmd == NULL) return REACTOR_FAILURE;
+    *cmd = (reactor_cmd_t){type, conn, target, gap, NULL};
+
+    pthread_mutex_lock(&reactor->mutex);
+    if (reactor->inbox_tail == NULL) reactor->inbox_head = cmd;
+    else reactor->inbox_tail->next = cmd;
+    reactor->inbox_tail = cmd;
+    pthread_mutex_unlock(&reactor->mutex);
+
+    uint64_t one = 1;
+    if (write(reactor->wake_fd, &one, sizeof(one)) != sizeof(one)) {
+        // Only fails when the counter is about to overflow, the reactor is awake then anyway
+    }
+    return REACTOR_SUCCESS;
+}
+
+static void link_conn(reactor_t *reactor, reactor_conn_t *conn) {
+    conn->prev = NULL;
+    conn->next = reactor->conns;
+    if (reactor->conns != NULL) reactor->conns->prev = conn;
+    reactor->conns = conn;
+    atomic_fetch_add(&reactor->connections, 1);
+}
+
+static void unlink_conn(reactor_t *reactor, reactor_conn_t *conn) {
+    if (conn->prev != NULL) conn->prev->next = conn->next;
+    else reactor->conns = conn->next;
+    if (conn->next != NULL) conn->next->prev = conn->prev;
+    atomic_fetch_sub(&reactor->connections, 1);
+}
+
+static void close_conn(reactor_pool_t *pool, reactor_conn_t *conn) {
+    if (pool->on_closed != NULL) pool->on_closed(pool->arg, &conn->state);
+    close(conn->state.fd);
+    free(conn);
+}
+
+static void add_conn(reactor_t *reactor, reactor_conn_t *conn) {
+    int busy_poll_us = atomic_load(&reactor->pool->busy_poll_us);
+    if (busy_poll_us > 0) {
+        // Best effort: refused above net.core.busy_read without CAP_NET_ADMIN
+        setsockopt(conn->state.fd, SOL_SOCKET, SO_BUSY_POLL, &busy_poll_us, sizeof(busy_poll_us));
+    }
+    struct epoll_event ev = {.events = EPOLLIN | EPOLLRDHUP, .data.ptr = conn};
+    if (epoll_ctl(reactor->epoll_fd, EPOLL_CTL_ADD, conn->state.fd, &ev) < 0) {
+        fprintf(stderr, "Reactor could not watch connection %d: %s\n", conn->state.fd, strerror(errno));
+        close_conn(reactor->pool, conn);
+        return;
+    }
+    link_conn(reactor, conn);
+}
+
+/**
+ * Reads what is available (at most REACTOR_READ_BYTES) and passes on every completed reading
+ */
+static void read_conn(reactor_t *reactor, reactor_conn_t *conn) {
+    reactor_pool_t *pool = reactor->pool;
+    unsigned char buf[REACTOR_READ_BYTES];
+    handover_conn_t *state = &conn->state;
+
+    ssize_t got = recv(state->fd, buf, sizeof(buf), MSG_DONTWAIT);
+    if (got < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) return;
+    if (got <= 0) {
+        epoll_ctl(reactor->epoll_fd, EPOLL_CTL_DEL, state->fd, NULL);
+        unlink_conn(reactor, conn);
+        close_conn(pool, conn);
+        return;
+    }
+    state->last_active = time(NULL);
+
+    for (ssize_t used = 0; used < got;) {
+        size_t n = HANDOVER_FRAME_SIZE - state->partial_len;
+        if (n > (size_t)(got - used)) n = got - used;
+        memcpy(state->partial + state->partial_len, buf + used, n);
+        state->partial_len += n;
+        used += n;
+        if (state->partial_len < HANDOVER_FRAME_SIZE) break;
+
+        // <sensor_id><temperature><timestamp>, the order the sensor nodes send them in
+        sensor_data_t reading;
+        memcpy(&reading.id, state->partial, sizeof(reading.id));
+        memcpy(&reading.value, state->partial + sizeof(reading.id), sizeof(reading.value));
+        memcpy(&reading.ts, state->partial + sizeof(reading.id) + sizeof(reading.value), sizeof(reading.ts));
+        state->partial_len = 0;
+        state->sensor_id = reading.id;
+        conn->readings++;
+        reactor->total++;
+        pool->on_reading(pool->arg, &reading);
+    }
+}
+
+/**
+ * Publishes the load of the interval that just ended, per connection and for the whole reactor
+ */
+static void sample(reactor_t *reactor) {
+    for (reactor_conn_t *conn = reactor->conns; conn != NULL; conn = conn->next) {
+        conn->recent = conn->readings - conn->mark;
+        conn->mark = conn->readings;
+    }
+    atomic_store(&reactor->load, reactor->total - reactor->total_mark);
+    reactor->total_mark = reactor->total;
+}
+
+/**
+ * Moves the connection that evens out the load with 'target' best, 'gap' is the difference between the two
+ * Moving load x leaves a difference of |gap - 2x|: the move has to narrow it by at least REACTOR_MIN_SKEW, so light
+ * connections are not shuffled around for nothing once the heavy ones are spread.
+ */
+static void migrate(reactor_t *reactor, reactor_t *target, uint32_t gap) {
+    reactor_conn_t *best = NULL;
+    uint32_t best_remaining = 0;
+
+    for (reactor_conn_t *conn = reactor->conns; conn != NULL; conn = conn->next) {
+        if (conn->recent >= gap) continue;
+        uint32_t remaining = 2 * conn->recent > gap ? 2 * conn->recent - gap : gap - 2 * conn->recent;
+        if (gap - remaining < REACTOR_MIN_SKEW) continue;
+        if (best == NULL || remaining < best_remaining) {
+            best = conn;
+            best_remaining = remaining;
+        }
+    }
+    if (best == NULL) return;
+
+    epoll_ctl(reactor->epoll_fd, EPOLL_CTL_DEL, best->state.fd, NULL);
+    unlink_conn(reactor, best);
+    // The readings since the last sample stay counted here, the target starts counting from now
+    best->mark = best->readings;
+    best->recent = 0;
+    if (post(target, REACTOR_CMD_ADD, best, 0, 0) != REACTOR_SUCCESS) {
+        add_conn(reactor, best);    // Keep serving it here
+        return;
+    }
+    atomic_fetch_add(&reactor->migrated_out, 1);
+    atomic_fetch_add(&target->migrated_in, 1);
+}
+
+static void drain_inbox(reactor_t *reactor) {
+    uint64_t count;
+    if (read(reactor->wake_fd, &count, sizeof(count)) != sizeof(count)) {
+        // Nothing to reset, the queue is checked below either way
+    }
+
+    pthread_mutex_lock(&reactor->mutex);
+    reactor_cmd_t *cmd = reactor->inbox_head;
+    reactor->inbox_head = reactor->inbox_tail = NULL;
+    pthread_mutex_unlock(&reactor->mutex);
+
+    while (cmd != NULL) {
+        reactor_cmd_t *next = cmd->next;
+        if (cmd->type == REACTOR_CMD_ADD) add_conn(reactor, cmd->conn);
+        else if (cmd->type == REACTOR_CMD_SAMPLE) sample(reactor);
+        else migrate(reactor, &reactor->pool->reactors[cmd->target], cmd->gap);
+        free(cmd);
+        cmd = next;
+    }
+}
+
+static void *reactor_thread(void *arg) {
+    reactor_t *reactor = (reactor_t *)arg;
+    struct epoll_event events[REACTOR_EVENTS];
+
+    while (!atomic_load(&reactor->stop)) {
+        bool busy = atomic_load_explicit(&reactor->pool->busy_poll_us, memory_order_relaxed) > 0;
+        int ready = epoll_wait(reactor->epoll_fd, events, REACTOR_EVENTS, busy ? 0 : -1);
+        if (ready == 0) cpu_relax();
+        bool woken = false;
+        for (int i = 0; i < ready; i++) {
+            if (events[i].data.ptr == NULL) woken = true;
+            else read_conn(reactor, events[i].data.ptr);
+        }
+        // Commands only after the batch: a connection migrated away must not be read from this thread anymore
+        if (woken) drain_inbox(reactor);
+    }
+    return NULL;
+}
+
+static void *balancer_thread(void *arg) {
+    reactor_pool_t *pool = (reactor_pool_t *)arg;
+    bool settling = false;
+
+    pthread_mutex_lock(&pool->mutex);
+    while (!pool->stop) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += (REACTOR_BALANCE_MS % 1000) * 1000000L;
+        deadline.tv_sec += REACTOR_BALANCE_MS / 1000 + deadline.tv_nsec / 1000000000L;
+        deadline.tv_nsec %= 1000000000L;
+        pthread_cond_timedwait(&pool->stop_signal, &pool->mutex, &deadline);
+        if (pool->stop) break;
+        pthread_mutex_unlock(&pool->mutex);
+
+        int hot = 0, cold = 0;
+        uint32_t load[REACTOR_MAX];
+        for (int i = 0; i < pool->num_reactors; i++) {
+            load[i] = atomic_load(&pool->reactors[i].load);
+            if (load[i] > load[hot]) hot = i;
+            if (load[i] < load[cold]) cold = i;
+        }
+        // Skip one interval after a move, the sample that saw it half done would trigger another one
+        if (settling) {
+            settling = false;
+        } else if (hot != cold && load[hot] >= load[cold] + REACTOR_MIN_SKEW && load[hot] > REACTOR_IMBALANCE * load[cold]) {
+            settling = post(&pool->reactors[hot], REACTOR_CMD_MIGRATE, NULL, cold, load[hot] - load[cold]) == REACTOR_SUCCESS;
+        }
+        for (int i = 0; i < pool->num_reactors; i++) {
+            post(&pool->reactors[i], REACTOR_CMD_SAMPLE, NULL, 0, 0);
+        }
+
+        pthread_mutex_lock(&pool->mutex);
+    }
+    pthread_mutex_unlock(&pool->mutex);
+    return NULL;
+}
+
+static int reactor_init(reactor_t *reactor, reactor_pool_t *pool) {
+    memset(reactor, 0, sizeof(reactor_t));
+    reactor->pool = pool;
+    reactor->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    reactor->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    struct epoll_event ev = {.events = EPOLLIN, .data.ptr = NULL};
+    if (reactor->epoll_fd < 0 || reactor->wake_fd < 0
+        || epoll_ctl(reactor->epoll_fd, EPOLL_CTL_ADD, reactor->wake_fd, &ev) < 0
+        || pthread_mutex_init(&reactor->mutex, NULL) != 0) {
+        if (reactor->epoll_fd >= 0) close(reactor->epoll_fd);
+        if (reactor->wake_fd >= 0) close(reactor->wake_fd);
+        return REACTOR_FAILURE;
+    }
+    atomic_init(&reactor->stop, false);
+    atomic_init(&reactor->connections, 0);
+    atomic_init(&reactor->load, 0);
+    atomic_init(&reactor->migrated_in, 0);
+    atomic_init(&reactor->migrated_out, 0);
+    return REACTOR_SUCCESS;
+}
+
+/**
+ * Closes what a stopped reactor still holds: its connections and the ones that were on their way to it
+ */
+static void reactor_destroy(reactor_t *reactor) {
+    while (reactor->conns != NULL) {
+        reactor_conn_t *conn = reactor->conns;
+        unlink_conn(reactor, conn);
+        close_conn(reactor->pool, conn);
+    }
+    for (reactor_cmd_t *cmd = reactor->inbox_head; cmd != NULL;) {
+        reactor_cmd_t *next = cmd->next;
+        if (cmd->type == REACTOR_CMD_ADD) close_conn(reactor->pool, cmd->conn);
+        free(cmd);
+        cmd = next;
+    }
+    pthread_mutex_destroy(&reactor->mutex);
+    close(reactor->epoll_fd);
+    close(reactor->wake_fd);
+}
+
+int reactor_pool_init(reactor_pool_t **pool, int num_reactors, reactor_reading_fn_t on_reading,
+                      reactor_closed_fn_t on_closed, void *arg) {
+    if (pool == NULL || on_reading == NULL || num_reactors < 1 || num_reactors > REACTOR_MAX) return REACTOR_FAILURE;
+    reactor_pool_t *p = calloc(1, sizeof(reactor_pool_t));
+    if (p == NULL) return REACTOR_FAILURE;
+    p->on_reading = on_reading;
+    p->on_closed = on_closed;
+    p->arg = arg;
+    atomic_init(&p->next, 0);
+    atomic_init(&p->busy_poll_us, 0);
+    pthread_mutex_init(&p->mutex, NULL);
+    pthread_cond_init(&p->stop_signal, NULL);
+
+    for (int i = 0; i < num_reactors; i++) {
+        if (reactor_init(&p->reactors[i], p) != REACTOR_SUCCESS
+            || pthread_create(&p->reactors[i].thread, NULL, reactor_thread, &p->reactors[i]) != 0) {
+            fprintf(stderr, "Error: Could not start reactor %d, aborting.\n", i);
+            exit(EXIT_FAILURE);
+        }
+        p->num_reactors++;
+    }
+    if (pthread_create(&p->balancer, NULL, balancer_thread, p) != 0) {
+        fprintf(stderr, "Error: Could not start the reactor balancer, aborting.\n");
+        exit(EXIT_FAILURE);
+    }
+    *pool = p;
+    return REACTOR_SUCCESS;
+}
+
+int reactor_pool_add(reactor_pool_t *pool, const handover_conn_t *conn) {
+    if (pool == NULL || conn == NULL || conn->partial_len > HANDOVER_FRAME_SIZE) return REACTOR_FAILURE;
+    reactor_conn_t *c = calloc(1, sizeof(reactor_conn_t));
+    if (c == NULL) return REACTOR_FAILURE;
+    c->state = *conn;
+
+    reactor_t *reactor = &pool->reactors[atomic_fetch_add(&pool->next, 1) % pool->num_reactors];
+    if (post(reactor, REACTOR_CMD_ADD, c, 0, 0) != REACTOR_SUCCESS) {
+        free(c);
+        return REACTOR_FAILURE;
+    }
+    return REACTOR_SUCCESS;
+}
+
+int reactor_pool_get_load(reactor_pool_t *pool, reactor_load_t *loads) {
+    if (pool == NULL || loads == NULL) return 0;
+    for (int i = 0; i < pool->num_reactors; i++) {
+        reactor_t *reactor = &pool->reactors[i];
+        loads[i].connections = atomic_load(&reactor->connections);
+        loads[i].readings = atomic_load(&reactor->load);
+        loads[i].migrated_in = atomic_load(&reactor->migrated_in);
+        loads[i].migrated_out = atomic_load(&reactor->migrated_out);
+    }
+    return pool->num_reactors;
+}
+
+int reactor_pool_set_busy_poll(reactor_pool_t *pool, int busy_poll_us) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int result = REACTOR_SUCCESS;
+
+    if (pool == NULL || busy_poll_us < 0 || cpus <= 0) return REACTOR_FAILURE;
+    atomic_store(&pool->busy_poll_us, busy_poll_us);
+
+    for (int i = 0; i < pool->num_reactors; i++) {
+        reactor_t *reactor = &pool->reactors[i];
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        if (busy_poll_us > 0) {
+            CPU_SET(i % cpus, &set);
+        } else {
+            for (long cpu = 0; cpu < cpus && cpu < CPU_SETSIZE; cpu++) CPU_SET(cpu, &set);
+        }
+        if (pthread_setaffinity_np(reactor->thread, sizeof(set), &set) != 0) result = REACTOR_FAILURE;
+
+        // A reactor that sleeps in epoll_wait only sees the new mode after its next event
+        uint64_t one = 1;
+        if (write(reactor->wake_fd, &one, sizeof(one)) != sizeof(one)) {
+            // The reactor is awake already
+        }
+    }
+    return result;
+}
+
+int reactor_pool_free(reactor_pool_t **pool) {
+    if (pool == NULL || *pool == NULL) return REACTOR_FAILURE;
+    reactor_pool_t *p = *pool;
+
+    // The balancer first, so nothing is migrated to a reactor that already stopped
+    pthread_mutex_lock(&p->mutex);
+    p->stop = true;
+    pthread_cond_signal(&p->stop_signal);
+    pthread_mutex_unlock(&p->mutex);
+    pthread_join(p->balancer, NULL);
+
+    for (int i = 0; i < p->num_reactors; i++) {
+        uint64_t one = 1;
+        atomic_store(&p->reactors[i].stop, true);
+        if (write(p->reactors[i].wake_fd, &one, sizeof(one)) != sizeof(one)) {
+            // The reactor is awake already
+        }
+    }
+    for (int i = 0; i < p->num_reactors; i++) pthread_join(p->reactors[i].thread, NULL);
+    for (int i = 0; i < p->num_reactors; i++) reactor_destroy(&p->reactors[i]);
+
+    pthread_mutex_destroy(&p->mutex);
+    pthread_cond_destroy(&p->stop_signal);
+    free(p);
+    *pool = NULL;
+    return REACTOR_SUCCESS;
+}
@@ -0,0 +1,105 @@
+/**
+ * \author {AUTHOR}
+ */
+
+#ifndef _REACTOR_H_
+#define _REACTOR_H_
+
+#include <stdint.h>
+#include "config.h"
+#include "handover.h"
+
+#define REACTOR_FAILURE -1
+#define REACTOR_SUCCESS 0
+
+#define REACTOR_MAX 16                  // Maximum number of reactor threads in a pool
+#define REACTOR_BALANCE_MS 500          // Interval of the load samples and of the balancing decisions
+#define REACTOR_IMBALANCE 1.5           // The hottest reactor is relieved when its load exceeds this times the coldest one
+#define REACTOR_MIN_SKEW 16             // ... and the difference is at least this many readings per interval
+
+/*
+ * Reactor threads for the sensor connections: every reactor waits on its own epoll set and decodes the reading
+ * frames of its connections. New connections are assigned round-robin, which balances the number of connections
+ * but not the traffic, and sensors stay connected for a long time. So every REACTOR_BALANCE_MS the reactors publish
+ * how many readings every connection delivered, and a balancer thread tells the hottest reactor to move a connection
+ * to the coldest one. The move happens on the threads that own the connection: the hot reactor removes it from its
+ * epoll set between two reads and posts it, partial frame included, on the handoff queue of the cold reactor, which
+ * adds it to its own set. Bytes that arrive in between wait in the socket, so every connection is read by exactly
+ * one reactor at a time and its readings keep their order.
+ *
+ * The gateway in this tree has no connection manager to feed the pool yet, so it is not linked into sensor_gateway;
+ * 'make reactor_test' runs a skewed load through it under ThreadSanitizer.
+ */
+
+typedef struct reactor_pool reactor_pool_t;
+
+/**
+ * Called for every decoded reading, concurrently from all reactor threads
+ */
+typedef void (*reactor_reading_fn_t)(void *arg, const sensor_data_t *reading);
+
+/**
+ * Called when the sensor closed the connection or it broke, the descriptor is closed right after the call
+ */
+typedef void (*reactor_closed_fn_t)(void *arg, const handover_conn_t *conn);
+
+/**
+ * load of one reactor over the last REACTOR_BALANCE_MS
+ */
+typedef struct reactor_load {
+    uint32_t connections;       /**< connections the reactor serves */
+    uint32_t readings;          /**< readings decoded in the last interval */
+    uint32_t migrated_in;       /**< connections moved to this reactor so far */
+    uint32_t migrated_out;      /**< connections moved away from this reactor so far */
+} reactor_load_t;
+
+/**
+ * Starts 'num_reactors' reactor threads and the balancer
+ * \param pool a double pointer to the pool that needs to be initialized
+ * \param num_reactors number of reactor threads (1 to REACTOR_MAX)
+ * \param on_reading called for every reading
+ * \param on_closed called for every connection that ends, may be NULL
+ * \param arg passed to the callbacks
+ * \return REACTOR_SUCCESS on success and REACTOR_FAILURE if an error occurred
+ */
+int reactor_pool_init(reactor_pool_t **pool, int num_reactors, reactor_reading_fn_t on_reading,
+                      reactor_closed_fn_t on_closed, void *arg);
+
+/**
+ * Hands a connection to the next reactor (round-robin), the pool owns the descriptor from then on
+ * A connection taken over from an old gateway keeps its partial frame and sensor id.
+ * \param pool a pointer to the pool that is used
+ * \param conn the connection and its state, copied
+ * \return REACTOR_SUCCESS on success and REACTOR_FAILURE if an error occurred (the caller still owns the descriptor)
+ */
+int reactor_pool_add(reactor_pool_t *pool, const handover_conn_t *conn);
+
+/**
+ * Reports the load of every reactor as of the last sample
+ * \param pool a pointer to the pool that is used
+ * \param loads pre-allocated array with an element for every reactor
+ * \return the number of reactors
+ */
+int reactor_pool_get_load(reactor_pool_t *pool, reactor_load_t *loads);
+
+/**
+ * Switches the reactors between sleeping in epoll_wait and busy polling, for deployments where latency matters more
+ * than CPU. Busy reactors call epoll_wait without a timeout in a loop, ask the kernel to busy poll the device queue
+ * (SO_BUSY_POLL) on the connections added from then on and are pinned to their own CPU: reactor i on CPU i.
+ * Setting SO_BUSY_POLL above net.core.busy_read needs CAP_NET_ADMIN, without it the reactors only spin in user space.
+ * A spinning reactor only gives its CPU up at the end of its time slice, so this only pays with a spare CPU per reactor:
+ * on a single CPU the send-to-callback latency measured by reactor_test rose from a p50 of 5 us to 750 us.
+ * \param pool a pointer to the pool that is used
+ * \param busy_poll_us microseconds the kernel may busy poll per read, 0 switches back to sleeping and unpins the reactors
+ * \return REACTOR_SUCCESS on success and REACTOR_FAILURE if an error occurred
+ */
+int reactor_pool_set_busy_poll(reactor_pool_t *pool, int busy_poll_us);
+
+/**
+ * Stops the balancer and the reactors, closes all connections and frees all allocated resources
+ * \param pool a double pointer to the pool that needs to be freed
+ * \return REACTOR_SUCCESS on success and REACTOR_FAILURE if an error occurred
+ */
+int reactor_pool_free(reactor_pool_t **pool);
+
+#endif  //_REACTOR_H_
@@ -0,0 +1,219 @@
+/**
+ * \author {AUTHOR}
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <inttypes.h>
+#include <sched.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include "reactor.h"
+
+#define TEST_REACTORS 3
+#define TEST_SENSORS 6              // Sensor i + 1 lands on reactor i % TEST_REACTORS
+#define TEST_TICKS 3000             // Milliseconds the sensors send, several balance intervals
+#define CHATTY_PER_TICK 8           // Readings per tick of the two chatty sensors, the others send one
+#define LATENCY_ROUNDS 2000         // Round trips per mode of the latency measurement
+#define TEST_BUSY_US 50             // SO_BUSY_POLL of the busy polling runs
+
+/**
+ * what arrived from one sensor, only written by the reactor that serves its connection at that moment
+ */
+typedef struct sensor_seen {
+    uint32_t readings;
+    sensor_ts_t last_seq;           /**< the timestamp field carries the sequence number of the reading */
+    uint32_t out_of_order;
+} sensor_seen_t;
+
+typedef struct test_state {
+    sensor_seen_t seen[TEST_SENSORS + 1];
+    atomic_uint total;
+} test_state_t;
+
+static void on_reading(void *arg, const sensor_data_t *reading) {
+    test_state_t *state = arg;
+    if (reading->id >= 1 && reading->id <= TEST_SENSORS) {
+        sensor_seen_t *seen = &state->seen[reading->id];
+        if (seen->readings > 0 && reading->ts != seen->last_seq + 1) seen->out_of_order++;
+        seen->last_seq = reading->ts;
+        seen->readings++;
+    }
+    atomic_fetch_add(&state->total, 1);
+}
+
+static bool is_chatty(int sensor) {
+    return sensor == 1 || sensor == 1 + TEST_REACTORS;     // Both on reactor 0
+}
+
+static void make_frame(sensor_id_t id, sensor_ts_t seq, unsigned char *frame) {
+    sensor_value_t value = 15 + (seq % 40) / 4.0;
+    memcpy(frame, &id, sizeof(id));
+    memcpy(frame + sizeof(id), &value, sizeof(value));
+    memcpy(frame + sizeof(id) + sizeof(value), &seq, sizeof(seq));
+}
+
+/**
+ * Sends 'len' bytes in chunks cut at random points, so frames arrive split over several reads
+ */
+static void send_split(int fd, const unsigned char *data, size_t len, unsigned int *seed) {
+    for (size_t sent = 0; sent < len;) {
+        size_t n = 1 + rand_r(seed) % HANDOVER_FRAME_SIZE;
+        if (n > len - sent) n = len - sent;
+        if (send(fd, data + sent, n, MSG_NOSIGNAL) != (ssize_t)n) {
+            perror("FAIL: sending readings");
+            exit(EXIT_FAILURE);
+        }
+        sent += n;
+    }
+}
+
+static void sleep_ms(long ms) {
+    struct timespec ts = {ms / 1000, (ms % 1000) * 1000000L};
+    nanosleep(&ts, NULL);
+}
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+/**
+ * Adds a connected socket pair to the pool as the connection of 'sensor'
+ * \return the sensor end
+ */
+static int connect_sensor(reactor_pool_t *pool, int sensor) {
+    int pair[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, pair) != 0) {
+        perror("FAIL: socketpair");
+        exit(EXIT_FAILURE);
+    }
+    handover_conn_t conn = {.fd = pair[0], .sensor_id = (sensor_id_t)sensor};
+    if (reactor_pool_add(pool, &conn) != REACTOR_SUCCESS) {
+        fprintf(stderr, "FAIL: adding sensor %d\n", sensor);
+        exit(EXIT_FAILURE);
+    }
+    return pair[1];
+}
+
+static bool wait_total(test_state_t *state, uint32_t expected) {
+    for (int i = 0; i < 5000 && atomic_load(&state->total) < expected; i++) sleep_ms(1);
+    return atomic_load(&state->total) == expected;
+}
+
+/**
+ * Two chatty sensors share reactor 0: the balancer must move one of them away, and every reading of every sensor must
+ * arrive exactly once and in order although the frames are split at random points
+ */
+static int test_migration(int busy_poll_us) {
+    static test_state_t state;
+    unsigned char frames[CHATTY_PER_TICK * HANDOVER_FRAME_SIZE];
+    int fds[TEST_SENSORS + 1];
+    sensor_ts_t sent[TEST_SENSORS + 1] = {0};
+    unsigned int seed = 1;
+    reactor_pool_t *pool;
+    int failed = 0;
+
+    memset(&state, 0, sizeof(state));
+    if (reactor_pool_init(&pool, TEST_REACTORS, on_reading, NULL, &state) != REACTOR_SUCCESS) return 1;
+    if (busy_poll_us > 0) reactor_pool_set_busy_poll(pool, busy_poll_us);
+    for (int sensor = 1; sensor <= TEST_SENSORS; sensor++) fds[sensor] = connect_sensor(pool, sensor);
+
+    for (int tick = 0; tick < TEST_TICKS; tick++) {
+        for (int sensor = 1; sensor <= TEST_SENSORS; sensor++) {
+            int n = is_chatty(sensor) ? CHATTY_PER_TICK : 1;
+            for (int i = 0; i < n; i++) make_frame(sensor, sent[sensor]++, frames + i * HANDOVER_FRAME_SIZE);
+            send_split(fds[sensor], frames, n * HANDOVER_FRAME_SIZE, &seed);
+        }
+        sleep_ms(1);
+    }
+    uint32_t expected = 0;
+    for (int sensor = 1; sensor <= TEST_SENSORS; sensor++) expected += sent[sensor];
+    if (!wait_total(&state, expected)) {
+        fprintf(stderr, "FAIL: %u of %" PRIu32 " readings arrived\n", atomic_load(&state.total), expected);
+        failed = 1;
+    }
+
+    reactor_load_t loads[TEST_REACTORS];
+    reactor_pool_get_load(pool, loads);
+    reactor_pool_free(&pool);
+    for (int sensor = 1; sensor <= TEST_SENSORS; sensor++) close(fds[sensor]);
+
+    for (int sensor = 1; sensor <= TEST_SENSORS; sensor++) {
+        sensor_seen_t *seen = &state.seen[sensor];
+        if (seen->readings != sent[sensor] || seen->out_of_order > 0) {
+            fprintf(stderr, "FAIL: sensor %d: %" PRIu32 " of %ld readings, %" PRIu32 " out of order\n", sensor,
+                    seen->readings, (long)sent[sensor], seen->out_of_order);
+            failed = 1;
+        }
+    }
+    if (loads[0].migrated_out == 0 || loads[0].connections != 1) {
+        fprintf(stderr, "FAIL: reactor 0 moved %" PRIu32 " connections and kept %" PRIu32 "\n",
+                loads[0].migrated_out, loads[0].connections);
+        failed = 1;
+    }
+    if (!failed) {
+        printf("ok: %s, %" PRIu32 " readings in order, connections per reactor %" PRIu32 "/%" PRIu32 "/%" PRIu32
+               " after %" PRIu32 " move(s)\n", busy_poll_us > 0 ? "busy polling" : "sleeping", expected,
+               loads[0].connections, loads[1].connections, loads[2].connections, loads[0].migrated_out);
+    }
+    return failed;
+}
+
+static int compare_u64(const void *x, const void *y) {
+    uint64_t a = *(const uint64_t *)x, b = *(const uint64_t *)y;
+    return a < b ? -1 : a > b;
+}
+
+/**
+ * Round trips of single readings through one reactor: time from the send to the callback. The numbers only mean
+ * something in a build without ThreadSanitizer, e.g. gcc -O2 reactor_test.c reactor.c -lpthread
+ */
+static int measure_latency(int busy_poll_us) {
+    static test_state_t state;
+    static uint64_t latency[LATENCY_ROUNDS];
+    unsigned char frame[HANDOVER_FRAME_SIZE];
+    reactor_pool_t *pool;
+
+    memset(&state, 0, sizeof(state));
+    if (reactor_pool_init(&pool, 1, on_reading, NULL, &state) != REACTOR_SUCCESS) return 1;
+    if (busy_poll_us > 0) reactor_pool_set_busy_poll(pool, busy_poll_us);
+    int fd = connect_sensor(pool, 1);
+
+    for (uint32_t i = 0; i < LATENCY_ROUNDS; i++) {
+        make_frame(1, i, frame);
+        uint64_t start = now_ns();
+        if (send(fd, frame, sizeof(frame), MSG_NOSIGNAL) != sizeof(frame)) break;
+        while (atomic_load(&state.total) <= i) sched_yield();
+        latency[i] = now_ns() - start;
+    }
+    reactor_pool_free(&pool);
+    close(fd);
+
+    qsort(latency, LATENCY_ROUNDS, sizeof(uint64_t), compare_u64);
+    printf("latency %s: p50 %" PRIu64 " ns, p99 %" PRIu64 " ns\n", busy_poll_us > 0 ? "busy polling" : "sleeping",
+           latency[LATENCY_ROUNDS / 2], latency[LATENCY_ROUNDS * 99 / 100]);
+    return state.seen[1].readings == LATENCY_ROUNDS && state.seen[1].out_of_order == 0 ? 0 : 1;
+}
+
+/**
+ * Runs the migration check with sleeping and with busy polling reactors, then measures the latency of both modes
+ */
+int main(void) {
+    int failed = 0;
+
+    failed |= test_migration(0);
+    failed |= test_migration(TEST_BUSY_US);
+    failed |= measure_latency(0);
+    failed |= measure_latency(TEST_BUSY_US);
+
+    printf("%s\n", failed ? "FAILED" : "PASSED");
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
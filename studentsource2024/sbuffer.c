@@ -4,6 +4,8 @@
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <stdbool.h>
+#include <stdatomic.h>
 #include "sbuffer.h"
 #include <pthread.h>
 
@@ -12,7 +14,12 @@
  */
 typedef struct sbuffer_node {
     struct sbuffer_node *next;  /**< a pointer to the next node*/
+#ifdef SENSOR_COMPACT
+    sensor_data_compact_t data; /**< the data in compact form, the timestamp is relative to the 'ts_base' of the buffer */
+    sensor_data_t full[];       /**< the whole reading when data.ts_delta is SENSOR_TS_DELTA_ESCAPE, only allocated then */
+#else
     sensor_data_t data;         /**< a structure containing the data */
+#endif
 } sbuffer_node_t;
 
 /**
@@ -21,17 +28,89 @@ typedef struct sbuffer_node {
 struct sbuffer {
     sbuffer_node_t *head;       /**< a pointer to the first node in the buffer */
     sbuffer_node_t *tail;       /**< a pointer to the last node in the buffer */
+    atomic_size_t count;        /**< number of nodes in the buffer, end-of-stream markers included, only changed under the lock */
     //The project involves multi-threading, where multiple threads (the producer and consumers) 
     //access shared resources like the buffer and the CSV file. Without proper synchronization, data races and inconsistent states could occur.
     pthread_mutex_t mutex;    // Mutex
     pthread_cond_t condition;  // Condition variable
+#ifdef SENSOR_COMPACT
+    sensor_ts_t ts_base;        /**< base of the compact timestamps, only moved while the buffer is empty */
+#endif
 };
 
+/**
+ * In compact mode an empty buffer is rebased on the first incoming reading, so the deltas stay small while data keeps
+ * flowing. The buffer must be locked.
+ */
+static void rebase_if_empty(sbuffer_t *buffer, sensor_ts_t ts) {
+#ifdef SENSOR_COMPACT
+    if (buffer->head == NULL) buffer->ts_base = ts;
+#else
+    (void)buffer;
+    (void)ts;
+#endif
+}
+
+/**
+ * Stores 'data' in 'node', the buffer must be locked
+ * A reading without a compact form (see sensor_data_pack()) is kept in full in a wider node that replaces 'node'
+ * \return the node holding the reading, NULL if the wider node could not be allocated ('node' is left untouched then)
+ */
+static sbuffer_node_t *node_store(sbuffer_t *buffer, sbuffer_node_t *node, const sensor_data_t *data) {
+#ifdef SENSOR_COMPACT
+    sensor_data_t reading = *data;
+    if (reading.id == 0) reading.ts = buffer->ts_base; // The end-of-stream marker carries no timestamp
+    if (sensor_data_pack(&reading, buffer->ts_base, &node->data) == 0) return node;
+
+    sbuffer_node_t *wide = malloc(sizeof(sbuffer_node_t) + sizeof(sensor_data_t));
+    if (wide == NULL) return NULL;
+    wide->next = node->next;
+    wide->data = (sensor_data_compact_t){.id = data->id, .ts_delta = SENSOR_TS_DELTA_ESCAPE};
+    wide->full[0] = *data;
+    free(node);
+    return wide;
+#else
+    (void)buffer;
+    node->data = *data;
+    return node;
+#endif
+}
+
+/**
+ * Reads the data of 'node' back into a sensor_data_t
+ * \param base the base timestamp of the buffer at the time the node was removed, ignored when not in compact mode
+ */
+static void node_load(const sbuffer_node_t *node, sensor_ts_t base, sensor_data_t *data) {
+#ifdef SENSOR_COMPACT
+    if (node->data.ts_delta == SENSOR_TS_DELTA_ESCAPE) *data = node->full[0];
+    else sensor_data_unpack(&node->data, base, data);
+#else
+    (void)base;
+    *data = node->data;
+#endif
+}
+
+/**
+ * Current base timestamp of the buffer, the buffer must be locked
+ */
+static sensor_ts_t buffer_base(const sbuffer_t *buffer) {
+#ifdef SENSOR_COMPACT
+    return buffer->ts_base;
+#else
+    (void)buffer;
+    return 0;
+#endif
+}
+
 int sbuffer_init(sbuffer_t **buffer) {
     *buffer = malloc(sizeof(sbuffer_t));
     if (*buffer == NULL) return SBUFFER_FAILURE;
     (*buffer)->head = NULL;
     (*buffer)->tail = NULL;
+    atomic_init(&(*buffer)->count, 0);
+#ifdef SENSOR_COMPACT
+    (*buffer)->ts_base = 0;
+#endif
 
     //We have to verify whether the mutex or condition variable were successfully initialized.
     // Check and intialize mutex
@@ -90,7 +169,7 @@ int sbuffer_remove(sbuffer_t *buffer, sensor_data_t *data) {
     }
 
     //if (buffer->head == NULL) return SBUFFER_NO_DATA;
-    *data = buffer->head->data;
+    node_load(buffer->head, buffer_base(buffer), data);
     dummy = buffer->head;
 
     if (buffer->head == buffer->tail) // buffer has only one node
@@ -100,6 +179,7 @@ int sbuffer_remove(sbuffer_t *buffer, sensor_data_t *data) {
     {
         buffer->head = buffer->head->next;
     }
+    atomic_fetch_sub_explicit(&buffer->count, 1, memory_order_relaxed);
     free(dummy);
 
     pthread_mutex_unlock(&buffer->mutex);
@@ -114,10 +194,17 @@ int sbuffer_insert(sbuffer_t *buffer, sensor_data_t *data) {
     dummy = malloc(sizeof(sbuffer_node_t));
     if (dummy == NULL) return SBUFFER_FAILURE;
 
-    dummy->data = *data;
     dummy->next = NULL;
     
     pthread_mutex_lock(&buffer->mutex);
+    if (data->id != 0) rebase_if_empty(buffer, data->ts);
+    sbuffer_node_t *stored = node_store(buffer, dummy, data);
+    if (stored == NULL) {
+        pthread_mutex_unlock(&buffer->mutex);
+        free(dummy);
+        return SBUFFER_FAILURE;
+    }
+    dummy = stored;
     if (buffer->tail == NULL) // buffer empty (buffer->head should also be NULL
     {
         buffer->head = buffer->tail = dummy;
@@ -126,6 +213,7 @@ int sbuffer_insert(sbuffer_t *buffer, sensor_data_t *data) {
         buffer->tail->next = dummy;
         buffer->tail = buffer->tail->next;
     }
+    atomic_fetch_add_explicit(&buffer->count, 1, memory_order_relaxed);
 
     //Signal new data is ready to be removed
     pthread_cond_signal(&buffer->condition);
@@ -133,3 +221,140 @@ int sbuffer_insert(sbuffer_t *buffer, sensor_data_t *data) {
 
     return SBUFFER_SUCCESS;
 }
+
+static void free_chain(sbuffer_node_t *chain) {
+    while (chain) {
+        sbuffer_node_t *node = chain;
+        chain = chain->next;
+        free(node);
+    }
+}
+
+int sbuffer_insert_block(sbuffer_t *buffer, const sensor_block_t *block) {
+    sbuffer_node_t *first = NULL, *last = NULL;
+
+    if (buffer == NULL || block == NULL) return SBUFFER_FAILURE;
+    if (block->count == 0) return SBUFFER_SUCCESS;
+
+    // Allocate the chain of nodes outside the critical section
+    for (uint32_t i = 0; i < block->count; i++) {
+        sbuffer_node_t *node = malloc(sizeof(sbuffer_node_t));
+        if (node == NULL) {
+            free_chain(first);
+            return SBUFFER_FAILURE;
+        }
+        node->next = NULL;
+        if (last == NULL) first = node;
+        else last->next = node;
+        last = node;
+    }
+
+    pthread_mutex_lock(&buffer->mutex);
+
+    // Fill in the data, in compact mode this depends on the base timestamp of the buffer: one base for the whole block
+    rebase_if_empty(buffer, block->ts[0]);
+    sbuffer_node_t **link = &first;
+    last = NULL;
+    for (uint32_t i = 0; i < block->count; i++) {
+        sensor_data_t reading = {block->id[i], block->value[i], block->ts[i]};
+        sbuffer_node_t *stored = node_store(buffer, *link, &reading);
+        if (stored == NULL) {
+            pthread_mutex_unlock(&buffer->mutex);
+            free_chain(first);
+            return SBUFFER_FAILURE;
+        }
+        *link = stored;
+        last = stored;
+        link = &stored->next;
+    }
+
+    if (buffer->tail == NULL) // buffer empty
+    {
+        buffer->head = first;
+    } else // buffer not empty
+    {
+        buffer->tail->next = first;
+    }
+    buffer->tail = last;
+    atomic_fetch_add_explicit(&buffer->count, block->count, memory_order_relaxed);
+
+    //Several readings became available, wake up every waiting consumer
+    pthread_cond_broadcast(&buffer->condition);
+    pthread_mutex_unlock(&buffer->mutex);
+
+    return SBUFFER_SUCCESS;
+}
+
+/**
+ * Shared part of sbuffer_remove_block() and sbuffer_poll_block(), 'wait' selects whether an empty buffer blocks
+ */
+static int take_block(sbuffer_t *buffer, sensor_block_t *block, bool wait) {
+    sbuffer_node_t *chain, *node;
+    sensor_ts_t base;
+    uint32_t count = 0;
+
+    if (buffer == NULL || block == NULL) return SBUFFER_FAILURE;
+    block->count = 0;
+
+    // A poller looks without the lock first, so spinning on an empty buffer does not contend with the producers
+    if (!wait && atomic_load_explicit(&buffer->count, memory_order_relaxed) == 0) return SBUFFER_EMPTY;
+
+    pthread_mutex_lock(&buffer->mutex);
+
+    if (!wait && buffer->head == NULL) {
+        pthread_mutex_unlock(&buffer->mutex);
+        return SBUFFER_EMPTY;
+    }
+    while (buffer->head == NULL) { // Wait if the buffer is empty
+        pthread_cond_wait(&buffer->condition, &buffer->mutex);
+    }
+
+    if (buffer->head->data.id == 0) { // Only the end-of-stream marker is left
+        pthread_mutex_unlock(&buffer->mutex);
+        return SBUFFER_NO_DATA;
+    }
+
+    // Detach the readings in front of the marker, at most one block full
+    chain = buffer->head;
+    node = chain;
+    count = 1;
+    while (count < SENSOR_BLOCK_CAPACITY && node->next != NULL && node->next->data.id != 0) {
+        node = node->next;
+        count++;
+    }
+    buffer->head = node->next;
+    if (buffer->head == NULL) buffer->tail = NULL;
+    atomic_fetch_sub_explicit(&buffer->count, count, memory_order_relaxed);
+    node->next = NULL;
+    base = buffer_base(buffer); // May move as soon as the buffer is unlocked and empty
+
+    pthread_mutex_unlock(&buffer->mutex);
+
+    // Copy the readings into the columns and free the nodes without holding the lock
+    while (chain) {
+        sensor_data_t reading;
+        node = chain;
+        chain = chain->next;
+        node_load(node, base, &reading);
+        block->id[block->count] = reading.id;
+        block->value[block->count] = reading.value;
+        block->ts[block->count] = reading.ts;
+        block->count++;
+        free(node);
+    }
+
+    return SBUFFER_SUCCESS;
+}
+
+int sbuffer_remove_block(sbuffer_t *buffer, sensor_block_t *block) {
+    return take_block(buffer, block, true);
+}
+
+int sbuffer_poll_block(sbuffer_t *buffer, sensor_block_t *block) {
+    return take_block(buffer, block, false);
+}
+
+size_t sbuffer_size(sbuffer_t *buffer) {
+    if (buffer == NULL) return 0;
+    return atomic_load_explicit(&buffer->count, memory_order_relaxed);
+}
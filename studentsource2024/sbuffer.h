@@ -10,6 +10,7 @@
 #define SBUFFER_FAILURE -1
 #define SBUFFER_SUCCESS 0
 #define SBUFFER_NO_DATA 1
+#define SBUFFER_EMPTY 2
 
 typedef struct sbuffer sbuffer_t;
 
@@ -44,4 +45,40 @@ int sbuffer_remove(sbuffer_t *buffer, sensor_data_t *data);
 */
 int sbuffer_insert(sbuffer_t *buffer, sensor_data_t *data);
 
+/**
+ * Inserts all 'block->count' readings of 'block' at the end of 'buffer' (at the 'tail'), in order
+ * The nodes are allocated before the buffer is locked, the lock is taken only once for the whole block
+ * \param buffer a pointer to the buffer that is used
+ * \param block a pointer to the block of readings, that will be copied into the buffer
+ * \return SBUFFER_SUCCESS on success and SBUFFER_FAILURE if an error occured (nothing is inserted then)
+ */
+int sbuffer_insert_block(sbuffer_t *buffer, const sensor_block_t *block);
+
+/**
+ * Removes up to SENSOR_BLOCK_CAPACITY readings from the head of 'buffer' with a single lock acquisition and stores them in 'block'
+ * Blocks until at least one reading (or the end-of-stream marker) is available, then takes whatever is there without waiting for more
+ * Removal stops in front of the end-of-stream marker (id == 0), which is left in the buffer for the other consumers
+ * \param buffer a pointer to the buffer that is used
+ * \param block a pointer to a pre-allocated block, 'block->count' is set to the number of readings removed
+ * \return SBUFFER_SUCCESS on success, SBUFFER_NO_DATA if the end-of-stream marker is at the head and SBUFFER_FAILURE if an error occurred
+ */
+int sbuffer_remove_block(sbuffer_t *buffer, sensor_block_t *block);
+
+/**
+ * Same as sbuffer_remove_block(), but returns SBUFFER_EMPTY right away instead of blocking when 'buffer' is empty
+ * Meant for consumers that spin on the buffer: an empty buffer is detected without taking the lock
+ * \param buffer a pointer to the buffer that is used
+ * \param block a pointer to a pre-allocated block, 'block->count' is set to the number of readings removed
+ * \return SBUFFER_SUCCESS on success, SBUFFER_NO_DATA if the end-of-stream marker is at the head, SBUFFER_EMPTY if
+ * there is nothing in the buffer and SBUFFER_FAILURE if an error occurred
+ */
+int sbuffer_poll_block(sbuffer_t *buffer, sensor_block_t *block);
+
+/**
+ * Returns the number of readings waiting in 'buffer', a snapshot that may be outdated as soon as it is returned
+ * \param buffer a pointer to the buffer that is used
+ * \return the number of readings in the buffer (end-of-stream markers included), 0 if 'buffer' is NULL
+ */
+size_t sbuffer_size(sbuffer_t *buffer);
+
 #endif  //_SBUFFER_H_
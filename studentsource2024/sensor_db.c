@@ -0,0 +1,1769 @@
+/**
+ * \author {AUTHOR}
+ */
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <limits.h>
+#include <math.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <time.h>
+#include "sensor_db.h"
+#include "threadpool.h"
+#include "crc32c.h"
+
+#define IDX_SUFFIX ".idx"
+#define ROOMS_SUFFIX ".rooms"
+#define SEGMENTS_SUFFIX ".seg"
+#define ROLLUP_LEVELS 3
+#define IDX_MAGIC "SDBIDX3"         // Magic and version at the start of the block index
+#define SEG_MAGIC "SDBSEG1"         // Magic and version at the start of the segment table
+#define MAX_ROW_LENGTH 344          // Longest CSV row: 5 digit id, %.2f of -DBL_MAX (313 chars), 20 char ts, separators, NUL
+#define DIRECT_ALIGN 4096           // Offset, length and buffer alignment of O_DIRECT writes
+#define DIRECT_BUFFER_SIZE (DIRECT_ALIGN + (SENSOR_BLOCK_CAPACITY * MAX_ROW_LENGTH + DIRECT_ALIGN - 1) / DIRECT_ALIGN * DIRECT_ALIGN)
+
+_Static_assert(SENSOR_DB_SEGMENT_BLOCKS <= 32, "the room index stores the blocks of a segment in a 32-bit mask");
+
+/**
+ * entry of the block index, stored as is in name.idx
+ * The min/max fields are the zone map of the block: a scan skips the block if its predicate can't match any row in it.
+ */
+typedef struct sensor_db_index_entry {
+    uint64_t offset;        /**< byte offset of the block in the data file */
+    int64_t min_ts;
+    int64_t max_ts;
+    double min_value;
+    double max_value;
+    uint32_t length;        /**< length of the block in bytes */
+    uint32_t count;         /**< rows in the block */
+    uint32_t segment;       /**< segment the block belongs to */
+    sensor_id_t min_id;
+    sensor_id_t max_id;
+    uint32_t crc;           /**< CRC32C of the bytes of the block */
+    uint32_t reserved;
+} sensor_db_index_entry_t;
+
+/**
+ * entry of the segment table, stored as is in name.seg and appended when the segment closes, after its rollup records
+ * and room index lines. The last complete entry is the high-water mark: the blocks before its end_block are rolled up.
+ */
+typedef struct sensor_db_segment_entry {
+    int64_t min_ts;                         /**< zone map of the rows of the segment */
+    int64_t max_ts;
+    uint64_t rollup_first[ROLLUP_LEVELS];   /**< first record of the segment in each rollup file */
+    uint64_t rooms_end;                     /**< size of name.rooms up to and including the lines of the segment */
+    uint32_t rollup_count[ROLLUP_LEVELS];   /**< records of the segment in each rollup file */
+    uint32_t segment;
+    uint32_t first_block;
+    uint32_t end_block;                     /**< first block after the segment */
+    sensor_id_t min_id;
+    sensor_id_t max_id;
+    uint32_t reserved;
+} sensor_db_segment_entry_t;
+
+/**
+ * count/sum/min/max of the readings of one sensor in one bucket of one segment, stored as is in the rollup files
+ * The records of a segment are sorted on (sensor, bucket), so a query finds its buckets with a binary search.
+ */
+typedef struct sensor_db_rollup_record {
+    int64_t bucket;         /**< start of the bucket */
+    double sum;
+    double min;
+    double max;
+    uint32_t count;
+    sensor_id_t sensor_id;
+    uint16_t reserved;
+} sensor_db_rollup_record_t;
+
+/**
+ * sensor seen in the open segment, with the blocks of the segment it occurs in
+ */
+typedef struct segment_sensor {
+    sensor_id_t sensor_id;
+    uint32_t blocks;        /**< bit i set: block 'segment_first_block + i' holds a reading of the sensor */
+} segment_sensor_t;
+
+/**
+ * rollup levels from coarse to fine, the aggregate query tries them in this order
+ */
+static const struct {
+    const char *suffix;
+    sensor_ts_t length;     /**< seconds per bucket */
+} rollup_levels[ROLLUP_LEVELS] = {
+        {".day",    86400},
+        {".hour",   3600},
+        {".minute", 60},
+};
+
+/**
+ * readings of one sensor in the hot tier: a ring of columns, the timestamp relative to the hot base of the database
+ * and the value as parsed back from its row (so the hot tier returns exactly what is on disk, at any magnitude)
+ */
+typedef struct hot_sensor {
+    sensor_id_t sensor_id;
+    uint32_t head;          /**< oldest reading */
+    uint32_t count;
+    uint32_t capacity;      /**< power of two */
+    uint32_t *ts;
+    sensor_value_t *value;
+} hot_sensor_t;
+
+typedef struct room_map_entry {
+    sensor_id_t sensor_id;
+    room_id_t room_id;
+} room_map_entry_t;
+
+/**
+ * a structure to keep track of an open database
+ */
+struct sensor_db {
+    char *data_name;
+    char *idx_name;
+    char *rooms_name;
+    char *rollup_names[ROLLUP_LEVELS];
+    char *segments_name;
+    bool readonly;
+    int data_fd;
+    int idx_fd;
+    int seg_fd;                     /**< -1 for a read-only handle on a database without a segment table */
+    int rollup_fds[ROLLUP_LEVELS];
+    FILE *rooms_file;               /**< NULL for read-only handles */
+    uint64_t data_size;             /**< bytes in the data file, the next block starts here */
+    uint32_t num_blocks;            /**< blocks written so far */
+    uint32_t segment;               /**< number of the open segment */
+    uint32_t segment_first_block;   /**< first block of the open segment, the blocks before it are rolled up */
+    uint32_t num_segments;          /**< complete entries in the segment table */
+    uint64_t rollup_records[ROLLUP_LEVELS]; /**< records in each rollup file */
+    uint64_t rooms_size;            /**< bytes of name.rooms that the segment table covers */
+    segment_sensor_t *segment_sensors;
+    int num_segment_sensors;
+    int cap_segment_sensors;
+    sensor_data_t *segment_rows;    /**< readings of the open segment, rolled up when it closes */
+    uint32_t num_segment_rows;
+    uint32_t cap_segment_rows;
+    hot_sensor_t *hot;              /**< hot tier, sorted on sensor id */
+    int num_hot;
+    int cap_hot;
+    sensor_ts_t hot_base;           /**< timestamps in the hot tier are relative to this one */
+    sensor_ts_t hot_newest;         /**< newest timestamp in the hot tier, LONG_MIN while it is empty */
+    sensor_ts_t hot_floor;          /**< the hot tier misses readings before this one (written before it started) */
+    bool hot_failed;                /**< out of memory, every query goes to disk */
+    room_map_entry_t *room_map;     /**< sorted on sensor id */
+    int room_map_size;
+    threadpool_t *query_pool;       /**< if not NULL, scans run on this pool */
+    sensor_db_durability_t durability;
+    int sync_interval_ms;           /**< SENSOR_DB_SYNC_PERIODIC: time between two syncs */
+    struct timespec last_sync;
+    bool unsynced;                  /**< SENSOR_DB_SYNC_PERIODIC: blocks were written after the last sync */
+    int direct_fd;                  /**< SENSOR_DB_SYNC_DIRECT: O_DIRECT descriptor of the data file, -1 otherwise */
+    char *direct_buffer;            /**< SENSOR_DB_SYNC_DIRECT: the data from direct_start on, the last page is partial */
+    uint64_t direct_start;          /**< page aligned offset of the first byte in direct_buffer */
+    sensor_db_sync_stats_t sync_stats;
+    pthread_mutex_t mutex;          /**< serializes writers, protects all of the above */
+};
+
+static char *make_name(const char *filename, const char *suffix) {
+    char *name = malloc(strlen(filename) + strlen(suffix) + 1);
+    if (name != NULL) {
+        strcpy(name, filename);
+        strcat(name, suffix);
+    }
+    return name;
+}
+
+static int write_all(int fd, const void *buf, size_t len) {
+    const char *p = buf;
+    while (len > 0) {
+        ssize_t written = write(fd, p, len);
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        p += written;
+        len -= written;
+    }
+    return 0;
+}
+
+static int write_all_at(int fd, const void *buf, size_t len, off_t offset) {
+    const char *p = buf;
+    while (len > 0) {
+        ssize_t written = pwrite(fd, p, len, offset);
+        if (written < 0 && errno == EINTR) continue;
+        if (written <= 0) return -1;
+        p += written;
+        len -= written;
+        offset += written;
+    }
+    return 0;
+}
+
+static int read_all_at(int fd, void *buf, size_t len, off_t offset) {
+    char *p = buf;
+    while (len > 0) {
+        ssize_t got = pread(fd, p, len, offset);
+        if (got < 0 && errno == EINTR) continue;
+        if (got <= 0) return -1;
+        p += got;
+        len -= got;
+        offset += got;
+    }
+    return 0;
+}
+
+static int read_entry(sensor_db_t *db, uint32_t block_nr, sensor_db_index_entry_t *entry) {
+    off_t offset = sizeof(IDX_MAGIC) + (off_t)block_nr * sizeof(sensor_db_index_entry_t);
+    return read_all_at(db->idx_fd, entry, sizeof(*entry), offset) == 0 ? SENSOR_DB_SUCCESS : SENSOR_DB_FAILURE;
+}
+
+static int compare_room_map(const void *x, const void *y) {
+    const room_map_entry_t *a = x, *b = y;
+    return (int)a->sensor_id - (int)b->sensor_id;
+}
+
+static sensor_db_t *db_alloc(const char *filename, bool readonly) {
+    sensor_db_t *db = calloc(1, sizeof(sensor_db_t));
+    if (db == NULL) return NULL;
+    db->readonly = readonly;
+    db->hot_newest = LONG_MIN;
+    db->hot_floor = LONG_MIN;
+    db->data_fd = -1;
+    db->idx_fd = -1;
+    db->direct_fd = -1;
+    db->seg_fd = -1;
+    db->data_name = make_name(filename, "");
+    db->idx_name = make_name(filename, IDX_SUFFIX);
+    db->rooms_name = make_name(filename, ROOMS_SUFFIX);
+    db->segments_name = make_name(filename, SEGMENTS_SUFFIX);
+    bool names_ok = db->data_name != NULL && db->idx_name != NULL && db->rooms_name != NULL && db->segments_name != NULL;
+    for (int level = 0; level < ROLLUP_LEVELS; level++) {
+        db->rollup_fds[level] = -1;
+        db->rollup_names[level] = make_name(filename, rollup_levels[level].suffix);
+        names_ok = names_ok && db->rollup_names[level] != NULL;
+    }
+    if (!names_ok || pthread_mutex_init(&db->mutex, NULL) != 0) {
+        free(db->data_name);
+        free(db->idx_name);
+        free(db->rooms_name);
+        free(db->segments_name);
+        for (int level = 0; level < ROLLUP_LEVELS; level++) free(db->rollup_names[level]);
+        free(db);
+        return NULL;
+    }
+    return db;
+}
+
+static void db_release(sensor_db_t *db) {
+    if (db->data_fd >= 0) close(db->data_fd);
+    if (db->idx_fd >= 0) close(db->idx_fd);
+    if (db->direct_fd >= 0) close(db->direct_fd);
+    if (db->seg_fd >= 0) close(db->seg_fd);
+    free(db->direct_buffer);
+    if (db->rooms_file != NULL) fclose(db->rooms_file);
+    for (int level = 0; level < ROLLUP_LEVELS; level++) {
+        if (db->rollup_fds[level] >= 0) close(db->rollup_fds[level]);
+        free(db->rollup_names[level]);
+    }
+    pthread_mutex_destroy(&db->mutex);
+    free(db->segment_sensors);
+    free(db->segment_rows);
+    for (int i = 0; i < db->num_hot; i++) {
+        free(db->hot[i].ts);
+        free(db->hot[i].value);
+    }
+    free(db->hot);
+    free(db->room_map);
+    free(db->data_name);
+    free(db->idx_name);
+    free(db->rooms_name);
+    free(db->segments_name);
+    free(db);
+}
+
+/**
+ * Checks the index header and derives the number of blocks from the size of the index
+ * A crash can leave a torn entry at the end of the index, data of a block whose entry never made it, or (without a
+ * sync, the kernel writes back in any order) entries of blocks whose data did not make it. Those are left out, and a
+ * handle that writes cuts both files back to the last complete block: its appends would land after the leftover bytes.
+ */
+static int load_index(sensor_db_t *db) {
+    char magic[sizeof(IDX_MAGIC)];
+    struct stat st;
+
+    if (read_all_at(db->idx_fd, magic, sizeof(magic), 0) != 0 || memcmp(magic, IDX_MAGIC, sizeof(magic)) != 0) {
+        fprintf(stderr, "%s is not a block index of this version.\n", db->idx_name);
+        return SENSOR_DB_FAILURE;
+    }
+    if (fstat(db->idx_fd, &st) != 0) return SENSOR_DB_FAILURE;
+    db->num_blocks = (st.st_size - sizeof(IDX_MAGIC)) / sizeof(sensor_db_index_entry_t);
+    if (fstat(db->data_fd, &st) != 0) return SENSOR_DB_FAILURE;
+
+    uint64_t data_end = 0;
+    for (; db->num_blocks > 0; db->num_blocks--) {
+        sensor_db_index_entry_t last;
+        if (read_entry(db, db->num_blocks - 1, &last) != SENSOR_DB_SUCCESS) return SENSOR_DB_FAILURE;
+        data_end = last.offset + last.length;
+        if (data_end <= (uint64_t)st.st_size) break;
+    }
+    if (db->num_blocks == 0) data_end = 0;
+    db->data_size = data_end;
+    if (db->readonly) return SENSOR_DB_SUCCESS;
+
+    if (ftruncate(db->idx_fd, sizeof(IDX_MAGIC) + (off_t)db->num_blocks * sizeof(sensor_db_index_entry_t)) != 0
+        || ftruncate(db->data_fd, data_end) != 0) {
+        perror("Unable to cut the database back to its last complete block");
+        return SENSOR_DB_FAILURE;
+    }
+    return SENSOR_DB_SUCCESS;
+}
+
+static int read_segment(sensor_db_t *db, uint32_t nr, sensor_db_segment_entry_t *entry) {
+    off_t offset = sizeof(SEG_MAGIC) + (off_t)nr * sizeof(sensor_db_segment_entry_t);
+    return read_all_at(db->seg_fd, entry, sizeof(*entry), offset) == 0 ? SENSOR_DB_SUCCESS : SENSOR_DB_FAILURE;
+}
+
+static uint64_t file_size(int fd) {
+    struct stat st;
+    return fd >= 0 && fstat(fd, &st) == 0 ? (uint64_t)st.st_size : 0;
+}
+
+/**
+ * Reads the segment table and sets the high-water mark: the open segment starts after the last block that is rolled
+ * up. A crash can cut the files at any point, so table entries whose rollup records, room lines or blocks did not all
+ * make it to disk are dropped. A handle that writes also cuts the files back to what the remaining entries cover.
+ */
+static int load_segments(sensor_db_t *db) {
+    char magic[sizeof(SEG_MAGIC)];
+    sensor_db_segment_entry_t last = {.segment = 0};
+    uint32_t n = 0;
+
+    if (db->seg_fd >= 0) {
+        if (read_all_at(db->seg_fd, magic, sizeof(magic), 0) != 0 || memcmp(magic, SEG_MAGIC, sizeof(magic)) != 0) {
+            fprintf(stderr, "%s is not a segment table of this version.\n", db->segments_name);
+            return SENSOR_DB_FAILURE;
+        }
+        n = (file_size(db->seg_fd) - sizeof(SEG_MAGIC)) / sizeof(sensor_db_segment_entry_t);
+    }
+    struct stat st;
+    uint64_t rooms_size = stat(db->rooms_name, &st) == 0 ? (uint64_t)st.st_size : 0;
+    for (; n > 0; n--) {
+        if (read_segment(db, n - 1, &last) != SENSOR_DB_SUCCESS) return SENSOR_DB_FAILURE;
+        bool complete = last.end_block <= db->num_blocks && last.rooms_end <= rooms_size;
+        for (int level = 0; level < ROLLUP_LEVELS; level++) {
+            uint64_t end = last.rollup_first[level] + last.rollup_count[level];
+            complete = complete && end * sizeof(sensor_db_rollup_record_t) <= file_size(db->rollup_fds[level]);
+        }
+        if (complete) break;
+    }
+
+    db->num_segments = n;
+    db->segment = n > 0 ? last.segment + 1 : 0;
+    db->segment_first_block = n > 0 ? last.end_block : 0;
+    // Without a segment table (an older read-only database) there are no rollups, but the room index is complete
+    db->rooms_size = n > 0 ? last.rooms_end : db->seg_fd < 0 ? rooms_size : 0;
+    for (int level = 0; level < ROLLUP_LEVELS; level++) {
+        db->rollup_records[level] = n > 0 ? last.rollup_first[level] + last.rollup_count[level] : 0;
+    }
+    if (db->readonly) return SENSOR_DB_SUCCESS;
+
+    bool cut = ftruncate(db->seg_fd, sizeof(SEG_MAGIC) + (off_t)n * sizeof(sensor_db_segment_entry_t)) == 0
+               && ftruncate(fileno(db->rooms_file), db->rooms_size) == 0;
+    for (int level = 0; level < ROLLUP_LEVELS; level++) {
+        cut = cut && ftruncate(db->rollup_fds[level], db->rollup_records[level] * sizeof(sensor_db_rollup_record_t)) == 0;
+    }
+    if (!cut) perror("Unable to cut the rollups back to the segment table");
+    return cut ? SENSOR_DB_SUCCESS : SENSOR_DB_FAILURE;
+}
+
+/**
+ * Keeps the readings that are already on disk out of the hot tier's range: its horizon never drops below the newest
+ * timestamp of the existing blocks
+ */
+static int hot_set_floor(sensor_db_t *db) {
+    for (uint32_t block_nr = 0; block_nr < db->num_blocks; block_nr++) {
+        sensor_db_index_entry_t entry;
+        if (read_entry(db, block_nr, &entry) != SENSOR_DB_SUCCESS) return SENSOR_DB_FAILURE;
+        if (entry.max_ts >= db->hot_floor) db->hot_floor = entry.max_ts + 1;
+    }
+    return SENSOR_DB_SUCCESS;
+}
+
+int sensor_db_load_room_map(sensor_db_t *db, FILE *fp_sensor_map) {
+    unsigned int room, sensor;
+    int capacity = 16, size = 0;
+
+    if (db == NULL || fp_sensor_map == NULL) return SENSOR_DB_FAILURE;
+
+    room_map_entry_t *map = malloc(capacity * sizeof(room_map_entry_t));
+    if (map == NULL) return SENSOR_DB_FAILURE;
+    while (fscanf(fp_sensor_map, "%u %u", &room, &sensor) == 2) {
+        if (size == capacity) {
+            capacity *= 2;
+            room_map_entry_t *grown = realloc(map, capacity * sizeof(room_map_entry_t));
+            if (grown == NULL) {
+                free(map);
+                return SENSOR_DB_FAILURE;
+            }
+            map = grown;
+        }
+        map[size++] = (room_map_entry_t){sensor, room};
+    }
+    qsort(map, size, sizeof(room_map_entry_t), compare_room_map);
+
+    pthread_mutex_lock(&db->mutex);
+    free(db->room_map);
+    db->room_map = map;
+    db->room_map_size = size;
+    pthread_mutex_unlock(&db->mutex);
+    return SENSOR_DB_SUCCESS;
+}
+
+/**
+ * Parses the next CSV row at '*cursor' (before 'end') into 'row' and moves the cursor to the next row
+ * \return false when there are no more (valid) rows
+ */
+static bool parse_row(char **cursor, char *end, sensor_data_t *row) {
+    char *p = *cursor, *next;
+    if (p >= end) return false;
+
+    row->id = (sensor_id_t)strtoul(p, &next, 10);
+    if (next == p || *next != ',') return false;
+    p = next + 1;
+    row->value = strtod(p, &next);
+    if (next == p || *next != ',') return false;
+    p = next + 1;
+    row->ts = (sensor_ts_t)strtoll(p, &next, 10);
+    if (next == p) return false;
+
+    while (next < end && *next != '\n') next++;
+    *cursor = next + 1;
+    return true;
+}
+
+/**
+ * Remembers that block 'block_in_segment' of the open segment holds a reading of 'sensor_id'
+ */
+static int segment_add(sensor_db_t *db, sensor_id_t sensor_id, uint32_t block_in_segment) {
+    for (int i = 0; i < db->num_segment_sensors; i++) {
+        if (db->segment_sensors[i].sensor_id == sensor_id) {
+            db->segment_sensors[i].blocks |= 1u << block_in_segment;
+            return SENSOR_DB_SUCCESS;
+        }
+    }
+    if (db->num_segment_sensors == db->cap_segment_sensors) {
+        int capacity = db->cap_segment_sensors ? 2 * db->cap_segment_sensors : 16;
+        segment_sensor_t *grown = realloc(db->segment_sensors, capacity * sizeof(segment_sensor_t));
+        if (grown == NULL) return SENSOR_DB_FAILURE;
+        db->segment_sensors = grown;
+        db->cap_segment_sensors = capacity;
+    }
+    db->segment_sensors[db->num_segment_sensors++] = (segment_sensor_t){sensor_id, 1u << block_in_segment};
+    return SENSOR_DB_SUCCESS;
+}
+
+/**
+ * Makes room for 'count' more rows in the open segment
+ */
+static int segment_reserve(sensor_db_t *db, uint32_t count) {
+    if (db->num_segment_rows + count <= db->cap_segment_rows) return SENSOR_DB_SUCCESS;
+    uint32_t capacity = db->cap_segment_rows ? db->cap_segment_rows : SENSOR_BLOCK_CAPACITY;
+    while (capacity < db->num_segment_rows + count) capacity *= 2;
+    sensor_data_t *grown = realloc(db->segment_rows, capacity * sizeof(sensor_data_t));
+    if (grown == NULL) return SENSOR_DB_FAILURE;
+    db->segment_rows = grown;
+    db->cap_segment_rows = capacity;
+    return SENSOR_DB_SUCCESS;
+}
+
+static int compare_row_ts(const void *x, const void *y) {
+    const sensor_data_t *a = x, *b = y;
+    if (a->ts != b->ts) return a->ts < b->ts ? -1 : 1;
+    return (int)a->id - (int)b->id;
+}
+
+static int compare_segment_row(const void *x, const void *y) {
+    const sensor_data_t *a = x, *b = y;
+    if (a->id != b->id) return (int)a->id - (int)b->id;
+    return (a->ts > b->ts) - (a->ts < b->ts);
+}
+
+static sensor_ts_t floor_div(sensor_ts_t a, sensor_ts_t b) {
+    return a / b - (a % b < 0);
+}
+
+/**
+ * Appends the per sensor count/sum/min/max of every bucket of the open segment to the rollup files and fills in where
+ * they went in 'segment'. A bucket that spans two segments gets a record in each of them, queries merge them.
+ * Expects the segment rows sorted on (sensor, ts).
+ */
+static int write_rollups(sensor_db_t *db, sensor_db_segment_entry_t *segment) {
+    sensor_db_rollup_record_t *records = calloc(db->num_segment_rows + 1, sizeof(sensor_db_rollup_record_t));
+    if (records == NULL) return SENSOR_DB_FAILURE;
+
+    int result = SENSOR_DB_SUCCESS;
+    for (int level = 0; level < ROLLUP_LEVELS && result == SENSOR_DB_SUCCESS; level++) {
+        sensor_ts_t length = rollup_levels[level].length;
+        uint32_t n = 0;
+        for (uint32_t i = 0; i < db->num_segment_rows;) {
+            sensor_data_t *first = &db->segment_rows[i];
+            sensor_db_rollup_record_t *record = &records[n++];
+            *record = (sensor_db_rollup_record_t){
+                    .bucket = floor_div(first->ts, length) * length, .min = first->value, .max = first->value,
+                    .sensor_id = first->id,
+            };
+            for (; i < db->num_segment_rows && db->segment_rows[i].id == first->id
+                   && db->segment_rows[i].ts < record->bucket + length; i++) {
+                sensor_value_t value = db->segment_rows[i].value;
+                record->count++;
+                record->sum += value;
+                if (value < record->min) record->min = value;
+                if (value > record->max) record->max = value;
+            }
+        }
+        // Written at the end of what the segment table covers, over the remains of an earlier failed write
+        off_t offset = (off_t)db->rollup_records[level] * sizeof(sensor_db_rollup_record_t);
+        if (write_all_at(db->rollup_fds[level], records, n * sizeof(sensor_db_rollup_record_t), offset) != 0) {
+            result = SENSOR_DB_FAILURE;
+            break;
+        }
+        segment->rollup_first[level] = db->rollup_records[level];
+        segment->rollup_count[level] = n;
+        db->rollup_records[level] += n;
+    }
+    free(records);
+    return result;
+}
+
+/**
+ * Writes the rollups and the room index of the open segment, then its entry in the segment table, and starts a new
+ * segment. The database must be locked.
+ */
+static int close_segment(sensor_db_t *db) {
+    if (db->num_blocks == db->segment_first_block) return SENSOR_DB_SUCCESS; // Nothing written in this segment
+
+    qsort(db->segment_rows, db->num_segment_rows, sizeof(sensor_data_t), compare_segment_row);
+    sensor_db_segment_entry_t segment = {
+            .segment = db->segment, .first_block = db->segment_first_block, .end_block = db->num_blocks,
+            .min_ts = LONG_MAX, .max_ts = LONG_MIN, .min_id = UINT16_MAX, .max_id = 0,
+    };
+    for (uint32_t i = 0; i < db->num_segment_rows; i++) {
+        if (db->segment_rows[i].ts < segment.min_ts) segment.min_ts = db->segment_rows[i].ts;
+        if (db->segment_rows[i].ts > segment.max_ts) segment.max_ts = db->segment_rows[i].ts;
+    }
+    if (db->num_segment_rows > 0) {
+        segment.min_id = db->segment_rows[0].id;
+        segment.max_id = db->segment_rows[db->num_segment_rows - 1].id;
+    }
+    int result = write_rollups(db, &segment);
+
+    for (int i = 0; i < db->num_segment_sensors; i++) {
+        segment_sensor_t *sensor = &db->segment_sensors[i];
+        room_map_entry_t key = {.sensor_id = sensor->sensor_id};
+        room_map_entry_t *entry = NULL;
+        if (db->room_map_size > 0) entry = bsearch(&key, db->room_map, db->room_map_size, sizeof(room_map_entry_t), compare_room_map);
+        if (entry == NULL) continue; // Not in any room, can't be found by a room query
+        int n = fprintf(db->rooms_file, "%" PRIu32 " %" PRIu32 " %" PRIu16 " %" PRIu16 " %" PRIx32 "\n",
+                        db->segment, db->segment_first_block, entry->room_id, sensor->sensor_id, sensor->blocks);
+        if (n < 0) result = SENSOR_DB_FAILURE;
+        else db->rooms_size += n;
+    }
+    if (fflush(db->rooms_file) != 0) result = SENSOR_DB_FAILURE;
+    segment.rooms_end = db->rooms_size;
+
+    // The table entry goes last: it makes the rollups and room lines of the segment count and moves the high-water mark
+    off_t offset = sizeof(SEG_MAGIC) + (off_t)db->num_segments * sizeof(sensor_db_segment_entry_t);
+    if (result == SENSOR_DB_SUCCESS && write_all_at(db->seg_fd, &segment, sizeof(segment), offset) == 0) {
+        db->num_segments++;
+    } else {
+        perror("Error occurred while closing a database segment");
+        result = SENSOR_DB_FAILURE;
+    }
+
+    db->num_segment_sensors = 0;
+    db->num_segment_rows = 0;
+    db->segment++;
+    db->segment_first_block = db->num_blocks;
+    return result;
+}
+
+static int compare_hot_sensor(const void *x, const void *y) {
+    const hot_sensor_t *a = x, *b = y;
+    return (int)a->sensor_id - (int)b->sensor_id;
+}
+
+/**
+ * Oldest timestamp that the hot tier holds all readings of, LONG_MAX if it is empty (or disabled)
+ * The database must be locked.
+ */
+static sensor_ts_t hot_horizon(const sensor_db_t *db) {
+    if (SENSOR_DB_HOT_SECONDS <= 0 || db->hot_failed || db->hot_newest == LONG_MIN) return LONG_MAX;
+    sensor_ts_t horizon = db->hot_newest - SENSOR_DB_HOT_SECONDS + 1;
+    if (horizon < db->hot_floor) horizon = db->hot_floor;
+    if (horizon < db->hot_base) horizon = db->hot_base;
+    return horizon;
+}
+
+/**
+ * Adds a stored reading to the hot tier and demotes the readings of its sensor that left the window, the database
+ * must be locked. Demoting only drops them, every reading is on disk already.
+ */
+static int hot_insert(sensor_db_t *db, const sensor_data_t *row) {
+    if (db->hot_newest == LONG_MIN) db->hot_base = row->ts;
+    if (row->ts < db->hot_base || row->ts - db->hot_base > UINT32_MAX) return SENSOR_DB_SUCCESS; // Served from disk
+    if (row->ts > db->hot_newest) db->hot_newest = row->ts;
+    sensor_ts_t horizon = hot_horizon(db);
+    if (row->ts < horizon) return SENSOR_DB_SUCCESS;   // Late reading, outside of the window already
+
+    hot_sensor_t key = {.sensor_id = row->id};
+    hot_sensor_t *sensor = NULL;
+    if (db->num_hot > 0) sensor = bsearch(&key, db->hot, db->num_hot, sizeof(hot_sensor_t), compare_hot_sensor);
+    if (sensor == NULL) {
+        if (db->num_hot == db->cap_hot) {
+            int capacity = db->cap_hot ? 2 * db->cap_hot : 16;
+            hot_sensor_t *grown = realloc(db->hot, capacity * sizeof(hot_sensor_t));
+            if (grown == NULL) return SENSOR_DB_FAILURE;
+            db->hot = grown;
+            db->cap_hot = capacity;
+        }
+        int i = db->num_hot++;
+        for (; i > 0 && db->hot[i - 1].sensor_id > row->id; i--) db->hot[i] = db->hot[i - 1];
+        db->hot[i] = (hot_sensor_t){.sensor_id = row->id};
+        sensor = &db->hot[i];
+    }
+
+    while (sensor->count > 0 && db->hot_base + (sensor_ts_t)sensor->ts[sensor->head] < horizon) {
+        sensor->head = (sensor->head + 1) & (sensor->capacity - 1);
+        sensor->count--;
+    }
+    if (sensor->count == sensor->capacity) {
+        uint32_t capacity = sensor->capacity ? 2 * sensor->capacity : 16;
+        uint32_t *ts = malloc(capacity * sizeof(uint32_t));
+        sensor_value_t *value = malloc(capacity * sizeof(sensor_value_t));
+        if (ts == NULL || value == NULL) {
+            free(ts);
+            free(value);
+            return SENSOR_DB_FAILURE;
+        }
+        for (uint32_t i = 0; i < sensor->count; i++) {
+            ts[i] = sensor->ts[(sensor->head + i) & (sensor->capacity - 1)];
+            value[i] = sensor->value[(sensor->head + i) & (sensor->capacity - 1)];
+        }
+        free(sensor->ts);
+        free(sensor->value);
+        sensor->ts = ts;
+        sensor->value = value;
+        sensor->head = 0;
+        sensor->capacity = capacity;
+    }
+    uint32_t tail = (sensor->head + sensor->count) & (sensor->capacity - 1);
+    sensor->ts[tail] = (uint32_t)(row->ts - db->hot_base);
+    sensor->value[tail] = row->value;
+    sensor->count++;
+    return SENSOR_DB_SUCCESS;
+}
+
+/**
+ * Copies the readings of the hot tier that match 'pred' and one of 'sensors' (all if num_sensors is 0) into a new
+ * array, sorted on timestamp
+ * \param horizon filled in with the hot horizon: the caller answers the part of the query before it from disk
+ */
+static int hot_collect(sensor_db_t *db, const sensor_db_predicate_t *pred, const sensor_id_t *sensors, int num_sensors,
+                       sensor_data_t **rows, uint32_t *num_rows, sensor_ts_t *horizon, sensor_db_query_stats_t *stats) {
+    uint32_t n = 0, capacity = 0;
+    sensor_data_t *r = NULL;
+
+    pthread_mutex_lock(&db->mutex);
+    stats->blocks_total = db->num_blocks;
+    *horizon = hot_horizon(db);
+    sensor_ts_t from = pred->from > *horizon ? pred->from : *horizon;
+    for (int i = 0; i < db->num_hot && from <= pred->to; i++) {
+        hot_sensor_t *sensor = &db->hot[i];
+        if (sensor->sensor_id < pred->min_id || sensor->sensor_id > pred->max_id) continue;
+        if (num_sensors > 0) {
+            int s;
+            for (s = 0; s < num_sensors && sensors[s] != sensor->sensor_id; s++);
+            if (s == num_sensors) continue;
+        }
+        for (uint32_t j = 0; j < sensor->count; j++) {
+            uint32_t slot = (sensor->head + j) & (sensor->capacity - 1);
+            sensor_data_t row = {sensor->sensor_id, sensor->value[slot], db->hot_base + (sensor_ts_t)sensor->ts[slot]};
+            if (row.ts < from || row.ts > pred->to || row.value < pred->min_value || row.value > pred->max_value) continue;
+            if (n == capacity) {
+                capacity = capacity ? 2 * capacity : SENSOR_BLOCK_CAPACITY;
+                sensor_data_t *grown = realloc(r, capacity * sizeof(sensor_data_t));
+                if (grown == NULL) {
+                    pthread_mutex_unlock(&db->mutex);
+                    free(r);
+                    return SENSOR_DB_FAILURE;
+                }
+                r = grown;
+            }
+            r[n++] = row;
+        }
+    }
+    pthread_mutex_unlock(&db->mutex);
+
+    if (n > 1) qsort(r, n, sizeof(sensor_data_t), compare_row_ts);
+    stats->hot_rows += n;
+    *rows = r;
+    *num_rows = n;
+    return SENSOR_DB_SUCCESS;
+}
+
+static uint64_t elapsed_ns(const struct timespec *start, const struct timespec *end) {
+    return (uint64_t)(end->tv_sec - start->tv_sec) * 1000000000u + end->tv_nsec - start->tv_nsec;
+}
+
+/**
+ * fdatasync of one file, the time it took is added to 'ns'
+ */
+static int timed_sync(int fd, uint64_t *ns) {
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    int result = fdatasync(fd);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    *ns += elapsed_ns(&start, &end);
+    if (result != 0) perror("Error occurred while syncing the database");
+    return result == 0 ? SENSOR_DB_SUCCESS : SENSOR_DB_FAILURE;
+}
+
+/**
+ * Adds one sync (of the data file and the index) to the statistics, the database must be locked
+ */
+static void count_sync(sensor_db_t *db, uint64_t ns) {
+    db->sync_stats.syncs++;
+    db->sync_stats.total_ns += ns;
+    if (ns > db->sync_stats.max_ns) db->sync_stats.max_ns = ns;
+    clock_gettime(CLOCK_MONOTONIC, &db->last_sync);
+    db->unsynced = false;
+}
+
+/**
+ * fdatasync of the data file and the index, the database must be locked
+ */
+static int sync_files(sensor_db_t *db) {
+    uint64_t ns = 0;
+    int result = timed_sync(db->data_fd, &ns);
+    if (result == SENSOR_DB_SUCCESS) result = timed_sync(db->idx_fd, &ns);
+    count_sync(db, ns);
+    return result;
+}
+
+/**
+ * SENSOR_DB_SYNC_PERIODIC: syncs the blocks written after the last sync once the sync interval passed, the database must
+ * be locked
+ */
+static int sync_if_due(sensor_db_t *db) {
+    struct timespec now;
+    if (db->durability != SENSOR_DB_SYNC_PERIODIC || !db->unsynced) return SENSOR_DB_SUCCESS;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if (elapsed_ns(&db->last_sync, &now) < (uint64_t)db->sync_interval_ms * 1000000u) return SENSOR_DB_SUCCESS;
+    return sync_files(db);
+}
+
+/**
+ * Appends 'length' bytes of rows through the O_DIRECT descriptor: the buffered partial page and the new rows are
+ * written as whole pages, the zero padding of the last page is cut off again. The database must be locked.
+ */
+static int write_direct(sensor_db_t *db, const char *rows, size_t length) {
+    size_t used = db->data_size - db->direct_start;
+    memcpy(db->direct_buffer + used, rows, length);
+    used += length;
+    size_t padded = (used + DIRECT_ALIGN - 1) / DIRECT_ALIGN * DIRECT_ALIGN;
+    memset(db->direct_buffer + used, 0, padded - used);
+
+    for (size_t done = 0; done < padded;) {
+        ssize_t written = pwrite(db->direct_fd, db->direct_buffer + done, padded - done, db->direct_start + done);
+        if (written < 0 && errno == EINTR) continue;
+        if (written <= 0) return -1;
+        done += written;
+    }
+    if (padded != used && ftruncate(db->direct_fd, db->direct_start + used) != 0) return -1;
+
+    // Keep the partial last page, the next block continues it
+    size_t full = used / DIRECT_ALIGN * DIRECT_ALIGN;
+    memmove(db->direct_buffer, db->direct_buffer + full, used - full);
+    db->direct_start += full;
+    return 0;
+}
+
+int sensor_db_set_durability(sensor_db_t *db, sensor_db_durability_t mode, int sync_interval_ms) {
+    if (db == NULL || db->readonly) return SENSOR_DB_FAILURE;
+    pthread_mutex_lock(&db->mutex);
+
+    if (mode == SENSOR_DB_SYNC_DIRECT && db->direct_fd < 0) {
+        void *buffer;
+        if (posix_memalign(&buffer, DIRECT_ALIGN, DIRECT_BUFFER_SIZE) != 0) {
+            pthread_mutex_unlock(&db->mutex);
+            return SENSOR_DB_FAILURE;
+        }
+        // Start at the page that holds the end of the data, its first part is rewritten with the next block
+        uint64_t start = db->data_size / DIRECT_ALIGN * DIRECT_ALIGN;
+        int fd = open(db->data_name, O_WRONLY | O_DIRECT);
+        if (fd < 0 || read_all_at(db->data_fd, buffer, db->data_size - start, start) != 0) {
+            if (fd < 0) perror("Unable to open the database for O_DIRECT writes");
+            if (fd >= 0) close(fd);
+            free(buffer);
+            pthread_mutex_unlock(&db->mutex);
+            return SENSOR_DB_FAILURE;
+        }
+        db->direct_fd = fd;
+        db->direct_buffer = buffer;
+        db->direct_start = start;
+    } else if (mode != SENSOR_DB_SYNC_DIRECT && db->direct_fd >= 0) {
+        close(db->direct_fd);
+        free(db->direct_buffer);
+        db->direct_fd = -1;
+        db->direct_buffer = NULL;
+        lseek(db->data_fd, db->data_size, SEEK_SET);    // write() continues after the data written with O_DIRECT
+    }
+    db->durability = mode;
+    db->sync_interval_ms = sync_interval_ms;
+    clock_gettime(CLOCK_MONOTONIC, &db->last_sync);
+    pthread_mutex_unlock(&db->mutex);
+    return SENSOR_DB_SUCCESS;
+}
+
+void sensor_db_get_sync_stats(sensor_db_t *db, sensor_db_sync_stats_t *stats) {
+    pthread_mutex_lock(&db->mutex);
+    *stats = db->sync_stats;
+    pthread_mutex_unlock(&db->mutex);
+}
+
+/**
+ * Passes rows collected from the hot tier to 'fn'
+ * \return 1 if 'fn' asked to stop, 0 otherwise
+ */
+static int emit_rows(const sensor_data_t *rows, uint32_t num_rows, sensor_db_row_fn_t fn, void *arg,
+                     sensor_db_query_stats_t *stats) {
+    for (uint32_t i = 0; i < num_rows; i++) {
+        stats->rows_matched++;
+        if (fn(arg, &rows[i]) != 0) return 1;
+    }
+    return 0;
+}
+
+int sensor_db_sync_due(sensor_db_t *db) {
+    if (db == NULL || db->readonly) return SENSOR_DB_FAILURE;
+    pthread_mutex_lock(&db->mutex);
+    int result = sync_if_due(db);
+    pthread_mutex_unlock(&db->mutex);
+    return result;
+}
+
+int sensor_db_write_block(sensor_db_t *db, const sensor_block_t *block) {
+    char rows[SENSOR_BLOCK_CAPACITY * MAX_ROW_LENGTH];
+    sensor_data_t stored[SENSOR_BLOCK_CAPACITY];
+    size_t length = 0;
+
+    if (db == NULL || block == NULL || db->readonly) return SENSOR_DB_FAILURE;
+    if (block->count == 0) return SENSOR_DB_SUCCESS;
+
+    // Format the rows before taking the lock, a row that does not fit fails the whole block instead of cutting it
+    for (uint32_t i = 0; i < block->count; i++) {
+        int n = snprintf(rows + length, sizeof(rows) - length, "%" PRIu16 ",%.2f,%ld\n",
+                         block->id[i], block->value[i], (long)block->ts[i]);
+        if (n < 0 || (size_t)n >= sizeof(rows) - length) {
+            fprintf(stderr, "Reading of sensor %" PRIu16 " does not fit in a database row.\n", block->id[i]);
+            return SENSOR_DB_FAILURE;
+        }
+        length += n;
+    }
+    uint32_t crc = crc32c(0, rows, length);
+
+    // Roll up the values as they are stored, so rollups and raw rows agree to the last digit. The zone map is seeded
+    // from the first row, parsed on its own: the block is not empty (checked above).
+    char *cursor = rows;
+    if (!parse_row(&cursor, rows + length, &stored[0])) return SENSOR_DB_FAILURE;
+    sensor_db_index_entry_t zone = {
+            .min_ts = stored[0].ts, .max_ts = stored[0].ts, .min_value = stored[0].value, .max_value = stored[0].value,
+            .min_id = stored[0].id, .max_id = stored[0].id,
+    };
+    for (uint32_t i = 1; i < block->count; i++) {
+        if (!parse_row(&cursor, rows + length, &stored[i])) return SENSOR_DB_FAILURE;
+        if (stored[i].ts < zone.min_ts) zone.min_ts = stored[i].ts;
+        if (stored[i].ts > zone.max_ts) zone.max_ts = stored[i].ts;
+        if (stored[i].value < zone.min_value) zone.min_value = stored[i].value;
+        if (stored[i].value > zone.max_value) zone.max_value = stored[i].value;
+        if (stored[i].id < zone.min_id) zone.min_id = stored[i].id;
+        if (stored[i].id > zone.max_id) zone.max_id = stored[i].id;
+    }
+
+    pthread_mutex_lock(&db->mutex);
+
+    if (segment_reserve(db, block->count) != SENSOR_DB_SUCCESS) {
+        pthread_mutex_unlock(&db->mutex);
+        return SENSOR_DB_FAILURE;
+    }
+
+    sensor_db_index_entry_t entry = {
+            .offset = db->data_size, .length = (uint32_t)length, .count = block->count, .segment = db->segment,
+            .min_ts = zone.min_ts, .max_ts = zone.max_ts, .min_value = zone.min_value, .max_value = zone.max_value,
+            .min_id = zone.min_id, .max_id = zone.max_id, .crc = crc,
+    };
+    // Every block is one group commit. When it is synced, the data goes to disk before the index entry pointing at it.
+    bool commit_sync = db->durability == SENSOR_DB_SYNC_GROUP || db->durability == SENSOR_DB_SYNC_DIRECT;
+    uint64_t sync_ns = 0;
+    int written = db->direct_fd >= 0 ? write_direct(db, rows, length) : write_all(db->data_fd, rows, length);
+    if (written != 0 || (commit_sync && timed_sync(db->data_fd, &sync_ns) != SENSOR_DB_SUCCESS)) {
+        perror("Error occurred while writing to the database");
+        pthread_mutex_unlock(&db->mutex);
+        return SENSOR_DB_FAILURE;
+    }
+    db->data_size += length;
+    if (write_all(db->idx_fd, &entry, sizeof(entry)) != 0
+        || (commit_sync && timed_sync(db->idx_fd, &sync_ns) != SENSOR_DB_SUCCESS)) {
+        perror("Error occurred while writing to the block index");
+        pthread_mutex_unlock(&db->mutex);
+        return SENSOR_DB_FAILURE;
+    }
+
+    int result = SENSOR_DB_SUCCESS;
+    if (commit_sync) {
+        count_sync(db, sync_ns);
+    } else if (db->durability == SENSOR_DB_SYNC_PERIODIC) {
+        db->unsynced = true;
+        result = sync_if_due(db);
+    }
+
+    uint32_t block_in_segment = db->num_blocks - db->segment_first_block;
+    db->num_blocks++;
+    for (uint32_t i = 0; i < block->count; i++) {
+        segment_add(db, block->id[i], block_in_segment);
+    }
+    memcpy(db->segment_rows + db->num_segment_rows, stored, block->count * sizeof(sensor_data_t));
+    db->num_segment_rows += block->count;
+    for (uint32_t i = 0; i < block->count && SENSOR_DB_HOT_SECONDS > 0 && !db->hot_failed; i++) {
+        if (hot_insert(db, &stored[i]) != SENSOR_DB_SUCCESS) {
+            fprintf(stderr, "Out of memory for the hot tier, all queries are served from disk.\n");
+            db->hot_failed = true;
+        }
+    }
+    if (db->num_blocks - db->segment_first_block == SENSOR_DB_SEGMENT_BLOCKS && close_segment(db) != SENSOR_DB_SUCCESS) {
+        result = SENSOR_DB_FAILURE;
+    }
+
+    pthread_mutex_unlock(&db->mutex);
+    return result;
+}
+
+/**
+ * Checks the zone map of a block against a predicate and the sensors that are looked for (all if num_sensors is 0)
+ * \return false if no row of the block can match
+ */
+static bool zone_matches(const sensor_db_index_entry_t *entry, const sensor_db_predicate_t *pred,
+                         const sensor_id_t *sensors, int num_sensors) {
+    if (entry->max_ts < pred->from || entry->min_ts > pred->to) return false;
+    if (entry->max_value < pred->min_value || entry->min_value > pred->max_value) return false;
+    if (entry->max_id < pred->min_id || entry->min_id > pred->max_id) return false;
+    if (num_sensors == 0) return true;
+    for (int s = 0; s < num_sensors; s++) {
+        if (sensors[s] >= entry->min_id && sensors[s] <= entry->max_id) return true;
+    }
+    return false;
+}
+
+/**
+ * Reads the block of 'entry' from disk and passes the rows that match 'pred' and one of 'sensors' (all if num_sensors
+ * is 0) to 'fn'
+ * A block that doesn't match its checksum (a torn write, a bad sector) is reported and skipped.
+ * \return 1 if 'fn' asked to stop, 0 to continue, SENSOR_DB_FAILURE on a read error
+ */
+static int scan_block(sensor_db_t *db, const sensor_db_index_entry_t *entry, const sensor_id_t *sensors, int num_sensors,
+                      const sensor_db_predicate_t *pred, sensor_db_row_fn_t fn, void *arg, sensor_db_query_stats_t *stats) {
+    char *data = malloc(entry->length + 1);
+    if (data == NULL) return SENSOR_DB_FAILURE;
+    if (read_all_at(db->data_fd, data, entry->length, entry->offset) != 0) {
+        free(data);
+        return SENSOR_DB_FAILURE;
+    }
+    data[entry->length] = '\0';
+    stats->blocks_read++;
+    if (crc32c(0, data, entry->length) != entry->crc) {
+        fprintf(stderr, "Checksum mismatch in the block at offset %" PRIu64 " of %s, skipping it.\n",
+                entry->offset, db->data_name);
+        stats->crc_errors++;
+        free(data);
+        return 0;
+    }
+
+    char *cursor = data, *end = data + entry->length;
+    sensor_data_t row;
+    int stop = 0;
+    while (!stop && parse_row(&cursor, end, &row)) {
+        stats->rows_scanned++;
+        if (row.ts < pred->from || row.ts > pred->to) continue;
+        if (row.value < pred->min_value || row.value > pred->max_value) continue;
+        if (row.id < pred->min_id || row.id > pred->max_id) continue;
+        if (num_sensors > 0) {
+            int s;
+            for (s = 0; s < num_sensors && sensors[s] != row.id; s++);
+            if (s == num_sensors) continue;
+        }
+        stats->rows_matched++;
+        stop = fn(arg, &row) != 0;
+    }
+    free(data);
+    return stop;
+}
+
+typedef struct block_sensor {
+    uint32_t block;
+    sensor_id_t sensor_id;
+} block_sensor_t;
+
+static int compare_block_sensor(const void *x, const void *y) {
+    const block_sensor_t *a = x, *b = y;
+    if (a->block != b->block) return a->block < b->block ? -1 : 1;
+    return (int)a->sensor_id - (int)b->sensor_id;
+}
+
+void sensor_db_set_query_pool(sensor_db_t *db, threadpool_t *pool) {
+    db->query_pool = pool;
+}
+
+void sensor_db_predicate_all(sensor_db_predicate_t *pred) {
+    pred->from = LONG_MIN;
+    pred->to = LONG_MAX;
+    pred->min_value = -HUGE_VAL;      // infinite readings are rows too
+    pred->max_value = HUGE_VAL;
+    pred->min_id = 0;
+    pred->max_id = UINT16_MAX;
+}
+
+/**
+ * part of the range of an aggregate query and the rollup level that answers it, ROLLUP_LEVELS means raw rows
+ */
+typedef struct aggregate_part {
+    int level;
+    sensor_ts_t from;
+    sensor_ts_t to;
+} aggregate_part_t;
+
+typedef struct aggregate_plan {
+    aggregate_part_t parts[2 * ROLLUP_LEVELS + 2];
+    int num_parts;
+} aggregate_plan_t;
+
+/**
+ * Covers [from, to] with the whole buckets of 'level' and hands the uncovered edges to the next finer level
+ */
+static void plan_aggregate(aggregate_plan_t *plan, int level, sensor_ts_t from, sensor_ts_t to) {
+    if (from > to) return;
+    if (level == ROLLUP_LEVELS) {
+        plan->parts[plan->num_parts++] = (aggregate_part_t){level, from, to};
+        return;
+    }
+    sensor_ts_t length = rollup_levels[level].length;
+    sensor_ts_t first = (floor_div(from - 1, length) + 1) * length;   // first bucket starting at or after 'from'
+    sensor_ts_t last = floor_div(to - length + 1, length) * length;     // last bucket ending at or before 'to'
+    if (first > last) {
+        plan_aggregate(plan, level + 1, from, to);
+        return;
+    }
+    plan->parts[plan->num_parts++] = (aggregate_part_t){level, first, last + length - 1};
+    plan_aggregate(plan, level + 1, from, first - 1);
+    if (last + length - 1 < to) plan_aggregate(plan, level + 1, last + length, to);
+}
+
+static void aggregate_add(sensor_db_aggregate_t *result, uint32_t count, double sum, sensor_value_t min, sensor_value_t max) {
+    if (count == 0) return;
+    if (result->count == 0 || min < result->min) result->min = min;
+    if (result->count == 0 || max > result->max) result->max = max;
+    result->count += count;
+    result->sum += sum;
+}
+
+typedef struct aggregate_scan {
+    const aggregate_plan_t *plan;
+    bool unrolled;                  /**< the block is not rolled up yet, all parts of the plan need its rows */
+    sensor_db_aggregate_t *result;
+} aggregate_scan_t;
+
+static int aggregate_row(void *arg, const sensor_data_t *row) {
+    aggregate_scan_t *scan = arg;
+    for (int i = 0; i < scan->plan->num_parts; i++) {
+        const aggregate_part_t *part = &scan->plan->parts[i];
+        if ((scan->unrolled || part->level == ROLLUP_LEVELS) && row->ts >= part->from && row->ts <= part->to) {
+            aggregate_add(scan->result, 1, row->value, row->value, row->value);
+            break;
+        }
+    }
+    return 0;
+}
+
+/**
+ * completion latch of the ranges of one query: every range counts it down when it finishes and the query waits for
+ * zero, so it never waits for the other work on the query pool
+ */
+typedef struct query_latch {
+    pthread_mutex_t mutex;
+    pthread_cond_t done;
+    int remaining;
+} query_latch_t;
+
+/**
+ * blocks [first_block, end_block) of a predicate or room scan or of the raw part of an aggregate, the unit of work
+ * that runs on the query pool
+ */
+typedef struct query_range {
+    sensor_db_t *db;
+    uint32_t first_block;
+    uint32_t end_block;
+    const sensor_db_predicate_t *pred;  /**< predicate and room scan: the conditions on the rows */
+    sensor_db_row_fn_t fn;              /**< predicate and room scan: called for every matching row */
+    void *arg;
+    const block_sensor_t *pairs;        /**< room scan: the (block, sensor) pairs of the range, sorted on block */
+    int num_pairs;
+    int max_sensors;                    /**< room scan: most sensors of the room that one block can hold */
+    query_latch_t *latch;               /**< NULL when the range runs in the calling thread */
+    const aggregate_plan_t *plan;       /**< aggregate: the plan, NULL for a predicate scan */
+    sensor_id_t sensor_id;
+    sensor_ts_t from;
+    sensor_ts_t to;
+    uint32_t rolled_blocks;             /**< aggregate: blocks before this one are in the rollups */
+    sensor_data_t *rows;                /**< parallel predicate scan: the matching rows, passed on after the merge */
+    uint32_t num_rows;
+    uint32_t cap_rows;
+    sensor_db_aggregate_t partial;      /**< aggregate: the partial result of the range */
+    sensor_db_query_stats_t stats;
+    int status;
+} query_range_t;
+
+static void add_stats(sensor_db_query_stats_t *total, const sensor_db_query_stats_t *part) {
+    total->blocks_read += part->blocks_read;
+    total->rows_scanned += part->rows_scanned;
+    total->rows_matched += part->rows_matched;
+    total->rollup_rows += part->rollup_rows;
+    total->crc_errors += part->crc_errors;
+}
+
+static int query_blocks(query_range_t *range) {
+    for (uint32_t block_nr = range->first_block; block_nr < range->end_block; block_nr++) {
+        sensor_db_index_entry_t entry;
+        if (read_entry(range->db, block_nr, &entry) != SENSOR_DB_SUCCESS) return SENSOR_DB_FAILURE;
+        if (!zone_matches(&entry, range->pred, NULL, 0)) continue;
+        int status = scan_block(range->db, &entry, NULL, 0, range->pred, range->fn, range->arg, &range->stats);
+        if (status != 0) return status;
+    }
+    return SENSOR_DB_SUCCESS;
+}
+
+/**
+ * Room scan: reads every block of the pairs of the range once, with all sensors of the room it holds
+ */
+static int room_blocks(query_range_t *range) {
+    sensor_id_t *sensors = malloc(range->max_sensors * sizeof(sensor_id_t));
+    int status = sensors == NULL ? SENSOR_DB_FAILURE : SENSOR_DB_SUCCESS;
+    for (int i = 0; i < range->num_pairs && status == SENSOR_DB_SUCCESS;) {
+        int num_sensors = 0;
+        uint32_t block_nr = range->pairs[i].block;
+        for (; i < range->num_pairs && range->pairs[i].block == block_nr; i++) {
+            if (num_sensors < range->max_sensors) sensors[num_sensors++] = range->pairs[i].sensor_id;
+        }
+        sensor_db_index_entry_t entry;
+        if (read_entry(range->db, block_nr, &entry) != SENSOR_DB_SUCCESS) {
+            status = SENSOR_DB_FAILURE;
+            break;
+        }
+        if (!zone_matches(&entry, range->pred, sensors, num_sensors)) continue;
+        status = scan_block(range->db, &entry, sensors, num_sensors, range->pred, range->fn, range->arg, &range->stats);
+    }
+    free(sensors);
+    return status;
+}
+
+static int aggregate_blocks(query_range_t *range) {
+    const aggregate_plan_t *plan = range->plan;
+    aggregate_scan_t scan = {plan, false, &range->partial};
+    sensor_db_predicate_t pred;
+    sensor_db_predicate_all(&pred);
+    for (uint32_t block_nr = range->first_block; block_nr < range->end_block; block_nr++) {
+        sensor_db_index_entry_t entry;
+        if (read_entry(range->db, block_nr, &entry) != SENSOR_DB_SUCCESS) return SENSOR_DB_FAILURE;
+
+        // Skip the block unless its zone map overlaps a part of the range that needs raw rows
+        scan.unrolled = block_nr >= range->rolled_blocks;
+        bool needed = false;
+        for (int i = 0; i < plan->num_parts && !needed; i++) {
+            if (!scan.unrolled && plan->parts[i].level != ROLLUP_LEVELS) continue;
+            pred.from = plan->parts[i].from;
+            pred.to = plan->parts[i].to;
+            needed = zone_matches(&entry, &pred, &range->sensor_id, 1);
+        }
+        if (!needed) continue;
+        pred.from = range->from;
+        pred.to = range->to;
+        if (scan_block(range->db, &entry, &range->sensor_id, 1, &pred, aggregate_row, &scan, &range->stats) == SENSOR_DB_FAILURE) {
+            return SENSOR_DB_FAILURE;
+        }
+    }
+    return SENSOR_DB_SUCCESS;
+}
+
+static void query_range_task(void *arg) {
+    query_range_t *range = arg;
+    int status = range->plan != NULL ? aggregate_blocks(range) : range->pairs != NULL ? room_blocks(range) : query_blocks(range);
+    if (range->status == SENSOR_DB_SUCCESS) range->status = status;  // collect_row may have failed already
+
+    query_latch_t *latch = range->latch;
+    if (latch != NULL) {
+        pthread_mutex_lock(&latch->mutex);
+        if (--latch->remaining == 0) pthread_cond_signal(&latch->done);
+        pthread_mutex_unlock(&latch->mutex);
+    }
+}
+
+/**
+ * Keeps a matching row of a parallel predicate scan until all ranges are done
+ */
+static int collect_row(void *arg, const sensor_data_t *row) {
+    query_range_t *range = arg;
+    if (range->num_rows == range->cap_rows) {
+        uint32_t capacity = range->cap_rows ? 2 * range->cap_rows : SENSOR_BLOCK_CAPACITY;
+        sensor_data_t *grown = realloc(range->rows, capacity * sizeof(sensor_data_t));
+        if (grown == NULL) {
+            range->status = SENSOR_DB_FAILURE;
+            return 1;
+        }
+        range->rows = grown;
+        range->cap_rows = capacity;
+    }
+    range->rows[range->num_rows++] = *row;
+    return 0;
+}
+
+/**
+ * Splits blocks [first_block, end_block) into ranges of SENSOR_DB_SEGMENT_BLOCKS blocks and runs them on the query
+ * pool, or runs them as one range in the calling thread if there is no pool (or the caller is one of its tasks).
+ * Without a pool a scan calls 'fn' directly, with a pool the rows of every range are collected for the merge.
+ * The query waits for its own ranges only, on a latch.
+ * \param query the fields that all ranges share
+ * \param ranges filled in with the finished ranges, to be freed by the caller
+ */
+static int run_ranges(const query_range_t *query, uint32_t first_block, uint32_t end_block,
+                      query_range_t **ranges, int *num_ranges) {
+    threadpool_t *pool = query->db->query_pool;
+    if (threadpool_in_worker(pool)) pool = NULL;    // All workers could be waiting for ranges that none of them runs
+    int n = 1;
+    if (pool != NULL && end_block > first_block) {
+        n = (int)((end_block - first_block + SENSOR_DB_SEGMENT_BLOCKS - 1) / SENSOR_DB_SEGMENT_BLOCKS);
+    }
+    query_range_t *r = calloc(n, sizeof(query_range_t));
+    if (r == NULL) return SENSOR_DB_FAILURE;
+
+    query_latch_t latch = {.remaining = n};
+    int pair = 0;
+    for (int i = 0; i < n; i++) {
+        r[i] = *query;
+        r[i].first_block = first_block + (uint32_t)i * SENSOR_DB_SEGMENT_BLOCKS;
+        r[i].end_block = pool != NULL && r[i].first_block + SENSOR_DB_SEGMENT_BLOCKS < end_block
+                         ? r[i].first_block + SENSOR_DB_SEGMENT_BLOCKS : end_block;
+        if (query->pairs != NULL) {
+            r[i].pairs = query->pairs + pair;
+            for (r[i].num_pairs = 0; pair < query->num_pairs && query->pairs[pair].block < r[i].end_block; pair++) {
+                r[i].num_pairs++;
+            }
+        }
+        if (pool != NULL && query->plan == NULL) {
+            r[i].fn = collect_row;
+            r[i].arg = &r[i];
+        }
+    }
+    if (pool == NULL) {
+        query_range_task(&r[0]);
+    } else if (pthread_mutex_init(&latch.mutex, NULL) != 0 || pthread_cond_init(&latch.done, NULL) != 0) {
+        for (int i = 0; i < n; i++) query_range_task(&r[i]);
+    } else {
+        for (int i = 0; i < n; i++) {
+            r[i].latch = &latch;
+            if (threadpool_submit(pool, query_range_task, &r[i]) != THREADPOOL_SUCCESS) query_range_task(&r[i]);
+        }
+        pthread_mutex_lock(&latch.mutex);
+        while (latch.remaining > 0) pthread_cond_wait(&latch.done, &latch.mutex);
+        pthread_mutex_unlock(&latch.mutex);
+        pthread_cond_destroy(&latch.done);
+        pthread_mutex_destroy(&latch.mutex);
+    }
+    *ranges = r;
+    *num_ranges = n;
+    return SENSOR_DB_SUCCESS;
+}
+
+static const sensor_data_t *head(const query_range_t *ranges, const int *heap, const uint32_t *pos, int i) {
+    return &ranges[heap[i]].rows[pos[heap[i]]];
+}
+
+/**
+ * k-way merge of the sorted rows of all ranges by timestamp, with a binary min-heap of range numbers
+ * \return 1 if 'fn' asked to stop, 0 otherwise
+ */
+static int merge_ranges(query_range_t *ranges, int num_ranges, sensor_db_row_fn_t fn, void *arg) {
+    if (num_ranges <= 0) return 0;     // Nothing to merge, and the sizes below stay positive
+    int *heap = malloc(num_ranges * sizeof(int));
+    uint32_t *pos = calloc(num_ranges, sizeof(uint32_t));
+    int size = 0, stop = 0;
+    if (heap == NULL || pos == NULL) {
+        free(heap);
+        free(pos);
+        return SENSOR_DB_FAILURE;
+    }
+    for (int i = 0; i < num_ranges; i++) {
+        if (ranges[i].num_rows == 0) continue;
+        // sift up
+        int child = size++;
+        heap[child] = i;
+        while (child > 0 && compare_row_ts(head(ranges, heap, pos, child), head(ranges, heap, pos, (child - 1) / 2)) < 0) {
+            int parent = (child - 1) / 2, tmp = heap[parent];
+            heap[parent] = heap[child];
+            heap[child] = tmp;
+            child = parent;
+        }
+    }
+    while (size > 0 && !stop) {
+        stop = fn(arg, head(ranges, heap, pos, 0)) != 0;
+        if (++pos[heap[0]] == ranges[heap[0]].num_rows) heap[0] = heap[--size];
+        // sift down
+        for (int parent = 0;;) {
+            int smallest = parent, left = 2 * parent + 1, right = left + 1;
+            if (left < size && compare_row_ts(head(ranges, heap, pos, left), head(ranges, heap, pos, smallest)) < 0) smallest = left;
+            if (right < size && compare_row_ts(head(ranges, heap, pos, right), head(ranges, heap, pos, smallest)) < 0) smallest = right;
+            if (smallest == parent) break;
+            int tmp = heap[parent];
+            heap[parent] = heap[smallest];
+            heap[smallest] = tmp;
+            parent = smallest;
+        }
+    }
+    free(heap);
+    free(pos);
+    return stop;
+}
+
+/**
+ * Collects the status and statistics of the finished ranges of a scan, passes their collected rows to 'fn' in
+ * timestamp order and frees the ranges
+ * \param stop set to 1 if 'fn' asked to stop
+ */
+static int finish_ranges(query_range_t *ranges, int num_ranges, sensor_db_row_fn_t fn, void *arg,
+                         sensor_db_query_stats_t *stats, int *stop) {
+    int result = SENSOR_DB_SUCCESS;
+    *stop = 0;
+    for (int i = 0; i < num_ranges; i++) {
+        if (ranges[i].status == SENSOR_DB_FAILURE) result = SENSOR_DB_FAILURE;
+        if (ranges[i].status == 1) *stop = 1;
+        add_stats(stats, &ranges[i].stats);
+        if (ranges[i].num_rows > 1) qsort(ranges[i].rows, ranges[i].num_rows, sizeof(sensor_data_t), compare_row_ts);
+    }
+    // Ranges that ran in the calling thread passed their rows to 'fn' already and collected none
+    if (result == SENSOR_DB_SUCCESS && *stop == 0) {
+        *stop = merge_ranges(ranges, num_ranges, fn, arg);
+        if (*stop == SENSOR_DB_FAILURE) result = SENSOR_DB_FAILURE;
+    }
+    for (int i = 0; i < num_ranges; i++) free(ranges[i].rows);
+    free(ranges);
+    return result;
+}
+
+int sensor_db_query(sensor_db_t *db, const sensor_db_predicate_t *pred, sensor_db_row_fn_t fn, void *arg,
+                    sensor_db_query_stats_t *stats) {
+    sensor_db_query_stats_t local_stats;
+    query_range_t *ranges;
+    int num_ranges, result = SENSOR_DB_SUCCESS;
+
+    if (db == NULL || pred == NULL || fn == NULL) return SENSOR_DB_FAILURE;
+    if (stats == NULL) stats = &local_stats;
+    memset(stats, 0, sizeof(*stats));
+
+    // Recent readings come from the hot tier, only the part of the range before its horizon from disk
+    sensor_data_t *hot_rows;
+    uint32_t num_hot_rows;
+    sensor_ts_t horizon;
+    if (hot_collect(db, pred, NULL, 0, &hot_rows, &num_hot_rows, &horizon, stats) != SENSOR_DB_SUCCESS) {
+        return SENSOR_DB_FAILURE;
+    }
+    sensor_db_predicate_t disk_pred = *pred;
+    if (horizon <= disk_pred.to) disk_pred.to = horizon - 1;
+
+    int stop = 0;
+    if (disk_pred.from <= disk_pred.to) {
+        query_range_t query = {.db = db, .pred = &disk_pred, .fn = fn, .arg = arg};
+        result = run_ranges(&query, 0, stats->blocks_total, &ranges, &num_ranges);
+        if (result == SENSOR_DB_SUCCESS) result = finish_ranges(ranges, num_ranges, fn, arg, stats, &stop);
+    }
+    if (result == SENSOR_DB_SUCCESS && stop == 0) emit_rows(hot_rows, num_hot_rows, fn, arg, stats);
+    free(hot_rows);
+    return result;
+}
+
+static int read_rollup(sensor_db_t *db, int level, uint64_t nr, sensor_db_rollup_record_t *record) {
+    off_t offset = (off_t)nr * sizeof(sensor_db_rollup_record_t);
+    return read_all_at(db->rollup_fds[level], record, sizeof(*record), offset) == 0 ? SENSOR_DB_SUCCESS : SENSOR_DB_FAILURE;
+}
+
+/**
+ * Merges the rollup records of 'sensor_id' in segments [0, num_segments) into 'result', for the parts of the plan that
+ * rollups answer. Needs no lock: table entries and records are never rewritten once the segment table counts them.
+ */
+static int aggregate_rollups(sensor_db_t *db, uint32_t num_segments, sensor_id_t sensor_id, const aggregate_plan_t *plan,
+                             sensor_db_aggregate_t *result, sensor_db_query_stats_t *stats) {
+    for (uint32_t nr = 0; nr < num_segments; nr++) {
+        sensor_db_segment_entry_t segment;
+        if (read_segment(db, nr, &segment) != SENSOR_DB_SUCCESS) return SENSOR_DB_FAILURE;
+        if (sensor_id < segment.min_id || sensor_id > segment.max_id) continue;
+        for (int i = 0; i < plan->num_parts; i++) {
+            const aggregate_part_t *part = &plan->parts[i];
+            if (part->level == ROLLUP_LEVELS || part->to < segment.min_ts || part->from > segment.max_ts) continue;
+
+            // Binary search for the first record at or after (sensor_id, part->from), the records are sorted on both
+            sensor_db_rollup_record_t record;
+            uint64_t low = segment.rollup_first[part->level], high = low + segment.rollup_count[part->level];
+            while (low < high) {
+                uint64_t mid = low + (high - low) / 2;
+                if (read_rollup(db, part->level, mid, &record) != SENSOR_DB_SUCCESS) return SENSOR_DB_FAILURE;
+                if (record.sensor_id < sensor_id || (record.sensor_id == sensor_id && record.bucket < part->from)) low = mid + 1;
+                else high = mid;
+            }
+            uint64_t end = segment.rollup_first[part->level] + segment.rollup_count[part->level];
+            for (; low < end; low++) {
+                if (read_rollup(db, part->level, low, &record) != SENSOR_DB_SUCCESS) return SENSOR_DB_FAILURE;
+                if (record.sensor_id != sensor_id || record.bucket > part->to) break;
+                aggregate_add(result, record.count, record.sum, record.min, record.max);
+                stats->rollup_rows++;
+            }
+        }
+    }
+    return SENSOR_DB_SUCCESS;
+}
+
+int sensor_db_query_room(sensor_db_t *db, room_id_t room_id, sensor_ts_t from, sensor_ts_t to,
+                         sensor_db_row_fn_t fn, void *arg, sensor_db_query_stats_t *stats) {
+    sensor_db_query_stats_t local_stats;
+    sensor_db_predicate_t pred;
+    block_sensor_t *pairs = NULL;
+    int num_pairs = 0, cap_pairs = 0;
+    unsigned int segment, first, room, sensor;
+    uint32_t blocks;
+    int result = SENSOR_DB_SUCCESS;
+
+    if (db == NULL || fn == NULL) return SENSOR_DB_FAILURE;
+    if (stats == NULL) stats = &local_stats;
+    memset(stats, 0, sizeof(*stats));
+    sensor_db_predicate_all(&pred);
+    pred.from = from;
+    pred.to = to;
+
+    // Recent readings of the sensors in the room come from the hot tier, only the older part of the range from disk
+    sensor_id_t *room_sensors = NULL;
+    int num_room_sensors = 0;
+    pthread_mutex_lock(&db->mutex);
+    if (db->room_map_size > 0) room_sensors = malloc(db->room_map_size * sizeof(sensor_id_t));
+    for (int i = 0; room_sensors != NULL && i < db->room_map_size; i++) {
+        if (db->room_map[i].room_id == room_id) room_sensors[num_room_sensors++] = db->room_map[i].sensor_id;
+    }
+    pthread_mutex_unlock(&db->mutex);
+    sensor_data_t *hot_rows = NULL;
+    uint32_t num_hot_rows = 0;
+    sensor_ts_t horizon = LONG_MAX;
+    if (num_room_sensors > 0) {
+        result = hot_collect(db, &pred, room_sensors, num_room_sensors, &hot_rows, &num_hot_rows, &horizon, stats);
+    }
+    if (result != SENSOR_DB_SUCCESS) {
+        free(room_sensors);
+        return result;
+    }
+    if (horizon <= pred.to) pred.to = horizon - 1;
+
+    // Collect the (block, sensor) pairs of the room from the room index, up to the lines of the last closed segment
+    pthread_mutex_lock(&db->mutex);
+    stats->blocks_total = db->num_blocks;
+    uint32_t rolled_blocks = db->segment_first_block;
+    long rooms_size = (long)db->rooms_size;
+    pthread_mutex_unlock(&db->mutex);
+    FILE *rooms = fopen(db->rooms_name, "r");
+    if (rooms != NULL) {
+        while (ftell(rooms) < rooms_size
+               && fscanf(rooms, "%u %u %u %u %" SCNx32, &segment, &first, &room, &sensor, &blocks) == 5) {
+            if (room != room_id) continue;
+            for (uint32_t bit = 0; bit < SENSOR_DB_SEGMENT_BLOCKS; bit++) {
+                if (!(blocks & (1u << bit))) continue;
+                if (num_pairs == cap_pairs) {
+                    cap_pairs = cap_pairs ? 2 * cap_pairs : 64;
+                    block_sensor_t *grown = realloc(pairs, cap_pairs * sizeof(block_sensor_t));
+                    if (grown == NULL) {
+                        result = SENSOR_DB_FAILURE;
+                        break;
+                    }
+                    pairs = grown;
+                }
+                pairs[num_pairs++] = (block_sensor_t){first + bit, (sensor_id_t)sensor};
+            }
+        }
+        fclose(rooms);
+    }
+    // The blocks after the high-water mark are not in the room index yet, the zone maps filter them on the sensors
+    for (uint32_t block_nr = rolled_blocks; block_nr < stats->blocks_total && result == SENSOR_DB_SUCCESS; block_nr++) {
+        for (int s = 0; s < num_room_sensors; s++) {
+            if (num_pairs == cap_pairs) {
+                cap_pairs = cap_pairs ? 2 * cap_pairs : 64;
+                block_sensor_t *grown = realloc(pairs, cap_pairs * sizeof(block_sensor_t));
+                if (grown == NULL) {
+                    result = SENSOR_DB_FAILURE;
+                    break;
+                }
+                pairs = grown;
+            }
+            pairs[num_pairs++] = (block_sensor_t){block_nr, room_sensors[s]};
+        }
+    }
+    free(room_sensors);
+
+    // Visit the blocks in file order, each block once with all sensors of the room it holds
+    int stop = 0;
+    if (num_pairs > 1) qsort(pairs, num_pairs, sizeof(block_sensor_t), compare_block_sensor);
+    if (result == SENSOR_DB_SUCCESS && num_pairs > 0 && pred.from <= pred.to) {
+        query_range_t query = {.db = db, .pred = &pred, .fn = fn, .arg = arg, .pairs = pairs, .num_pairs = num_pairs,
+                               .max_sensors = num_room_sensors + SENSOR_BLOCK_CAPACITY};
+        query_range_t *ranges;
+        int num_ranges;
+        result = run_ranges(&query, pairs[0].block, pairs[num_pairs - 1].block + 1, &ranges, &num_ranges);
+        if (result == SENSOR_DB_SUCCESS) result = finish_ranges(ranges, num_ranges, fn, arg, stats, &stop);
+    }
+    if (result == SENSOR_DB_SUCCESS && stop == 0) emit_rows(hot_rows, num_hot_rows, fn, arg, stats);
+    free(hot_rows);
+    free(pairs);
+    return result;
+}
+
+int sensor_db_aggregate(sensor_db_t *db, sensor_id_t sensor_id, sensor_ts_t from, sensor_ts_t to,
+                        sensor_db_aggregate_t *result, sensor_db_query_stats_t *stats) {
+    sensor_db_query_stats_t local_stats;
+    aggregate_plan_t plan = {.num_parts = 0};
+    int result_code = SENSOR_DB_SUCCESS;
+
+    if (db == NULL || result == NULL || from > to) return SENSOR_DB_FAILURE;
+    if (stats == NULL) stats = &local_stats;
+    memset(stats, 0, sizeof(*stats));
+    memset(result, 0, sizeof(*result));
+
+    // Recent readings come from the hot tier, only the part of the range before its horizon from disk
+    sensor_db_predicate_t hot_pred;
+    sensor_data_t *hot_rows;
+    uint32_t num_hot_rows;
+    sensor_ts_t horizon;
+    sensor_db_predicate_all(&hot_pred);
+    hot_pred.from = from;
+    hot_pred.to = to;
+    if (hot_collect(db, &hot_pred, &sensor_id, 1, &hot_rows, &num_hot_rows, &horizon, stats) != SENSOR_DB_SUCCESS) {
+        return SENSOR_DB_FAILURE;
+    }
+    for (uint32_t i = 0; i < num_hot_rows; i++) {
+        aggregate_add(result, 1, hot_rows[i].value, hot_rows[i].value, hot_rows[i].value);
+    }
+    free(hot_rows);
+    if (horizon <= to) to = horizon - 1;
+    if (from > to) return SENSOR_DB_SUCCESS;
+
+    // Snapshot of the high-water mark, the rollups before it are read without the lock while writers go on
+    pthread_mutex_lock(&db->mutex);
+    stats->blocks_total = db->num_blocks;
+    uint32_t num_blocks = db->num_blocks, rolled_blocks = db->segment_first_block, num_segments = db->num_segments;
+    pthread_mutex_unlock(&db->mutex);
+
+    // A database without rollups (written by an older gateway) is answered from the raw rows only
+    plan_aggregate(&plan, num_segments > 0 ? 0 : ROLLUP_LEVELS, from, to);
+    if (aggregate_rollups(db, num_segments, sensor_id, &plan, result, stats) != SENSOR_DB_SUCCESS) {
+        return SENSOR_DB_FAILURE;
+    }
+
+    // Raw rows: the edges finer than a minute in every block, the whole range in the blocks not rolled up yet
+    bool raw_edges = false;
+    for (int i = 0; i < plan.num_parts; i++) raw_edges = raw_edges || plan.parts[i].level == ROLLUP_LEVELS;
+    query_range_t query = {.db = db, .plan = &plan, .sensor_id = sensor_id, .from = from, .to = to,
+                           .rolled_blocks = rolled_blocks};
+    query_range_t *ranges;
+    int num_ranges;
+    if (run_ranges(&query, raw_edges ? 0 : rolled_blocks, num_blocks, &ranges, &num_ranges) != SENSOR_DB_SUCCESS) {
+        return SENSOR_DB_FAILURE;
+    }
+    for (int i = 0; i < num_ranges; i++) {
+        if (ranges[i].status == SENSOR_DB_FAILURE) result_code = SENSOR_DB_FAILURE;
+        aggregate_add(result, ranges[i].partial.count, ranges[i].partial.sum, ranges[i].partial.min, ranges[i].partial.max);
+        add_stats(stats, &ranges[i].stats);
+    }
+    free(ranges);
+    return result_code;
+}
+
+/**
+ * Loads the room map of the room index: a reopened database starts with it, so segments that are rolled up again on
+ * open keep their rooms, and a read-only handle finds the sensors of a room in the blocks after the high-water mark.
+ * sensor_db_load_room_map replaces it.
+ */
+static int load_room_index_map(sensor_db_t *db) {
+    unsigned int segment, first, room, sensor;
+    uint32_t blocks;
+    int capacity = 16, size = 0;
+
+    FILE *rooms = fopen(db->rooms_name, "r");
+    if (rooms == NULL) return SENSOR_DB_SUCCESS;
+    room_map_entry_t *map = malloc(capacity * sizeof(room_map_entry_t));
+    while (map != NULL && fscanf(rooms, "%u %u %u %u %" SCNx32, &segment, &first, &room, &sensor, &blocks) == 5) {
+        if (size == capacity) {
+            capacity *= 2;
+            room_map_entry_t *grown = realloc(map, capacity * sizeof(room_map_entry_t));
+            if (grown == NULL) free(map);
+            map = grown;
+            if (map == NULL) break;
+        }
+        map[size++] = (room_map_entry_t){sensor, room};
+    }
+    fclose(rooms);
+    if (map == NULL) return SENSOR_DB_FAILURE;
+
+    // One entry per sensor
+    qsort(map, size, sizeof(room_map_entry_t), compare_room_map);
+    int unique = 0;
+    for (int i = 0; i < size; i++) {
+        if (unique == 0 || map[unique - 1].sensor_id != map[i].sensor_id) map[unique++] = map[i];
+    }
+    db->room_map = map;
+    db->room_map_size = unique;
+    return SENSOR_DB_SUCCESS;
+}
+
+/**
+ * Reopens the blocks after the high-water mark as the open segment: after a crash they are written but not rolled up.
+ * Earlier segments among them (their table entry was lost as well) are rolled up and room indexed again.
+ */
+static int reopen_segment(sensor_db_t *db) {
+    uint32_t end_block = db->num_blocks;
+    query_range_t block = {.db = db};   // collects the rows of one block
+    sensor_db_predicate_t all;
+    int result = SENSOR_DB_SUCCESS;
+
+    sensor_db_predicate_all(&all);
+    for (db->num_blocks = db->segment_first_block; db->num_blocks < end_block && result == SENSOR_DB_SUCCESS;) {
+        sensor_db_index_entry_t entry;
+        if (read_entry(db, db->num_blocks, &entry) != SENSOR_DB_SUCCESS) {
+            result = SENSOR_DB_FAILURE;
+            break;
+        }
+        uint32_t block_in_segment = db->num_blocks - db->segment_first_block;
+        if (block_in_segment > 0 && (entry.segment != db->segment || block_in_segment == SENSOR_DB_SEGMENT_BLOCKS)) {
+            result = close_segment(db);
+            block_in_segment = 0;
+        }
+        db->segment = entry.segment;
+
+        // A block that fails its checksum is reported and left out of the rollups, as it is left out of every scan
+        block.num_rows = 0;
+        if (result == SENSOR_DB_SUCCESS) {
+            int status = scan_block(db, &entry, NULL, 0, &all, collect_row, &block, &block.stats);
+            if (status == SENSOR_DB_FAILURE || block.status != SENSOR_DB_SUCCESS) result = SENSOR_DB_FAILURE;
+        }
+        if (result == SENSOR_DB_SUCCESS) result = segment_reserve(db, block.num_rows);
+        for (uint32_t i = 0; i < block.num_rows && result == SENSOR_DB_SUCCESS; i++) {
+            result = segment_add(db, block.rows[i].id, block_in_segment);
+        }
+        if (result == SENSOR_DB_SUCCESS) {
+            memcpy(db->segment_rows + db->num_segment_rows, block.rows, block.num_rows * sizeof(sensor_data_t));
+            db->num_segment_rows += block.num_rows;
+            db->num_blocks++;
+        }
+    }
+    free(block.rows);
+    if (result == SENSOR_DB_SUCCESS && db->num_blocks - db->segment_first_block == SENSOR_DB_SEGMENT_BLOCKS) {
+        result = close_segment(db);
+    }
+    if (result != SENSOR_DB_SUCCESS) fprintf(stderr, "Unable to reopen the last segment of %s.\n", db->data_name);
+    return result;
+}
+
+int sensor_db_open(sensor_db_t **db, const char *filename, bool append) {
+    if (db == NULL || filename == NULL) return SENSOR_DB_FAILURE;
+
+    sensor_db_t *d = db_alloc(filename, false);
+    if (d == NULL) return SENSOR_DB_FAILURE;
+
+    int flags = O_RDWR | O_CREAT | (append ? O_APPEND : O_TRUNC);
+    d->data_fd = open(d->data_name, flags, 0644);
+    d->idx_fd = open(d->idx_name, flags, 0644);
+    // The segment table and the rollups are written at the offsets that the table covers, so never with O_APPEND
+    d->seg_fd = open(d->segments_name, O_RDWR | O_CREAT | (append ? 0 : O_TRUNC), 0644);
+    d->rooms_file = fopen(d->rooms_name, append ? "a" : "w");
+    bool rollups_ok = true;
+    for (int level = 0; level < ROLLUP_LEVELS; level++) {
+        d->rollup_fds[level] = open(d->rollup_names[level], O_RDWR | O_CREAT | (append ? 0 : O_TRUNC), 0644);
+        rollups_ok = rollups_ok && d->rollup_fds[level] >= 0;
+    }
+    if (d->data_fd < 0 || d->idx_fd < 0 || d->seg_fd < 0 || d->rooms_file == NULL || !rollups_ok) {
+        perror("Unable to open the database files");
+        db_release(d);
+        return SENSOR_DB_FAILURE;
+    }
+
+    struct stat st;
+    if (fstat(d->idx_fd, &st) == 0 && st.st_size == 0) {
+        // New (or emptied) database
+        bool emptied = ftruncate(d->data_fd, 0) == 0 && ftruncate(d->seg_fd, 0) == 0
+                       && ftruncate(fileno(d->rooms_file), 0) == 0;
+        for (int level = 0; level < ROLLUP_LEVELS; level++) emptied = emptied && ftruncate(d->rollup_fds[level], 0) == 0;
+        if (!emptied || write_all(d->idx_fd, IDX_MAGIC, sizeof(IDX_MAGIC)) != 0
+            || write_all_at(d->seg_fd, SEG_MAGIC, sizeof(SEG_MAGIC), 0) != 0) {
+            db_release(d);
+            return SENSOR_DB_FAILURE;
+        }
+    } else if (load_index(d) != SENSOR_DB_SUCCESS || load_room_index_map(d) != SENSOR_DB_SUCCESS
+               || load_segments(d) != SENSOR_DB_SUCCESS || reopen_segment(d) != SENSOR_DB_SUCCESS
+               || hot_set_floor(d) != SENSOR_DB_SUCCESS) {
+        db_release(d);
+        return SENSOR_DB_FAILURE;
+    }
+
+    *db = d;
+    return SENSOR_DB_SUCCESS;
+}
+
+int sensor_db_open_readonly(sensor_db_t **db, const char *filename) {
+    if (db == NULL || filename == NULL) return SENSOR_DB_FAILURE;
+
+    sensor_db_t *d = db_alloc(filename, true);
+    if (d == NULL) return SENSOR_DB_FAILURE;
+
+    d->data_fd = open(d->data_name, O_RDONLY);
+    d->idx_fd = open(d->idx_name, O_RDONLY);
+    d->seg_fd = open(d->segments_name, O_RDONLY);   // Missing in a database of an older gateway: no rollups
+    for (int level = 0; level < ROLLUP_LEVELS; level++) d->rollup_fds[level] = open(d->rollup_names[level], O_RDONLY);
+    if (d->data_fd < 0 || d->idx_fd < 0 || load_index(d) != SENSOR_DB_SUCCESS || load_segments(d) != SENSOR_DB_SUCCESS
+        || load_room_index_map(d) != SENSOR_DB_SUCCESS) {
+        if (d->data_fd < 0 || d->idx_fd < 0) perror("Unable to open the database files");
+        db_release(d);
+        return SENSOR_DB_FAILURE;
+    }
+
+    *db = d;
+    return SENSOR_DB_SUCCESS;
+}
+
+int sensor_db_close(sensor_db_t **db) {
+    if ((db == NULL) || (*db == NULL)) return SENSOR_DB_FAILURE;
+    int result = SENSOR_DB_SUCCESS;
+    if (!(*db)->readonly) {
+        pthread_mutex_lock(&(*db)->mutex);
+        result = close_segment(*db);
+        if ((*db)->durability != SENSOR_DB_SYNC_NONE && sync_files(*db) != SENSOR_DB_SUCCESS) result = SENSOR_DB_FAILURE;
+        pthread_mutex_unlock(&(*db)->mutex);
+    }
+    db_release(*db);
+    *db = NULL;
+    return result;
+}
@@ -0,0 +1,246 @@
+/**
+ * \author {AUTHOR}
+ */
+
+#ifndef _SENSOR_DB_H_
+#define _SENSOR_DB_H_
+
+#include <stdio.h>
+#include <stdbool.h>
+#include "config.h"
+#include "threadpool.h"
+
+#ifndef SENSOR_DB_SEGMENT_BLOCKS
+#define SENSOR_DB_SEGMENT_BLOCKS 16     // Blocks per segment, a segment is closed (and indexed) after this many blocks
+#endif
+
+#ifndef SENSOR_DB_HOT_SECONDS
+#define SENSOR_DB_HOT_SECONDS 3600     // Window of the hot tier: the readings of the last hour are kept in memory, 0 disables it
+#endif
+
+#ifndef SENSOR_DB_SYNC_INTERVAL_MS
+#define SENSOR_DB_SYNC_INTERVAL_MS 1000     // Default time between two syncs in SENSOR_DB_SYNC_PERIODIC mode
+#endif
+
+#define SENSOR_DB_FAILURE -1
+#define SENSOR_DB_SUCCESS 0
+
+/*
+ * Storage layout, for a database called 'name':
+ *  name         the readings as CSV rows "<id>,<value>,<ts>", written one block (one storage batch) at a time
+ *  name.idx     binary block index: the byte range, row count, segment, zone map (min/max of ts, value and
+ *               sensor id) and CRC32C checksum of every block in 'name'
+ *  name.rooms   room index, one line per (segment, room, sensor) that is appended when the segment closes:
+ *               "<segment> <first block> <room> <sensor> <bitmask of the blocks of the segment holding the sensor>"
+ *  name.minute  rollups, one binary record per (segment, sensor, bucket) with the count, sum, min and max of the
+ *  name.hour    readings, appended when the segment closes. The records of a segment are sorted on (sensor, bucket).
+ *  name.day
+ *  name.seg     segment table: per closed segment its blocks, zone map, rollup records and the end of its room lines,
+ *               appended after those. Its last entry is the high-water mark of the rollups and the room index.
+ * Rooms are resolved with the room map that is loaded when the segment closes, so queries never need room_sensor.map.
+ * Aggregates read the rollups up to a snapshot of the segment table, without blocking writers. After a crash the blocks
+ * after the high-water mark are reopened as the open segment, rollup records and room lines past it are cut off.
+ *
+ * A handle that writes also keeps a hot tier: per sensor, the readings of the last SENSOR_DB_HOT_SECONDS (counted back
+ * from the newest timestamp written) in memory. Queries on that handle take the recent part of their range from memory
+ * and only read blocks for the older part. Readings that leave the window are dropped, they are on disk already.
+ */
+
+typedef struct sensor_db sensor_db_t;
+
+/**
+ * How far a written block is guaranteed to be on disk when sensor_db_write_block returns
+ */
+typedef enum {
+    SENSOR_DB_SYNC_NONE,        /**< page cache only, the kernel writes it back whenever it likes (default) */
+    SENSOR_DB_SYNC_PERIODIC,    /**< page cache, fdatasync when the sync interval passed since the last one */
+    SENSOR_DB_SYNC_GROUP,       /**< fdatasync after every block (one storage batch is one group commit) */
+    SENSOR_DB_SYNC_DIRECT,      /**< O_DIRECT page aligned writes from an own buffer, bypassing the page cache, and
+                                     fdatasync after every block for the file size and the device cache */
+} sensor_db_durability_t;
+
+/**
+ * Latency of the fdatasync calls of a database, a sync covers the data file and the index
+ */
+typedef struct sensor_db_sync_stats {
+    uint32_t syncs;
+    uint64_t total_ns;
+    uint64_t max_ns;
+} sensor_db_sync_stats_t;
+
+/**
+ * Called for every row that matches a query, returning non-zero stops the query
+ */
+typedef int (*sensor_db_row_fn_t)(void *arg, const sensor_data_t *row);
+
+/**
+ * Counters describing the work done by one query
+ */
+typedef struct sensor_db_query_stats {
+    uint32_t blocks_total;      /**< blocks in the database */
+    uint32_t blocks_read;       /**< blocks that were read and parsed */
+    uint32_t rows_scanned;      /**< rows parsed in the blocks that were read */
+    uint32_t rows_matched;      /**< rows passed to the callback */
+    uint32_t rollup_rows;       /**< rollup records merged by an aggregate query */
+    uint32_t hot_rows;          /**< readings served from the hot tier */
+    uint32_t crc_errors;        /**< blocks skipped because their CRC32C checksum did not match */
+} sensor_db_query_stats_t;
+
+/**
+ * Conditions on the rows of a scan, all bounds are inclusive
+ * Blocks whose zone map doesn't overlap the predicate are skipped without being read.
+ */
+typedef struct sensor_db_predicate {
+    sensor_ts_t from;
+    sensor_ts_t to;
+    sensor_value_t min_value;
+    sensor_value_t max_value;
+    sensor_id_t min_id;
+    sensor_id_t max_id;
+} sensor_db_predicate_t;
+
+/**
+ * Result of an aggregate query, min and max are only valid if count > 0
+ */
+typedef struct sensor_db_aggregate {
+    uint32_t count;
+    double sum;
+    sensor_value_t min;
+    sensor_value_t max;
+} sensor_db_aggregate_t;
+
+/**
+ * Opens (creates) a database for writing
+ * \param db a double pointer to the database handle that needs to be initialized
+ * \param filename name of the CSV data file, the index files get an extra suffix
+ * \param append if true, new blocks are added after the existing ones (the blocks after the high-water mark are
+ *               reopened as the open segment), otherwise the database is emptied
+ * \return SENSOR_DB_SUCCESS on success and SENSOR_DB_FAILURE if an error occurred
+ */
+int sensor_db_open(sensor_db_t **db, const char *filename, bool append);
+
+/**
+ * Opens an existing database for queries only
+ * \param db a double pointer to the database handle that needs to be initialized
+ * \param filename name of the CSV data file
+ * \return SENSOR_DB_SUCCESS on success and SENSOR_DB_FAILURE if an error occurred
+ */
+int sensor_db_open_readonly(sensor_db_t **db, const char *filename);
+
+/**
+ * Loads (or reloads) the sensor-room mapping used to build the room index, lines hold '<room id> <sensor id>'
+ * The new mapping applies to the segment that is being written and all later segments
+ * \param db a pointer to the database that is used
+ * \param fp_sensor_map the opened room_sensor.map file
+ * \return SENSOR_DB_SUCCESS on success and SENSOR_DB_FAILURE if an error occurred
+ */
+int sensor_db_load_room_map(sensor_db_t *db, FILE *fp_sensor_map);
+
+/**
+ * Selects the durability mode of a database that is open for writing, the close of the database always syncs unless
+ * the mode is SENSOR_DB_SYNC_NONE
+ * \param db a pointer to the database that is used
+ * \param mode the durability mode
+ * \param sync_interval_ms the time between two syncs in SENSOR_DB_SYNC_PERIODIC mode, ignored by the other modes
+ * \return SENSOR_DB_SUCCESS on success and SENSOR_DB_FAILURE if an error occurred (e.g. the file system does not
+ *         support O_DIRECT), the mode is unchanged then
+ */
+int sensor_db_set_durability(sensor_db_t *db, sensor_db_durability_t mode, int sync_interval_ms);
+
+/**
+ * Returns the number and latency of the syncs done so far
+ * \param db a pointer to the database that is used
+ * \param stats filled in with the statistics
+ */
+void sensor_db_get_sync_stats(sensor_db_t *db, sensor_db_sync_stats_t *stats);
+
+/**
+ * SENSOR_DB_SYNC_PERIODIC: syncs the blocks written after the last sync once the sync interval passed. Writes only sync
+ * when they find the interval passed, so a writer that goes quiet calls this on a timer to bound how long its last
+ * blocks stay in the page cache. Does nothing in the other modes. Thread-safe.
+ * \param db a pointer to the database that is used
+ * \return SENSOR_DB_SUCCESS on success and SENSOR_DB_FAILURE if an error occurred
+ */
+int sensor_db_sync_due(sensor_db_t *db);
+
+/**
+ * Appends all readings of 'block' as one storage block and syncs it according to the durability mode. Thread-safe.
+ * \param db a pointer to the database that is used
+ * \param block the readings to store
+ * \return SENSOR_DB_SUCCESS on success and SENSOR_DB_FAILURE if an error occurred
+ */
+int sensor_db_write_block(sensor_db_t *db, const sensor_block_t *block);
+
+/**
+ * Calls 'fn' for every stored reading of a sensor in room 'room_id' with from <= ts <= to
+ * Only the blocks that hold a sensor of the room according to the room index are read, and the blocks after its
+ * high-water mark whose zone map has a sensor of the room. Blocks whose zone map has no timestamp in [from, to] are
+ * skipped. The rows from disk come in storage order, or in timestamp order if the handle has a query pool. Rows from
+ * the hot tier come last, in timestamp order.
+ * \param db a pointer to the database that is used
+ * \param room_id the room to look for
+ * \param from first timestamp of the range
+ * \param to last timestamp of the range
+ * \param fn called for every matching row
+ * \param arg passed to 'fn'
+ * \param stats if not NULL, filled in with the work done by the query
+ * \return SENSOR_DB_SUCCESS on success and SENSOR_DB_FAILURE if an error occurred
+ */
+int sensor_db_query_room(sensor_db_t *db, room_id_t room_id, sensor_ts_t from, sensor_ts_t to,
+                         sensor_db_row_fn_t fn, void *arg, sensor_db_query_stats_t *stats);
+
+/**
+ * Lets the scans of this handle (sensor_db_query, sensor_db_query_room and the raw part of sensor_db_aggregate) run in
+ * parallel on 'pool'. The blocks are split into ranges of SENSOR_DB_SEGMENT_BLOCKS blocks, one task per range. Aggregates
+ * are merged from the partial result of every range, rows are collected per range and merged on timestamp. A query
+ * waits for its own ranges only, so the pool can be shared with other work; started from a task of 'pool' it scans in
+ * the calling thread.
+ * \param db a pointer to the database that is used
+ * \param pool the pool to run the scans on, NULL to scan in the calling thread
+ */
+void sensor_db_set_query_pool(sensor_db_t *db, threadpool_t *pool);
+
+/**
+ * Sets a predicate that matches every row, callers narrow the fields they need
+ * \param pred the predicate to initialize
+ */
+void sensor_db_predicate_all(sensor_db_predicate_t *pred);
+
+/**
+ * Calls 'fn' for every stored reading that matches 'pred', including the blocks of the open segment
+ * The rows from disk come in storage order, or in timestamp order if the handle has a query pool. Rows from the hot tier
+ * are newer than all of them and come last, in timestamp order.
+ * \param db a pointer to the database that is used
+ * \param pred the conditions on the rows
+ * \param fn called for every matching row
+ * \param arg passed to 'fn'
+ * \param stats if not NULL, filled in with the work done by the query
+ * \return SENSOR_DB_SUCCESS on success and SENSOR_DB_FAILURE if an error occurred
+ */
+int sensor_db_query(sensor_db_t *db, const sensor_db_predicate_t *pred, sensor_db_row_fn_t fn, void *arg,
+                    sensor_db_query_stats_t *stats);
+
+/**
+ * Computes count, sum, min and max of the readings of 'sensor_id' with from <= ts <= to
+ * The range is split into whole days, hours and minutes that are answered from the rollups, only the edges that are
+ * not a whole minute and the blocks after the high-water mark of the rollups are read from the raw rows. The part of the
+ * range that is in the hot tier is aggregated from memory.
+ * \param db a pointer to the database that is used
+ * \param sensor_id the sensor to aggregate
+ * \param from first timestamp of the range
+ * \param to last timestamp of the range
+ * \param result filled in with the aggregate
+ * \param stats if not NULL, filled in with the work done by the query
+ * \return SENSOR_DB_SUCCESS on success and SENSOR_DB_FAILURE if an error occurred
+ */
+int sensor_db_aggregate(sensor_db_t *db, sensor_id_t sensor_id, sensor_ts_t from, sensor_ts_t to,
+                        sensor_db_aggregate_t *result, sensor_db_query_stats_t *stats);
+
+/**
+ * Closes the open segment and the files, all allocated resources are freed
+ * \param db a double pointer to the database that needs to be closed
+ * \return SENSOR_DB_SUCCESS on success and SENSOR_DB_FAILURE if an error occurred
+ */
+int sensor_db_close(sensor_db_t **db);
+
+#endif  //_SENSOR_DB_H_
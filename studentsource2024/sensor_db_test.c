@@ -0,0 +1,351 @@
+/**
+ * \author {AUTHOR}
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <sys/stat.h>
+#include <float.h>
+#include <limits.h>
+#include <math.h>
+#include <inttypes.h>
+#include "config.h"
+#include "sensor_db.h"
+#include "threadpool.h"
+
+#define TEST_DB "sensor_db_test.csv"
+#define CRASH_DB "sensor_db_crash.csv"
+#define TORN_DB "sensor_db_torn.csv"
+#define SYNC_DB "sensor_db_sync.csv"
+#define SYNC_INTERVAL_MS 100
+#define TORN_BLOCKS (SENSOR_DB_SEGMENT_BLOCKS + 5)     // A closed segment and an open one with the torn block
+#define CRASH_SENSORS 8
+#define CRASH_BLOCKS (2 * SENSOR_DB_SEGMENT_BLOCKS + 5)     // Two closed segments and an open one
+#define CRASH_BASE 1700000000L
+#define LATE_TS 4102444800L     // 2100-01-01, the early rows go back before 1970
+
+static const sensor_value_t extreme_values[] = {1e30, -DBL_MAX, DBL_MAX, INFINITY, -INFINITY, 0.005, -0.0};
+#define NUM_EXTREME (sizeof(extreme_values) / sizeof(extreme_values[0]))
+
+typedef struct check {
+    uint32_t rows;
+    uint32_t errors;
+} check_t;
+
+/**
+ * Fills a whole block with one value, ids run to the end of their range and timestamps are far apart
+ */
+static void fill_block(sensor_block_t *block, sensor_value_t value, uint32_t round) {
+    for (uint32_t i = 0; i < SENSOR_BLOCK_CAPACITY; i++) {
+        block->id[i] = (sensor_id_t)(UINT16_MAX - i);
+        block->value[i] = value;
+        block->ts[i] = i % 2 ? (sensor_ts_t)(LATE_TS + round) : -(sensor_ts_t)round;
+    }
+    block->count = SENSOR_BLOCK_CAPACITY;
+    block->has_room = false;
+}
+
+/**
+ * Every row has to come back as one of the extreme values, rounded to the 2 decimals the database stores
+ */
+static int check_row(void *arg, const sensor_data_t *row) {
+    check_t *check = arg;
+    uint32_t round = (uint32_t)(row->ts <= 0 ? -row->ts : row->ts - LATE_TS);
+    sensor_value_t expected = round < NUM_EXTREME ? extreme_values[round] : NAN;
+    if (expected == 0.005) expected = 0.01;     // %.2f rounds half away from zero for this one
+    if (expected == 0.0) expected = -0.0;
+    if (row->value != expected || row->id < UINT16_MAX - SENSOR_BLOCK_CAPACITY + 1) {
+        fprintf(stderr, "Unexpected row %" PRIu16 ",%g,%ld\n", row->id, row->value, (long)row->ts);
+        check->errors++;
+    }
+    check->rows++;
+    return 0;
+}
+
+static int query_all(sensor_db_t *db, const char *where) {
+    sensor_db_predicate_t all;
+    check_t check = {0, 0};
+
+    sensor_db_predicate_all(&all);
+    if (sensor_db_query(db, &all, check_row, &check, NULL) != SENSOR_DB_SUCCESS) {
+        fprintf(stderr, "FAIL: query of the %s failed\n", where);
+        return 1;
+    }
+    if (check.errors > 0 || check.rows != NUM_EXTREME * SENSOR_BLOCK_CAPACITY) {
+        fprintf(stderr, "FAIL: %s returned %" PRIu32 " rows, %" PRIu32 " wrong\n", where, check.rows, check.errors);
+        return 1;
+    }
+    printf("ok: %s returned all %" PRIu32 " rows\n", where, check.rows);
+    return 0;
+}
+
+/**
+ * Reading 'k' of the crash test: sensors 1..CRASH_SENSORS in turn, 7 seconds apart, values that %.2f keeps exactly
+ */
+static void crash_reading(uint32_t k, sensor_data_t *row) {
+    row->id = (sensor_id_t)(k % CRASH_SENSORS + 1);
+    row->value = (k % 50) / 4.0;
+    row->ts = CRASH_BASE + 7 * (sensor_ts_t)k;
+}
+
+static void write_crash_blocks(sensor_db_t *db, uint32_t first_block, uint32_t end_block) {
+    sensor_block_t block;
+    for (uint32_t b = first_block; b < end_block; b++) {
+        for (uint32_t i = 0; i < SENSOR_BLOCK_CAPACITY; i++) {
+            sensor_data_t row;
+            crash_reading(b * SENSOR_BLOCK_CAPACITY + i, &row);
+            block.id[i] = row.id;
+            block.value[i] = row.value;
+            block.ts[i] = row.ts;
+        }
+        block.count = SENSOR_BLOCK_CAPACITY;
+        block.has_room = false;
+        sensor_db_write_block(db, &block);
+    }
+}
+
+static int count_row(void *arg, const sensor_data_t *row) {
+    (void)row;
+    (*(uint32_t *)arg)++;
+    return 0;
+}
+
+/**
+ * Checks the aggregates of every sensor (over a range with edges that are not whole minutes) and the size of both rooms
+ * against the readings of blocks [0, num_blocks)
+ */
+static int check_crash_db(sensor_db_t *db, uint32_t num_blocks, const char *where) {
+    sensor_ts_t from = CRASH_BASE + 3601, to = CRASH_BASE + 7 * (sensor_ts_t)(num_blocks * SENSOR_BLOCK_CAPACITY) - 30;
+    uint32_t rollup_rows = 0, room_rows[2] = {0, 0};
+    int failed = 0;
+
+    for (sensor_id_t id = 1; id <= CRASH_SENSORS; id++) {
+        sensor_db_aggregate_t expected = {0, 0, 0, 0}, result;
+        sensor_db_query_stats_t stats;
+        for (uint32_t k = 0; k < num_blocks * SENSOR_BLOCK_CAPACITY; k++) {
+            sensor_data_t row;
+            crash_reading(k, &row);
+            if (row.id != id || row.ts < from || row.ts > to) continue;
+            if (expected.count == 0 || row.value < expected.min) expected.min = row.value;
+            if (expected.count == 0 || row.value > expected.max) expected.max = row.value;
+            expected.count++;
+            expected.sum += row.value;
+        }
+        if (sensor_db_aggregate(db, id, from, to, &result, &stats) != SENSOR_DB_SUCCESS
+            || result.count != expected.count || result.sum != expected.sum
+            || result.min != expected.min || result.max != expected.max) {
+            fprintf(stderr, "FAIL: %s: sensor %" PRIu16 " aggregates to %" PRIu32 " readings, sum %g instead of %"
+                    PRIu32 ", %g\n", where, id, result.count, result.sum, expected.count, expected.sum);
+            failed = 1;
+        }
+        rollup_rows += stats.rollup_rows;
+    }
+    for (room_id_t room = 1; room <= 2; room++) {
+        if (sensor_db_query_room(db, room, LONG_MIN, LONG_MAX, count_row, &room_rows[room - 1], NULL) != SENSOR_DB_SUCCESS
+            || room_rows[room - 1] != num_blocks * SENSOR_BLOCK_CAPACITY / 2) {
+            fprintf(stderr, "FAIL: %s: room %" PRIu16 " has %" PRIu32 " readings\n", where, room, room_rows[room - 1]);
+            failed = 1;
+        }
+    }
+    if (!failed) printf("ok: %s, %" PRIu32 " rollup records merged\n", where, rollup_rows);
+    return failed;
+}
+
+typedef struct pool_check {
+    sensor_db_t *db;
+    uint32_t num_blocks;
+    int failed;
+} pool_check_t;
+
+static void check_in_task(void *arg) {
+    pool_check_t *check = arg;
+    check->failed = check_crash_db(check->db, check->num_blocks, "queries from a task of the query pool");
+}
+
+/**
+ * Crashes a writer without closing its database and with the last entry of its segment table lost, then reads the
+ * database, reopens it to write more blocks and reads it again
+ */
+static int test_crash(void) {
+    char room_map[CRASH_SENSORS * 8] = "";
+    sensor_db_t *db;
+    int failed = 0;
+
+    for (int id = 1; id <= CRASH_SENSORS; id++) {
+        sprintf(room_map + strlen(room_map), "%d %d\n", id % 2 + 1, id);
+    }
+    pid_t pid = fork();
+    if (pid == 0) {
+        FILE *map = fmemopen(room_map, strlen(room_map), "r");
+        if (sensor_db_open(&db, CRASH_DB, false) != SENSOR_DB_SUCCESS || sensor_db_load_room_map(db, map) != SENSOR_DB_SUCCESS) {
+            _exit(EXIT_FAILURE);
+        }
+        write_crash_blocks(db, 0, CRASH_BLOCKS);
+        _exit(EXIT_SUCCESS);   // Without sensor_db_close
+    }
+    int status;
+    if (pid < 0 || waitpid(pid, &status, 0) != pid || !WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS) {
+        fprintf(stderr, "FAIL: crashing writer\n");
+        return 1;
+    }
+    struct stat st;
+    if (stat(CRASH_DB ".seg", &st) != 0 || truncate(CRASH_DB ".seg", st.st_size - 40) != 0) {  // Tear the last entry
+        perror("FAIL: tearing the segment table");
+        return 1;
+    }
+
+    if (sensor_db_open_readonly(&db, CRASH_DB) != SENSOR_DB_SUCCESS) return 1;
+    failed |= check_crash_db(db, CRASH_BLOCKS, "crashed database");
+    sensor_db_close(&db);
+
+    FILE *map = fmemopen(room_map, strlen(room_map), "r");
+    if (sensor_db_open(&db, CRASH_DB, true) != SENSOR_DB_SUCCESS || sensor_db_load_room_map(db, map) != SENSOR_DB_SUCCESS) {
+        fprintf(stderr, "FAIL: could not reopen %s\n", CRASH_DB);
+        return 1;
+    }
+    fclose(map);
+    failed |= check_crash_db(db, CRASH_BLOCKS, "reopened database");
+    write_crash_blocks(db, CRASH_BLOCKS, CRASH_BLOCKS + SENSOR_DB_SEGMENT_BLOCKS);
+    failed |= check_crash_db(db, CRASH_BLOCKS + SENSOR_DB_SEGMENT_BLOCKS, "database written after the crash");
+    if (sensor_db_close(&db) != SENSOR_DB_SUCCESS) return 1;
+
+    if (sensor_db_open_readonly(&db, CRASH_DB) != SENSOR_DB_SUCCESS) return 1;
+    failed |= check_crash_db(db, CRASH_BLOCKS + SENSOR_DB_SEGMENT_BLOCKS, "closed database");
+
+    // The same queries split over a query pool, and started from one of its tasks (which scans in that task)
+    threadpool_t *pool;
+    pool_check_t check = {db, CRASH_BLOCKS + SENSOR_DB_SEGMENT_BLOCKS, 1};
+    if (threadpool_init(&pool, 2) != THREADPOOL_SUCCESS) return 1;
+    sensor_db_set_query_pool(db, pool);
+    failed |= check_crash_db(db, CRASH_BLOCKS + SENSOR_DB_SEGMENT_BLOCKS, "closed database on a query pool");
+    threadpool_submit(pool, check_in_task, &check);
+    threadpool_wait(pool);
+    failed |= check.failed;
+    threadpool_free(&pool);
+    sensor_db_close(&db);
+    return failed;
+}
+
+/**
+ * Cuts a few bytes off the last entry of the block index, as a crash while it was written would, then reopens the
+ * database to append: the torn block is dropped and the blocks written after it must line up with their entries
+ */
+static int test_torn_index(void) {
+    char room_map[CRASH_SENSORS * 8] = "";
+    sensor_db_t *db;
+    struct stat st;
+    int failed = 0;
+
+    for (int id = 1; id <= CRASH_SENSORS; id++) {
+        sprintf(room_map + strlen(room_map), "%d %d\n", id % 2 + 1, id);
+    }
+    FILE *map = fmemopen(room_map, strlen(room_map), "r");
+    if (sensor_db_open(&db, TORN_DB, false) != SENSOR_DB_SUCCESS || sensor_db_load_room_map(db, map) != SENSOR_DB_SUCCESS) {
+        fprintf(stderr, "FAIL: could not create %s\n", TORN_DB);
+        return 1;
+    }
+    fclose(map);
+    write_crash_blocks(db, 0, TORN_BLOCKS);
+    if (sensor_db_close(&db) != SENSOR_DB_SUCCESS) return 1;
+    if (stat(TORN_DB ".idx", &st) != 0 || truncate(TORN_DB ".idx", st.st_size - 10) != 0) {
+        perror("FAIL: tearing the block index");
+        return 1;
+    }
+
+    map = fmemopen(room_map, strlen(room_map), "r");
+    if (sensor_db_open(&db, TORN_DB, true) != SENSOR_DB_SUCCESS || sensor_db_load_room_map(db, map) != SENSOR_DB_SUCCESS) {
+        fprintf(stderr, "FAIL: could not reopen %s\n", TORN_DB);
+        return 1;
+    }
+    fclose(map);
+    failed |= check_crash_db(db, TORN_BLOCKS - 1, "database with a torn index entry");
+    write_crash_blocks(db, TORN_BLOCKS - 1, 2 * TORN_BLOCKS);
+    failed |= check_crash_db(db, 2 * TORN_BLOCKS, "database written after a torn index entry");
+    if (sensor_db_close(&db) != SENSOR_DB_SUCCESS) return 1;
+
+    if (sensor_db_open_readonly(&db, TORN_DB) != SENSOR_DB_SUCCESS) return 1;
+    failed |= check_crash_db(db, 2 * TORN_BLOCKS, "closed database after a torn index entry");
+    sensor_db_close(&db);
+    return failed;
+}
+
+/**
+ * SENSOR_DB_SYNC_PERIODIC: a write within the sync interval stays unsynced until sensor_db_sync_due() finds the interval
+ * passed, which syncs only when something was written since the last sync
+ */
+static int test_periodic_sync(void) {
+    const uint32_t expected[] = {0, 0, 1, 1};
+    sensor_db_sync_stats_t sync_stats;
+    sensor_block_t block;
+    sensor_db_t *db;
+    int failed = 0;
+
+    if (sensor_db_open(&db, SYNC_DB, false) != SENSOR_DB_SUCCESS
+        || sensor_db_set_durability(db, SENSOR_DB_SYNC_PERIODIC, SYNC_INTERVAL_MS) != SENSOR_DB_SUCCESS) {
+        fprintf(stderr, "FAIL: could not create %s\n", SYNC_DB);
+        return 1;
+    }
+    fill_block(&block, 21.5, 0);
+    for (int step = 0; step < 4; step++) {
+        if (step == 0 && sensor_db_write_block(db, &block) != SENSOR_DB_SUCCESS) failed = 1;
+        if (step >= 2) usleep(SYNC_INTERVAL_MS * 1500);
+        if (step >= 1 && sensor_db_sync_due(db) != SENSOR_DB_SUCCESS) failed = 1;
+        sensor_db_get_sync_stats(db, &sync_stats);
+        if (sync_stats.syncs != expected[step]) {
+            fprintf(stderr, "FAIL: %" PRIu32 " periodic syncs after step %d, expected %" PRIu32 "\n", sync_stats.syncs,
+                    step, expected[step]);
+            failed = 1;
+        }
+    }
+    if (sensor_db_close(&db) != SENSOR_DB_SUCCESS) return 1;
+    if (!failed) printf("ok: a quiet periodic database synced once its interval passed\n");
+    return failed;
+}
+
+/**
+ * Writes full blocks of extreme values (huge, infinite, tiny and negative zero) and reads them back, from the open
+ * database and after a reopen. Build with a sanitizer to catch writes past the row buffer. Then checks the recovery of
+ * the rollups and the room index after a crash, and of the block index after a torn entry, and the periodic sync of a
+ * database that is no longer written.
+ */
+int main(void) {
+    sensor_db_t *db;
+    sensor_block_t block;
+    int failed = 0;
+
+    if (sensor_db_open(&db, TEST_DB, false) != SENSOR_DB_SUCCESS) {
+        fprintf(stderr, "FAIL: could not create %s\n", TEST_DB);
+        return EXIT_FAILURE;
+    }
+    for (uint32_t round = 0; round < NUM_EXTREME; round++) {
+        fill_block(&block, extreme_values[round], round);
+        if (sensor_db_write_block(db, &block) != SENSOR_DB_SUCCESS) {
+            fprintf(stderr, "FAIL: block of %g was not stored\n", extreme_values[round]);
+            failed = 1;
+        }
+    }
+    failed |= query_all(db, "open database");
+    if (sensor_db_close(&db) != SENSOR_DB_SUCCESS) {
+        fprintf(stderr, "FAIL: close\n");
+        return EXIT_FAILURE;
+    }
+
+    if (sensor_db_open_readonly(&db, TEST_DB) != SENSOR_DB_SUCCESS) {
+        fprintf(stderr, "FAIL: could not reopen %s\n", TEST_DB);
+        return EXIT_FAILURE;
+    }
+    failed |= query_all(db, "reopened database");
+    sensor_db_close(&db);
+
+    failed |= test_crash();
+    failed |= test_torn_index();
+    failed |= test_periodic_sync();
+
+    printf("%s\n", failed ? "FAILED" : "PASSED");
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -9,6 +9,9 @@
 #include <time.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/socket.h>
 #include "config.h"
 #include "lib/tcpsock.h"
 
@@ -49,12 +52,124 @@
 #define LOG_CLOSE(...) (void)0
 #endif
 
+// conditional compilation option to keep readings until the gateway acknowledges them as persisted
+// the gateway sends a cumulative "persisted up to <timestamp>" (a sensor_ts_t) after its storage commits;
+// when the connection breaks, the node reconnects and resends only the readings that were not acknowledged
+#ifdef ACK_MODE
+
+#define ACK_BUFFER_SIZE 1024    // unacknowledged readings kept, the oldest one is lost when it is full
+#define RECONNECT_DELAY 1       // seconds between two reconnect attempts
+
+static sensor_data_t unacked[ACK_BUFFER_SIZE];
+static int unacked_head = 0, unacked_count = 0;
+
+static void buffer_reading(const sensor_data_t *data) {
+    if (unacked_count == ACK_BUFFER_SIZE) {
+        printf("ack buffer full, reading at %ld can't be resent anymore\n", (long int) unacked[unacked_head].ts);
+        unacked_head = (unacked_head + 1) % ACK_BUFFER_SIZE;
+        unacked_count--;
+    }
+    unacked[(unacked_head + unacked_count) % ACK_BUFFER_SIZE] = *data;
+    unacked_count++;
+}
+
+/**
+ * Discards the readings covered by an ack
+ */
+static void handle_ack(sensor_ts_t up_to) {
+    while (unacked_count > 0 && unacked[unacked_head].ts <= up_to) {
+        unacked_head = (unacked_head + 1) % ACK_BUFFER_SIZE;
+        unacked_count--;
+    }
+}
+#endif
+
+// flow control: the gateway asks the node to slow down (and batch) or to pause when its queues fill up, see config.h
+#define FLOW_SLOW_FACTOR 4      // sleep time multiplier while slowed down
+#define FLOW_BATCH 8            // readings collected before they are sent while slowed down
+#define FLOW_PAUSE_POLL_MS 1000 // wait for the frame that ends a pause in steps of this many milliseconds
+
+static sensor_flow_t flow_level = SENSOR_FLOW_GO;
+static sensor_data_t batch[FLOW_BATCH];
+static int batch_count = 0;
+static unsigned char frame_bytes[sizeof(sensor_ts_t)];  // partially received frame from the gateway
+static int frame_received = 0;
+
+/**
+ * Reads the frames the gateway sent: acks discard the readings they cover, flow frames set the flow level
+ * \param timeout_ms how long to wait for the first byte, 0 only takes what arrived already
+ * \return 0, or -1 when the gateway closed the connection or it broke
+ */
+static int read_frames(tcpsock_t *client, int timeout_ms) {
+    struct pollfd pfd = {.events = POLLIN};
+    if (tcp_get_sd(client, &pfd.fd) != TCP_NO_ERROR) return -1;
+    if (timeout_ms > 0 && poll(&pfd, 1, timeout_ms) == 0) return 0;
+    for (;;) {
+        ssize_t got = recv(pfd.fd, frame_bytes + frame_received, sizeof(frame_bytes) - frame_received, MSG_DONTWAIT);
+        if (got == 0) return -1;
+        if (got < 0) return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR ? 0 : -1;
+        frame_received += got;
+        if (frame_received < (int) sizeof(frame_bytes)) continue;
+        frame_received = 0;
+
+        sensor_ts_t frame;
+        memcpy(&frame, frame_bytes, sizeof(frame));
+        if (frame < 0) {
+            sensor_flow_t level = SENSOR_FLOW_LEVEL(frame);
+            if (level <= SENSOR_FLOW_PAUSE) flow_level = level;
+        } else {
+#ifdef ACK_MODE
+            handle_ack(frame);
+#endif
+        }
+    }
+}
 #define INITIAL_TEMPERATURE    20
 #define TEMP_DEV        5    // max afwijking vorige temperatuur in 0.1 celsius
 
 
 void print_help(void);
 
+/**
+ * Sends one reading in the order the gateway expects: <sensor_id><temperature><timestamp>
+ * remark: don't send as a struct!
+ */
+static int send_reading(tcpsock_t *client, sensor_data_t *data) {
+    int bytes, result;
+    bytes = sizeof(data->id);
+    if ((result = tcp_send(client, (void *) &data->id, &bytes)) != TCP_NO_ERROR) return result;
+    bytes = sizeof(data->value);
+    if ((result = tcp_send(client, (void *) &data->value, &bytes)) != TCP_NO_ERROR) return result;
+    bytes = sizeof(data->ts);
+    return tcp_send(client, (void *) &data->ts, &bytes);
+}
+
+/**
+ * Sends the collected readings. In ACK_MODE a broken connection is reopened and everything the gateway did not
+ * acknowledge is resent, the batch included; without it the node gives up.
+ */
+static void send_batch(tcpsock_t **client, int server_port, char *server_ip) {
+    int k = 0;
+    while (k < batch_count && send_reading(*client, &batch[k]) == TCP_NO_ERROR) k++;
+    bool sent = k == batch_count;
+    batch_count = 0;
+    if (sent) return;
+#ifdef ACK_MODE
+    for (;;) {
+        tcp_close(client);
+        frame_received = 0;
+        flow_level = SENSOR_FLOW_GO;
+        while (tcp_active_open(client, server_port, server_ip) != TCP_NO_ERROR) sleep(RECONNECT_DELAY);
+        for (k = 0; k < unacked_count; k++) {
+            if (send_reading(*client, &unacked[(unacked_head + k) % ACK_BUFFER_SIZE]) != TCP_NO_ERROR) break;
+        }
+        if (k == unacked_count) return;
+    }
+#else
+    exit(EXIT_FAILURE);
+#endif
+}
+
 /**
  * For starting the sensor node 4 command line arguments are needed. These should be given in the order below
  * and can then be used through the argv[] variable
@@ -70,7 +185,7 @@ int main(int argc, char *argv[]) {
     int server_port;
     char server_ip[] = "000.000.000.000";
     tcpsock_t *client;
-    int i, bytes, sleep_time;
+    int i, sleep_time;
 
     LOG_OPEN();
 
@@ -92,20 +207,23 @@ int main(int argc, char *argv[]) {
     data.value = INITIAL_TEMPERATURE;
     i = LOOPS;
     while (i) {
+        if (read_frames(client, 0) != 0) flow_level = SENSOR_FLOW_GO;
+        while (flow_level == SENSOR_FLOW_PAUSE) {
+            // a closed connection ends the pause, sending then reconnects (ACK_MODE) or gives up
+            if (read_frames(client, FLOW_PAUSE_POLL_MS) != 0) flow_level = SENSOR_FLOW_GO;
+        }
         data.value = data.value + TEMP_DEV * ((drand48() - 0.5) / 10);
         time(&data.ts);
-        // send data to server in this order (!!): <sensor_id><temperature><timestamp>
-        // remark: don't send as a struct!
-        bytes = sizeof(data.id);
-        if (tcp_send(client, (void *) &data.id, &bytes) != TCP_NO_ERROR) exit(EXIT_FAILURE);
-        bytes = sizeof(data.value);
-        if (tcp_send(client, (void *) &data.value, &bytes) != TCP_NO_ERROR) exit(EXIT_FAILURE);
-        bytes = sizeof(data.ts);
-        if (tcp_send(client, (void *) &data.ts, &bytes) != TCP_NO_ERROR) exit(EXIT_FAILURE);
+#ifdef ACK_MODE
+        buffer_reading(&data);
+#endif
+        batch[batch_count++] = data;
+        if (flow_level == SENSOR_FLOW_GO || batch_count == FLOW_BATCH) send_batch(&client, server_port, server_ip);
         LOG_PRINTF(data.id, data.value, data.ts);
-        sleep(sleep_time);
+        sleep(flow_level == SENSOR_FLOW_SLOW ? sleep_time * FLOW_SLOW_FACTOR : sleep_time);
         UPDATE(i);
     }
+    if (batch_count > 0) send_batch(&client, server_port, server_ip);
 
     if (tcp_close(&client) != TCP_NO_ERROR) exit(EXIT_FAILURE);
 
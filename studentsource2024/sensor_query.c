@@ -0,0 +1,107 @@
+/**
+ * \author {AUTHOR}
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <limits.h>
+#include "config.h"
+#include "sensor_db.h"
+#include "threadpool.h"
+
+#ifndef QUERY_THREADS
+#define QUERY_THREADS 4     // Workers that scan block ranges in parallel, 1 scans in the main thread
+#endif
+
+void print_help(void);
+
+/**
+ * Prints one matching row in the same CSV format as the database
+ */
+static int print_row(void *arg, const sensor_data_t *row) {
+    (void)arg;
+    printf("%" PRIu16 ",%.2f,%ld\n", row->id, row->value, (long)row->ts);
+    return 0;
+}
+
+/**
+ * Offline query tool for the database written by the sensor gateway
+ *
+ * argv[1] = database (the CSV file of the gateway, e.g. sensor_data_out.csv)
+ * argv[2] = query type: 'room' (print the readings of a room), 'agg' (count/avg/min/max of one sensor) or
+ *           'min' (print the readings with a value of at least argv[3])
+ * argv[3] = room ID, sensor ID or value
+ * argv[4] = (optional) first timestamp of the range
+ * argv[5] = (optional) last timestamp of the range
+ */
+int main(int argc, char *argv[]) {
+    sensor_db_t *db;
+    threadpool_t *pool = NULL;
+    sensor_db_query_stats_t stats;
+    sensor_ts_t from = 0, to = LONG_MAX;
+
+    if ((argc != 4 && argc != 6)
+        || (strcmp(argv[2], "room") != 0 && strcmp(argv[2], "agg") != 0 && strcmp(argv[2], "min") != 0)) {
+        print_help();
+        exit(EXIT_SUCCESS);
+    }
+    int id = atoi(argv[3]);
+    if (argc == 6) {
+        from = atol(argv[4]);
+        to = atol(argv[5]);
+    }
+
+    if (sensor_db_open_readonly(&db, argv[1]) != SENSOR_DB_SUCCESS) exit(EXIT_FAILURE);
+    if (QUERY_THREADS > 1 && threadpool_init(&pool, QUERY_THREADS) == THREADPOOL_SUCCESS) {
+        sensor_db_set_query_pool(db, pool);
+    }
+
+    int status;
+    if (strcmp(argv[2], "agg") == 0) {
+        sensor_db_aggregate_t result;
+        status = sensor_db_aggregate(db, (sensor_id_t)id, from, to, &result, &stats);
+        if (status == SENSOR_DB_SUCCESS && result.count > 0) {
+            printf("sensor %d: %" PRIu32 " readings, avg %.2f, min %.2f, max %.2f\n",
+                   id, result.count, result.sum / result.count, result.min, result.max);
+        } else if (status == SENSOR_DB_SUCCESS) {
+            printf("sensor %d: no readings\n", id);
+        }
+    } else if (strcmp(argv[2], "min") == 0) {
+        sensor_db_predicate_t pred;
+        sensor_db_predicate_all(&pred);
+        pred.from = from;
+        pred.to = to;
+        pred.min_value = atof(argv[3]);
+        status = sensor_db_query(db, &pred, print_row, NULL, &stats);
+    } else {
+        status = sensor_db_query_room(db, (room_id_t)id, from, to, print_row, NULL, &stats);
+    }
+    if (status != SENSOR_DB_SUCCESS) {
+        fprintf(stderr, "Query failed.\n");
+        sensor_db_close(&db);
+        if (pool != NULL) threadpool_free(&pool);
+        exit(EXIT_FAILURE);
+    }
+    fprintf(stderr, "%" PRIu32 " rows matched, %" PRIu32 " rows scanned in %" PRIu32 " of %" PRIu32 " blocks, "
+            "%" PRIu32 " rollup rows\n",
+            stats.rows_matched, stats.rows_scanned, stats.blocks_read, stats.blocks_total, stats.rollup_rows);
+    if (stats.crc_errors > 0) fprintf(stderr, "%" PRIu32 " corrupt blocks skipped\n", stats.crc_errors);
+
+    sensor_db_close(&db);
+    if (pool != NULL) threadpool_free(&pool);
+    exit(EXIT_SUCCESS);
+}
+
+/**
+ * Helper method to print a message on how to use this application
+ */
+void print_help(void) {
+    printf("Use this program with the following command line options: \n");
+    printf("\t%-15s : the database written by the gateway (e.g. sensor_data_out.csv)\n", "\'database\'");
+    printf("\t%-15s : the query type, \'room\' returns the readings of a room, \'agg\' aggregates one sensor,\n", "\'query\'");
+    printf("\t%-15s   \'min\' returns the readings with at least the given value\n", "");
+    printf("\t%-15s : the room (room), sensor (agg) or value (min) to query\n", "\'argument\'");
+    printf("\t%-15s : (optional) first and last timestamp of the range\n", "\'from to\'");
+}
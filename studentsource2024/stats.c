@@ -0,0 +1,103 @@
+/**
+ * \author {AUTHOR}
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include "stats.h"
+
+_Thread_local stats_shard_t *stats_local = NULL;
+
+static _Atomic(stats_shard_t *) shards = NULL;      // Lock-free list of all registered shards, newest first
+
+static const char *counter_names[STATS_NUM_COUNTERS] = {
+    [STATS_READINGS] = "readings",
+    [STATS_BYTES] = "bytes",
+    [STATS_DUPLICATES] = "duplicates",
+    [STATS_ALERTS] = "alerts",
+    [STATS_STORED] = "stored",
+};
+
+static const char *histogram_names[STATS_NUM_HISTOGRAMS] = {
+    [STATS_BLOCK_SIZE] = "block size",
+    [STATS_STORE_NS] = "store ns",
+    [STATS_CHECK_NS] = "ingest to check ns",
+    [STATS_ALERT_NS] = "ingest to alert ns",
+};
+
+void stats_register_thread(void) {
+    if (stats_local != NULL) return;
+
+    stats_shard_t *shard = aligned_alloc(STATS_CACHE_LINE, sizeof(stats_shard_t));
+    if (shard == NULL) return;
+    memset(shard, 0, sizeof(stats_shard_t));
+
+    // Push on the list, the shard is complete before it becomes visible to readers
+    shard->next = atomic_load_explicit(&shards, memory_order_relaxed);
+    while (!atomic_compare_exchange_weak_explicit(&shards, &shard->next, shard,
+                                                  memory_order_release, memory_order_relaxed));
+    stats_local = shard;
+}
+
+uint64_t stats_get(stats_counter_t counter) {
+    uint64_t total = 0;
+    for (stats_shard_t *s = atomic_load_explicit(&shards, memory_order_acquire); s != NULL; s = s->next) {
+        total += atomic_load_explicit(&s->counters[counter], memory_order_relaxed);
+    }
+    return total;
+}
+
+uint64_t stats_get_histogram(stats_histogram_t histogram, uint64_t buckets[STATS_HIST_BUCKETS]) {
+    uint64_t total = 0;
+
+    memset(buckets, 0, STATS_HIST_BUCKETS * sizeof(uint64_t));
+    for (stats_shard_t *s = atomic_load_explicit(&shards, memory_order_acquire); s != NULL; s = s->next) {
+        for (int b = 0; b < STATS_HIST_BUCKETS; b++) {
+            uint64_t n = atomic_load_explicit(&s->histograms[histogram][b], memory_order_relaxed);
+            buckets[b] += n;
+            total += n;
+        }
+    }
+    return total;
+}
+
+/**
+ * Upper bound of the bucket that holds the value of rank 'rank' (0-based)
+ */
+static uint64_t bucket_bound(const uint64_t buckets[STATS_HIST_BUCKETS], uint64_t rank) {
+    uint64_t seen = 0;
+    for (int b = 0; b < STATS_HIST_BUCKETS; b++) {
+        seen += buckets[b];
+        if (seen > rank) return b == 64 ? UINT64_MAX : (UINT64_C(1) << b) - 1;
+    }
+    return UINT64_MAX;
+}
+
+void stats_print(FILE *out) {
+    uint64_t buckets[STATS_HIST_BUCKETS];
+
+    fprintf(out, "Stats:");
+    for (int c = 0; c < STATS_NUM_COUNTERS; c++) {
+        fprintf(out, " %s=%" PRIu64, counter_names[c], stats_get((stats_counter_t)c));
+    }
+    fprintf(out, "\n");
+
+    for (int h = 0; h < STATS_NUM_HISTOGRAMS; h++) {
+        uint64_t total = stats_get_histogram((stats_histogram_t)h, buckets);
+        if (total == 0) continue;
+        fprintf(out, "Stats: %s: %" PRIu64 " values, p50 <= %" PRIu64 ", p99 <= %" PRIu64 ", max <= %" PRIu64 "\n",
+                histogram_names[h], total, bucket_bound(buckets, total / 2), bucket_bound(buckets, total * 99 / 100),
+                bucket_bound(buckets, total - 1));
+    }
+}
+
+void stats_free(void) {
+    stats_shard_t *s = atomic_exchange(&shards, NULL);
+    while (s != NULL) {
+        stats_shard_t *next = s->next;
+        free(s);
+        s = next;
+    }
+    stats_local = NULL;
+}
@@ -0,0 +1,114 @@
+/**
+ * \author {AUTHOR}
+ */
+
+#ifndef _STATS_H_
+#define _STATS_H_
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdatomic.h>
+
+#define STATS_CACHE_LINE 64
+#define STATS_HIST_BUCKETS 65   // Bucket b counts the values that need b bits: 0, 1, 2-3, 4-7, ..., 2^63-2^64-1
+
+/*
+ * Gateway statistics without shared counters in the hot path: every thread owns a cache-line-aligned shard with
+ * all counters and histograms and is the only one that writes to it, so no two threads ever write the same cache
+ * line and an update is a plain load and store. A thread registers its shard on its first update (or earlier with
+ * stats_register_thread()); readers walk the list of shards and sum them lazily. Shards are never unlinked while
+ * the gateway runs, so the counts of threads that already stopped are kept.
+ */
+
+typedef enum {
+    STATS_READINGS,         /**< readings that entered the gateway */
+    STATS_BYTES,            /**< bytes of reading data that entered the gateway */
+    STATS_DUPLICATES,       /**< readings dropped as duplicates */
+    STATS_ALERTS,           /**< readings outside [SET_MIN_TEMP, SET_MAX_TEMP] */
+    STATS_STORED,           /**< readings written to the database */
+    STATS_NUM_COUNTERS
+} stats_counter_t;
+
+typedef enum {
+    STATS_BLOCK_SIZE,       /**< readings per block handed to a processing stage */
+    STATS_STORE_NS,         /**< time to write one storage batch to the database, in nanoseconds */
+    STATS_CHECK_NS,         /**< time from decoding a reading to its range check in the alert stage, every reading, in nanoseconds */
+    STATS_ALERT_NS,         /**< time from decoding a reading to its alert, only readings outside the range, in nanoseconds */
+    STATS_NUM_HISTOGRAMS
+} stats_histogram_t;
+
+/**
+ * the counters and histograms of one thread, only written by that thread
+ */
+typedef struct stats_shard {
+    _Alignas(STATS_CACHE_LINE) _Atomic uint64_t counters[STATS_NUM_COUNTERS];
+    _Atomic uint64_t histograms[STATS_NUM_HISTOGRAMS][STATS_HIST_BUCKETS];
+    struct stats_shard *next;   /**< next registered shard */
+} stats_shard_t;
+
+extern _Thread_local stats_shard_t *stats_local;   // shard of the current thread, NULL before registration
+
+/**
+ * Gives the calling thread its own shard, to be called at the start of a thread so the first update doesn't pay for
+ * the allocation. Calling it again is harmless. When the allocation fails the updates of the thread are not counted.
+ */
+void stats_register_thread(void);
+
+/**
+ * Adds 'n' to a counter of the calling thread
+ * \param counter the counter
+ * \param n the amount to add
+ */
+static inline void stats_add(stats_counter_t counter, uint64_t n) {
+    if (stats_local == NULL) {
+        stats_register_thread();
+        if (stats_local == NULL) return;
+    }
+    // Single writer: a relaxed load and store is enough, readers may just see the value a moment later
+    _Atomic uint64_t *c = &stats_local->counters[counter];
+    atomic_store_explicit(c, atomic_load_explicit(c, memory_order_relaxed) + n, memory_order_relaxed);
+}
+
+/**
+ * Counts 'value' in a histogram of the calling thread
+ * \param histogram the histogram
+ * \param value the value to count, it goes into the bucket of its bit length
+ */
+static inline void stats_record(stats_histogram_t histogram, uint64_t value) {
+    if (stats_local == NULL) {
+        stats_register_thread();
+        if (stats_local == NULL) return;
+    }
+    int bucket = value == 0 ? 0 : 64 - __builtin_clzll(value);
+    _Atomic uint64_t *c = &stats_local->histograms[histogram][bucket];
+    atomic_store_explicit(c, atomic_load_explicit(c, memory_order_relaxed) + 1, memory_order_relaxed);
+}
+
+/**
+ * Sums a counter over all threads, concurrent updates may or may not be included
+ * \param counter the counter
+ * \return the total
+ */
+uint64_t stats_get(stats_counter_t counter);
+
+/**
+ * Sums the buckets of a histogram over all threads
+ * \param histogram the histogram
+ * \param buckets filled in with the summed buckets
+ * \return the number of values counted
+ */
+uint64_t stats_get_histogram(stats_histogram_t histogram, uint64_t buckets[STATS_HIST_BUCKETS]);
+
+/**
+ * Prints every counter and, for every histogram that counted values, the upper bound of the bucket of the median,
+ * the 99th percentile and the maximum
+ * \param out the stream to print to
+ */
+void stats_print(FILE *out);
+
+/**
+ * Frees all shards, only allowed once every thread that updated statistics stopped (or never updates them again)
+ */
+void stats_free(void);
+
+#endif  //_STATS_H_
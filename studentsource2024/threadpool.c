@@ -0,0 +1,328 @@
+/**
+ * \author {AUTHOR}
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include "threadpool.h"
+
+#define DEQUE_INITIAL_CAPACITY 64
+
+/**
+ * a task waiting in one of the deques
+ */
+typedef struct threadpool_task {
+    threadpool_task_fn_t fn;    /**< the function to execute */
+    void *arg;                  /**< the argument of the function */
+} threadpool_task_t;
+
+/**
+ * a double ended queue owned by one worker, implemented as a growing ring buffer
+ * The owner pushes and pops at the bottom (LIFO, cache friendly), thieves take from the top (FIFO, oldest work)
+ */
+typedef struct threadpool_deque {
+    threadpool_task_t *tasks;   /**< ring buffer holding the tasks */
+    int capacity;               /**< number of slots in 'tasks' */
+    int top;                    /**< index of the oldest task */
+    int size;                   /**< number of tasks in the deque */
+    pthread_mutex_t mutex;      /**< protects this deque only, so workers rarely contend */
+} threadpool_deque_t;
+
+typedef struct threadpool_worker {
+    threadpool_t *pool;         /**< the pool this worker belongs to */
+    int index;                  /**< index of the worker in the pool */
+    pthread_t thread;           /**< the thread executing the worker loop */
+    threadpool_deque_t deque;   /**< the tasks owned by this worker */
+} threadpool_worker_t;
+
+/**
+ * a structure to keep track of the pool
+ */
+struct threadpool {
+    threadpool_worker_t *workers;   /**< array of 'num_workers' workers */
+    int num_workers;                /**< number of workers */
+    atomic_int queued;              /**< tasks sitting in a deque, used to decide whether a worker can sleep */
+    atomic_int pending;             /**< tasks submitted but not yet finished (queued + running) */
+    atomic_uint next_worker;        /**< round-robin cursor for submissions from outside the pool */
+    bool shutdown;                  /**< set when the workers have to stop, protected by 'mutex' */
+    pthread_mutex_t mutex;          /**< protects the sleeping/waking of workers and waiters */
+    pthread_cond_t work_available;  /**< signalled when a task is submitted or on shutdown */
+    pthread_cond_t all_done;        /**< signalled when 'pending' drops to zero */
+};
+
+// The worker running on the current thread, NULL for threads outside any pool
+static _Thread_local threadpool_worker_t *current_worker = NULL;
+
+static int deque_init(threadpool_deque_t *deque) {
+    deque->tasks = malloc(DEQUE_INITIAL_CAPACITY * sizeof(threadpool_task_t));
+    if (deque->tasks == NULL) return THREADPOOL_FAILURE;
+    deque->capacity = DEQUE_INITIAL_CAPACITY;
+    deque->top = 0;
+    deque->size = 0;
+    if (pthread_mutex_init(&deque->mutex, NULL) != 0) {
+        free(deque->tasks);
+        return THREADPOOL_FAILURE;
+    }
+    return THREADPOOL_SUCCESS;
+}
+
+static void deque_destroy(threadpool_deque_t *deque) {
+    pthread_mutex_destroy(&deque->mutex);
+    free(deque->tasks);
+    deque->tasks = NULL;
+}
+
+static int deque_push_bottom(threadpool_deque_t *deque, threadpool_task_t task) {
+    pthread_mutex_lock(&deque->mutex);
+    if (deque->size == deque->capacity) {
+        // Grow and unroll the ring so the oldest task ends up at index 0 again
+        threadpool_task_t *grown = malloc(2 * deque->capacity * sizeof(threadpool_task_t));
+        if (grown == NULL) {
+            pthread_mutex_unlock(&deque->mutex);
+            return THREADPOOL_FAILURE;
+        }
+        for (int i = 0; i < deque->size; i++) {
+            grown[i] = deque->tasks[(deque->top + i) % deque->capacity];
+        }
+        free(deque->tasks);
+        deque->tasks = grown;
+        deque->capacity *= 2;
+        deque->top = 0;
+    }
+    deque->tasks[(deque->top + deque->size) % deque->capacity] = task;
+    deque->size++;
+    pthread_mutex_unlock(&deque->mutex);
+    return THREADPOOL_SUCCESS;
+}
+
+static bool deque_pop_bottom(threadpool_deque_t *deque, threadpool_task_t *task) {
+    bool found = false;
+    pthread_mutex_lock(&deque->mutex);
+    if (deque->size > 0) {
+        deque->size--;
+        *task = deque->tasks[(deque->top + deque->size) % deque->capacity];
+        found = true;
+    }
+    pthread_mutex_unlock(&deque->mutex);
+    return found;
+}
+
+static bool deque_steal_top(threadpool_deque_t *deque, threadpool_task_t *task) {
+    bool found = false;
+    // Never block on a busy victim, just try the next one
+    if (pthread_mutex_trylock(&deque->mutex) != 0) return false;
+    if (deque->size > 0) {
+        *task = deque->tasks[deque->top];
+        deque->top = (deque->top + 1) % deque->capacity;
+        deque->size--;
+        found = true;
+    }
+    pthread_mutex_unlock(&deque->mutex);
+    return found;
+}
+
+/**
+ * Looks for work: first in the own deque, then in the deques of the other workers starting at the right neighbour
+ */
+static bool worker_find_task(threadpool_worker_t *worker, threadpool_task_t *task) {
+    threadpool_t *pool = worker->pool;
+
+    if (deque_pop_bottom(&worker->deque, task)) return true;
+
+    for (int i = 1; i < pool->num_workers; i++) {
+        threadpool_worker_t *victim = &pool->workers[(worker->index + i) % pool->num_workers];
+        if (deque_steal_top(&victim->deque, task)) return true;
+    }
+    return false;
+}
+
+static void *worker_thread(void *args) {
+    threadpool_worker_t *worker = (threadpool_worker_t *)args;
+    threadpool_t *pool = worker->pool;
+    threadpool_task_t task;
+
+    current_worker = worker;
+
+    while (true) {
+        if (worker_find_task(worker, &task)) {
+            atomic_fetch_sub(&pool->queued, 1);
+            task.fn(task.arg);
+
+            if (atomic_fetch_sub(&pool->pending, 1) == 1) {
+                pthread_mutex_lock(&pool->mutex);
+                pthread_cond_broadcast(&pool->all_done);
+                pthread_mutex_unlock(&pool->mutex);
+            }
+            continue;
+        }
+
+        // Nothing to run or steal: sleep until a submit or the shutdown wakes us up.
+        // 'queued' is re-checked under the mutex, the submitter signals under the same mutex, so no wakeup is lost.
+        pthread_mutex_lock(&pool->mutex);
+        while (atomic_load(&pool->queued) == 0 && !pool->shutdown) {
+            pthread_cond_wait(&pool->work_available, &pool->mutex);
+        }
+        if (pool->shutdown && atomic_load(&pool->queued) == 0) {
+            pthread_mutex_unlock(&pool->mutex);
+            break;
+        }
+        pthread_mutex_unlock(&pool->mutex);
+    }
+
+    current_worker = NULL;
+    pthread_exit(NULL);
+}
+
+int threadpool_init(threadpool_t **pool, int num_workers) {
+    if (pool == NULL || num_workers < 1) return THREADPOOL_FAILURE;
+
+    *pool = malloc(sizeof(threadpool_t));
+    if (*pool == NULL) return THREADPOOL_FAILURE;
+    threadpool_t *p = *pool;
+
+    p->workers = calloc(num_workers, sizeof(threadpool_worker_t));
+    if (p->workers == NULL) {
+        free(p);
+        *pool = NULL;
+        return THREADPOOL_FAILURE;
+    }
+    p->num_workers = num_workers;
+    atomic_init(&p->queued, 0);
+    atomic_init(&p->pending, 0);
+    atomic_init(&p->next_worker, 0);
+    p->shutdown = false;
+
+    if (pthread_mutex_init(&p->mutex, NULL) != 0) {
+        free(p->workers);
+        free(p);
+        *pool = NULL;
+        return THREADPOOL_FAILURE;
+    }
+    pthread_cond_init(&p->work_available, NULL);
+    pthread_cond_init(&p->all_done, NULL);
+
+    // All deques must exist before the first worker starts stealing
+    for (int i = 0; i < num_workers; i++) {
+        p->workers[i].pool = p;
+        p->workers[i].index = i;
+        if (deque_init(&p->workers[i].deque) != THREADPOOL_SUCCESS) {
+            while (--i >= 0) deque_destroy(&p->workers[i].deque);
+            pthread_cond_destroy(&p->all_done);
+            pthread_cond_destroy(&p->work_available);
+            pthread_mutex_destroy(&p->mutex);
+            free(p->workers);
+            free(p);
+            *pool = NULL;
+            return THREADPOOL_FAILURE;
+        }
+    }
+
+    for (int i = 0; i < num_workers; i++) {
+        if (pthread_create(&p->workers[i].thread, NULL, worker_thread, &p->workers[i]) != 0) {
+            fprintf(stderr, "Error: Could not start worker thread %d.\n", i);
+            // Stop the workers that did start, then release everything
+            pthread_mutex_lock(&p->mutex);
+            p->shutdown = true;
+            pthread_cond_broadcast(&p->work_available);
+            pthread_mutex_unlock(&p->mutex);
+            for (int j = 0; j < i; j++) pthread_join(p->workers[j].thread, NULL);
+            for (int j = 0; j < num_workers; j++) deque_destroy(&p->workers[j].deque);
+            pthread_cond_destroy(&p->all_done);
+            pthread_cond_destroy(&p->work_available);
+            pthread_mutex_destroy(&p->mutex);
+            free(p->workers);
+            free(p);
+            *pool = NULL;
+            return THREADPOOL_FAILURE;
+        }
+    }
+
+    return THREADPOOL_SUCCESS;
+}
+
+int threadpool_submit(threadpool_t *pool, threadpool_task_fn_t task, void *arg) {
+    threadpool_worker_t *target;
+
+    if (pool == NULL || task == NULL) return THREADPOOL_FAILURE;
+
+    // Tasks spawned by a task stay local to that worker, others are spread round-robin
+    if (current_worker != NULL && current_worker->pool == pool) {
+        target = current_worker;
+    } else {
+        target = &pool->workers[atomic_fetch_add(&pool->next_worker, 1) % pool->num_workers];
+    }
+
+    // Both counters go up before the task becomes visible: a thief that runs it right away decrements them after this,
+    // so they never drop below the real number of tasks and a waiter cannot see 'pending' at 0 too early.
+    // A worker that sees 'queued' before the push completes just looks once more instead of sleeping.
+    atomic_fetch_add(&pool->pending, 1);
+    atomic_fetch_add(&pool->queued, 1);
+    threadpool_task_t entry = {task, arg};
+    if (deque_push_bottom(&target->deque, entry) != THREADPOOL_SUCCESS) {
+        atomic_fetch_sub(&pool->queued, 1);
+        atomic_fetch_sub(&pool->pending, 1);
+        return THREADPOOL_FAILURE;
+    }
+
+    pthread_mutex_lock(&pool->mutex);
+    pthread_cond_signal(&pool->work_available);
+    pthread_mutex_unlock(&pool->mutex);
+
+    return THREADPOOL_SUCCESS;
+}
+
+int threadpool_wait(threadpool_t *pool) {
+    if (pool == NULL) return THREADPOOL_FAILURE;
+    // A worker waiting for the pool waits for its own task to finish as well, it would never return
+    if (current_worker != NULL && current_worker->pool == pool) {
+        fprintf(stderr, "Error: threadpool_wait called from a task of the same pool.\n");
+        return THREADPOOL_FAILURE;
+    }
+
+    pthread_mutex_lock(&pool->mutex);
+    while (atomic_load(&pool->pending) > 0) {
+        pthread_cond_wait(&pool->all_done, &pool->mutex);
+    }
+    pthread_mutex_unlock(&pool->mutex);
+
+    return THREADPOOL_SUCCESS;
+}
+
+int threadpool_in_worker(threadpool_t *pool) {
+    return pool != NULL && current_worker != NULL && current_worker->pool == pool;
+}
+
+int threadpool_pending(threadpool_t *pool) {
+    if (pool == NULL) return 0;
+    return atomic_load_explicit(&pool->pending, memory_order_relaxed);
+}
+
+int threadpool_free(threadpool_t **pool) {
+    if ((pool == NULL) || (*pool == NULL)) return THREADPOOL_FAILURE;
+    threadpool_t *p = *pool;
+
+    if (threadpool_wait(p) != THREADPOOL_SUCCESS) return THREADPOOL_FAILURE;
+
+    pthread_mutex_lock(&p->mutex);
+    p->shutdown = true;
+    pthread_cond_broadcast(&p->work_available);
+    pthread_mutex_unlock(&p->mutex);
+
+    for (int i = 0; i < p->num_workers; i++) {
+        pthread_join(p->workers[i].thread, NULL);
+    }
+
+    for (int i = 0; i < p->num_workers; i++) {
+        deque_destroy(&p->workers[i].deque);
+    }
+    pthread_cond_destroy(&p->all_done);
+    pthread_cond_destroy(&p->work_available);
+    pthread_mutex_destroy(&p->mutex);
+    free(p->workers);
+    free(p);
+    *pool = NULL;
+    return THREADPOOL_SUCCESS;
+}
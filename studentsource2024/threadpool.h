@@ -0,0 +1,68 @@
+/**
+ * \author {AUTHOR}
+ */
+
+#ifndef _THREADPOOL_H_
+#define _THREADPOOL_H_
+
+#define THREADPOOL_FAILURE -1
+#define THREADPOOL_SUCCESS 0
+
+typedef struct threadpool threadpool_t;
+
+/**
+ * A task is a function pointer together with the argument it will be called with
+ */
+typedef void (*threadpool_task_fn_t)(void *arg);
+
+/**
+ * Allocates and initializes a new work-stealing thread pool and starts its worker threads
+ * Every worker owns a deque of tasks; an idle worker steals the oldest task from the deque of another worker
+ * \param pool a double pointer to the pool that needs to be initialized
+ * \param num_workers the number of worker threads to start (must be at least 1)
+ * \return THREADPOOL_SUCCESS on success and THREADPOOL_FAILURE if an error occurred
+ */
+int threadpool_init(threadpool_t **pool, int num_workers);
+
+/**
+ * Submits a task to the pool. The call never blocks on the execution of the task.
+ * When called from inside a worker, the task is pushed on the deque of that worker, otherwise the deques are filled round-robin
+ * \param pool a pointer to the pool that is used
+ * \param task the function that will be executed by one of the workers
+ * \param arg the argument passed to 'task', ownership stays with the caller/task
+ * \return THREADPOOL_SUCCESS on success and THREADPOOL_FAILURE if an error occurred
+ */
+int threadpool_submit(threadpool_t *pool, threadpool_task_fn_t task, void *arg);
+
+/**
+ * Blocks until every task submitted so far (including tasks submitted by running tasks) has finished
+ * Must not be called from a task of the same pool, that would wait for itself: the call fails right away then.
+ * \param pool a pointer to the pool that is used
+ * \return THREADPOOL_SUCCESS on success and THREADPOOL_FAILURE if an error occurred
+ */
+int threadpool_wait(threadpool_t *pool);
+
+/**
+ * Tells whether the calling thread is a worker of 'pool', a task that waits for other tasks of its own pool can
+ * deadlock when all workers wait
+ * \param pool a pointer to the pool that is used
+ * \return 1 if the caller runs on a worker of 'pool', 0 otherwise
+ */
+int threadpool_in_worker(threadpool_t *pool);
+
+/**
+ * Returns the number of tasks that were submitted but did not finish yet (queued or running), a snapshot without locking
+ * \param pool a pointer to the pool that is used
+ * \return the number of unfinished tasks, 0 if 'pool' is NULL
+ */
+int threadpool_pending(threadpool_t *pool);
+
+/**
+ * Waits for all pending tasks, stops the worker threads and frees all allocated resources
+ * Like threadpool_wait it fails when called from a task of the same pool.
+ * \param pool a double pointer to the pool that needs to be freed
+ * \return THREADPOOL_SUCCESS on success and THREADPOOL_FAILURE if an error occurred
+ */
+int threadpool_free(threadpool_t **pool);
+
+#endif  //_THREADPOOL_H_
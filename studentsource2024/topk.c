@@ -0,0 +1,196 @@
+/**
+ * \author {AUTHOR}
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "topk.h"
+
+/**
+ * a Space-Saving counter
+ */
+typedef struct topk_counter {
+    uint16_t key;
+    uint32_t count;         /**< occurrences attributed to the key, including 'error' */
+    uint32_t error;         /**< count of the evicted key this counter took over */
+    uint32_t observed;      /**< occurrences really seen since the key got this counter */
+    double sum;             /**< sum of the values of the 'observed' occurrences */
+} topk_counter_t;
+
+/**
+ * the counters of one sub-window
+ */
+typedef struct topk_epoch {
+    long epoch;             /**< sub-window number (ts / epoch_length), -1 when unused */
+    int used;               /**< counters in use */
+    topk_counter_t *counters;
+} topk_epoch_t;
+
+struct topk {
+    int capacity;
+    int num_epochs;
+    sensor_ts_t epoch_length;
+    long current;           /**< newest sub-window number seen, -1 before the first update */
+    topk_epoch_t *epochs;   /**< ring of 'num_epochs' sub-windows, epoch e lives at index e % num_epochs */
+    topk_counter_t *merged; /**< scratch space to merge the sub-windows when a report is made */
+};
+
+static void epoch_reset(topk_epoch_t *epoch, long number) {
+    epoch->epoch = number;
+    epoch->used = 0;
+}
+
+/**
+ * Space-Saving update: an untracked key replaces the key with the smallest count and inherits that count as its error
+ */
+static void epoch_add(topk_epoch_t *epoch, int capacity, uint16_t key, sensor_value_t value) {
+    topk_counter_t *min = NULL;
+
+    for (int i = 0; i < epoch->used; i++) {
+        topk_counter_t *counter = &epoch->counters[i];
+        if (counter->key == key) {
+            counter->count++;
+            counter->observed++;
+            counter->sum += value;
+            return;
+        }
+        if (min == NULL || counter->count < min->count) min = counter;
+    }
+
+    if (epoch->used < capacity) {
+        topk_counter_t *counter = &epoch->counters[epoch->used++];
+        *counter = (topk_counter_t){key, 1, 0, 1, value};
+        return;
+    }
+
+    *min = (topk_counter_t){key, min->count + 1, min->count, 1, value};
+}
+
+int topk_init(topk_t **tracker, int capacity, int epochs, sensor_ts_t epoch_length) {
+    if (tracker == NULL || capacity < 1 || epochs < 1 || epoch_length < 1) return TOPK_FAILURE;
+
+    topk_t *t = malloc(sizeof(topk_t));
+    if (t == NULL) return TOPK_FAILURE;
+    t->capacity = capacity;
+    t->num_epochs = epochs;
+    t->epoch_length = epoch_length;
+    t->current = -1;
+    t->epochs = calloc(epochs, sizeof(topk_epoch_t));
+    // One block of counters for all sub-windows plus the scratch space for merging them
+    t->merged = malloc(2 * (size_t)epochs * capacity * sizeof(topk_counter_t));
+    if (t->epochs == NULL || t->merged == NULL) {
+        free(t->epochs);
+        free(t->merged);
+        free(t);
+        return TOPK_FAILURE;
+    }
+    for (int i = 0; i < epochs; i++) {
+        t->epochs[i].counters = t->merged + (size_t)(epochs + i) * capacity;
+        epoch_reset(&t->epochs[i], -1);
+    }
+
+    *tracker = t;
+    return TOPK_SUCCESS;
+}
+
+int topk_update(topk_t *tracker, const uint16_t *keys, const sensor_value_t *values, const sensor_ts_t *ts, uint32_t count) {
+    int advanced = 0;
+
+    if (tracker == NULL || keys == NULL || values == NULL || ts == NULL) return TOPK_FAILURE;
+
+    for (uint32_t i = 0; i < count; i++) {
+        long number = (long)(ts[i] / tracker->epoch_length);
+
+        if (number > tracker->current) {
+            if (tracker->current >= 0) {
+                long moved = number - tracker->current;
+                advanced += moved > tracker->num_epochs ? tracker->num_epochs : (int)moved;
+            }
+            tracker->current = number;
+        } else if (number <= tracker->current - tracker->num_epochs) {
+            continue; // Older than the window
+        }
+
+        topk_epoch_t *epoch = &tracker->epochs[number % tracker->num_epochs];
+        if (epoch->epoch != number) epoch_reset(epoch, number); // Slot still holds a sub-window that left the window
+        epoch_add(epoch, tracker->capacity, keys[i], values[i]);
+    }
+
+    return advanced;
+}
+
+/**
+ * Sums the counters of all sub-windows in the window per key into 'merged'
+ * \return the number of distinct keys
+ */
+static int merge_window(topk_t *tracker) {
+    int distinct = 0;
+
+    for (int e = 0; e < tracker->num_epochs; e++) {
+        topk_epoch_t *epoch = &tracker->epochs[e];
+        if (epoch->epoch < 0 || epoch->epoch <= tracker->current - tracker->num_epochs) continue;
+
+        for (int c = 0; c < epoch->used; c++) {
+            topk_counter_t *counter = &epoch->counters[c];
+            int m;
+            for (m = 0; m < distinct && tracker->merged[m].key != counter->key; m++);
+            if (m == distinct) {
+                tracker->merged[distinct++] = *counter;
+            } else {
+                tracker->merged[m].count += counter->count;
+                tracker->merged[m].error += counter->error;
+                tracker->merged[m].observed += counter->observed;
+                tracker->merged[m].sum += counter->sum;
+            }
+        }
+    }
+    return distinct;
+}
+
+static int compare_count(const void *x, const void *y) {
+    const topk_counter_t *a = x, *b = y;
+    if (a->count != b->count) return a->count < b->count ? 1 : -1;
+    return (int)a->key - (int)b->key;
+}
+
+static int compare_average(const void *x, const void *y) {
+    const topk_counter_t *a = x, *b = y;
+    double avg_a = a->sum / a->observed, avg_b = b->sum / b->observed;
+    if (avg_a != avg_b) return avg_a < avg_b ? 1 : -1;
+    return (int)a->key - (int)b->key;
+}
+
+static int report(topk_t *tracker, topk_entry_t *top, int n, int (*compare)(const void *, const void *)) {
+    if (tracker == NULL || top == NULL || n < 0) return TOPK_FAILURE;
+
+    int distinct = merge_window(tracker);
+    qsort(tracker->merged, distinct, sizeof(topk_counter_t), compare);
+
+    if (n > distinct) n = distinct;
+    for (int i = 0; i < n; i++) {
+        topk_counter_t *counter = &tracker->merged[i];
+        top[i].key = counter->key;
+        top[i].count = counter->count;
+        top[i].error = counter->error;
+        top[i].average = counter->sum / counter->observed;
+    }
+    return n;
+}
+
+int topk_top_by_count(topk_t *tracker, topk_entry_t *top, int n) {
+    return report(tracker, top, n, compare_count);
+}
+
+int topk_top_by_average(topk_t *tracker, topk_entry_t *top, int n) {
+    return report(tracker, top, n, compare_average);
+}
+
+int topk_free(topk_t **tracker) {
+    if ((tracker == NULL) || (*tracker == NULL)) return TOPK_FAILURE;
+    free((*tracker)->merged);
+    free((*tracker)->epochs);
+    free(*tracker);
+    *tracker = NULL;
+    return TOPK_SUCCESS;
+}
@@ -0,0 +1,75 @@
+/**
+ * \author {AUTHOR}
+ */
+
+#ifndef _TOPK_H_
+#define _TOPK_H_
+
+#include <stdio.h>
+#include "config.h"
+
+#define TOPK_FAILURE -1
+#define TOPK_SUCCESS 0
+
+typedef struct topk topk_t;
+
+/**
+ * one key of a top-K report
+ */
+typedef struct topk_entry {
+    uint16_t key;           /**< the tracked key (sensor id, room id, ...) */
+    uint32_t count;         /**< number of updates seen for the key in the window (may overestimate by at most 'error') */
+    uint32_t error;         /**< maximum overestimation of 'count' caused by evictions */
+    double average;         /**< average of the values of the updates that were attributed to the key */
+} topk_entry_t;
+
+/**
+ * Allocates a tracker of the most frequent keys over a sliding window, using the Space-Saving algorithm
+ * The window consists of 'epochs' sub-windows of 'epoch_length' seconds (of reading time, not wall clock time),
+ * every sub-window holds at most 'capacity' counters. Memory use is fixed: it does not depend on the number of keys.
+ * \param tracker a double pointer to the tracker that needs to be initialized
+ * \param capacity number of counters per sub-window, keys beyond this evict the least frequent key
+ * \param epochs number of sub-windows in the sliding window
+ * \param epoch_length length of one sub-window in seconds
+ * \return TOPK_SUCCESS on success and TOPK_FAILURE if an error occurred
+ */
+int topk_init(topk_t **tracker, int capacity, int epochs, sensor_ts_t epoch_length);
+
+/**
+ * Adds a batch of updates: update i counts one occurrence of keys[i] with value values[i] at time ts[i]
+ * The updates are expected in (roughly) increasing time, updates older than the window are ignored
+ * \param tracker a pointer to the tracker that is used
+ * \param keys the keys, one per update
+ * \param values the values, one per update, used for the per-key average
+ * \param ts the timestamps, one per update
+ * \param count the number of updates
+ * \return the number of sub-windows the window moved forward because of this batch, TOPK_FAILURE if an error occurred
+ */
+int topk_update(topk_t *tracker, const uint16_t *keys, const sensor_value_t *values, const sensor_ts_t *ts, uint32_t count);
+
+/**
+ * Fills 'top' with the (at most) 'n' keys seen most often in the window, the most frequent first
+ * \param tracker a pointer to the tracker that is used
+ * \param top pre-allocated array of at least 'n' entries
+ * \param n the maximum number of entries to return
+ * \return the number of entries filled in, TOPK_FAILURE if an error occurred
+ */
+int topk_top_by_count(topk_t *tracker, topk_entry_t *top, int n);
+
+/**
+ * Fills 'top' with the (at most) 'n' tracked keys with the highest average value in the window, the highest first
+ * \param tracker a pointer to the tracker that is used
+ * \param top pre-allocated array of at least 'n' entries
+ * \param n the maximum number of entries to return
+ * \return the number of entries filled in, TOPK_FAILURE if an error occurred
+ */
+int topk_top_by_average(topk_t *tracker, topk_entry_t *top, int n);
+
+/**
+ * All allocated resources are freed and cleaned up
+ * \param tracker a double pointer to the tracker that needs to be freed
+ * \return TOPK_SUCCESS on success and TOPK_FAILURE if an error occurred
+ */
+int topk_free(topk_t **tracker);
+
+#endif  //_TOPK_H_